@@ -35,14 +35,380 @@ public:
 	int32 Status;
 	TMultiMap<FString,FString> Headers;
 
-	TArray<FString> HeaderLines;
-	TArray<BYTE> ReceivedData; // EOH is an empty line!
-
 	HTTP_Response()
 		: Status(0) {}
 };
 
 
+//
+// Incremental response parser, works in place over a reusable receive buffer.
+// Header lines are consumed as soon as they're complete and a partial line
+// carries over to the next read, body bytes stay in the buffer until the
+// caller hands them to its file sink.
+//
+#define HTTP_RECV_BUFFER 65536
+
+enum EHTTPParseState
+{
+	HTTPPARSE_StatusLine,
+	HTTPPARSE_Headers,
+	HTTPPARSE_Body,
+	HTTPPARSE_Error,
+};
+
+class FHTTPParser
+{
+public:
+	TArray<uint8> Buffer;
+	int32 State;
+	int32 Start; //First unconsumed byte
+	int32 End;   //End of received data
+	int32 Scan;  //CRLF search resumes here
+
+	FHTTPParser()
+		: State(HTTPPARSE_StatusLine), Start(0), End(0), Scan(0) {}
+
+	void Reset();
+
+	// Receive into the buffer, returns nullptr if a header doesn't fit.
+	uint8* GetWriteBuffer();
+	int32 WriteSpace() const { return Buffer.Num() - End; }
+	void Commit( int32 Bytes) { End += Bytes; }
+
+	// Returns 1 once the end of header has been reached.
+	UBOOL ParseHeaders( HTTP_Response& Response, FOutputDevice* Log=nullptr);
+
+	uint8* BodyData() { return &Buffer(Start); }
+	int32 BodyBytes() const { return End - Start; }
+	void ConsumeBody( int32 Count);
+};
+
+
+//
+// Idle keep-alive connections, shared by all downloaders.
+//
+#define HTTP_POOL_MAX 8
+
+class FHTTPConnectionPool
+{
+public:
+	struct FIdleConnection
+	{
+		IPEndpoint Endpoint;
+		CSocket Socket;
+		double IdleSince;
+	};
+
+	volatile int32 Lock;
+	TArray<FIdleConnection> Idle;
+
+	FHTTPConnectionPool()
+		: Lock(0) {}
+
+	UBOOL Acquire( const IPEndpoint& Endpoint, CSocket& OutSocket, double IdleTimeout);
+	void Release( const IPEndpoint& Endpoint, CSocket& Socket);
+};
+
+extern FHTTPConnectionPool GHTTPConnectionPool;
+
+
+//
+// Validators of previously downloaded files, plus a local copy of each.
+// Requests for a known URL and package GUID become conditional and a
+// 304 response is served from the copy instead of the network.
+//
+struct FValidatorEntry
+{
+	FString URL; //Requested URL, before redirects
+	FGuid Guid;
+	FString ETag;
+	FString LastModified;
+	int32 Size;
+	int32 Compression; //Of the local copy
+
+	FValidatorEntry()
+		: Size(0), Compression(0) {}
+
+	UBOOL IsValid() const { return URL.Len() && (ETag.Len() || LastModified.Len()); }
+	void SetHeaders( HTTP_Request& Request) const;
+	void FromResponse( HTTP_Response& Response);
+};
+
+class FHTTPValidatorCache
+{
+public:
+	FString Directory;
+	int32 MaxSizeMB; //Of all local copies, 0 disables
+
+	FHTTPValidatorCache();
+
+	// Game thread.
+	void Update();
+
+	// Any thread.
+	UBOOL Find( const FString& URL, const FGuid& Guid, FValidatorEntry& Out);
+	UBOOL Restore( const FValidatorEntry& Entry, const TCHAR* Dest);
+	void Store( const FValidatorEntry& Entry, const TCHAR* Source);
+	void Remove( const FString& URL);
+
+private:
+	volatile int32 Lock;
+	UBOOL Loaded;
+	UBOOL Dirty;
+	TArray<FValidatorEntry> Index; //Least recently used first
+
+	FString IndexFilename() const;
+	FString CopyFilename( const FValidatorEntry& Entry) const;
+	int32 FindIndex( const FString& URL) const;
+	void RemoveIndex( int32 i);
+	void LoadIndex();
+	void SaveIndex();
+	void Trim();
+};
+
+FHTTPValidatorCache* GetHTTPValidatorCache();
+
+
+//
+// Per redirect knowledge carried across downloads: compression variants the
+// server doesn't have, and permanent redirects to follow before connecting.
+//
+struct FRedirectMemoEntry
+{
+	FString URL;     //Redirect base URL, or a single file's URL
+	int32 Found;     //Compression variants served, 1 << Compression
+	uint8 Misses[LZMA_COMPRESSION+1];  //Consecutive 404s per compression variant
+	uint8 Skipped[LZMA_COMPRESSION+1]; //Requests that stepped down since the last probe
+	FString MovedTo; //Permanent redirect target
+};
+
+class FHTTPRedirectMemo
+{
+public:
+	UBOOL bSave; //Keep in DownloadTemp for later sessions
+
+	FHTTPRedirectMemo();
+
+	// Game thread.
+	void Update();
+
+	// Any thread.
+	int32 PickCompression( const FDownloadURL& URL);
+	FString FindMove( const FDownloadURL& URL);
+	void Found( const FDownloadURL& URL);
+	void Missing( const FDownloadURL& URL);
+	void Moved( const FDownloadURL& From, const FString& To);
+
+private:
+	volatile int32 Lock;
+	UBOOL Loaded;
+	UBOOL Dirty;
+	TArray<FRedirectMemoEntry> Entries;
+
+	FRedirectMemoEntry* FindEntry( const FString& URL);
+	FRedirectMemoEntry& GetEntry( const FString& URL);
+	void Load();
+	void Save();
+};
+
+FHTTPRedirectMemo* GetHTTPRedirectMemo();
+
+
+//
+// Single libcurl engine for HTTPS, shared by all downloaders.
+// Transfers run concurrently on one thread through a multi handle, DNS
+// cache and TLS sessions are kept in a share handle across packages.
+//
+struct FCurlTransfer
+{
+	// Set by caller.
+	FString URL;
+	float Timeout;
+	int32 (*Receive)( FCurlTransfer* Transfer, const uint8* Data, int32 Count); //Return 0 to abort
+	void* Owner;
+	volatile int32 Cancelled; //Any thread, atomic, checked periodically even without data
+
+	// Set by engine.
+	void* Easy;
+	int32 Result; //CURLcode
+	int32 ResponseCode;
+	int32 ContentLength; //-1 until the first data arrives
+	volatile int32 Done;
+	FThreadEvent DoneEvent;
+
+	FCurlTransfer()
+		: Timeout(4.f), Receive(nullptr), Owner(nullptr), Cancelled(0), Easy(nullptr)
+		, Result(0), ResponseCode(0), ContentLength(-1), Done(0) {}
+};
+
+class FHTTPCurlEngine
+{
+public:
+	FHTTPCurlEngine();
+	~FHTTPCurlEngine();
+
+	// Game thread.
+	UBOOL Init();
+
+	// Any thread, blocks until the transfer ends.
+	int32 Perform( FCurlTransfer& Transfer);
+
+	// Module exit, aborts running transfers and stops the engine thread.
+	void Shutdown();
+
+	// Engine thread, returns false once the engine has shut down.
+	UBOOL Run();
+
+private:
+	CScopedLibrary* Library;
+	void* Multi;
+	void* Share;
+	CThread* Thread;
+	TArray<FCurlTransfer*> Active;
+	FThreadEvent Event; //Idle engine thread waits here
+
+	// Shared with callers.
+	volatile int32 Lock;
+	TArray<FCurlTransfer*> Pending;
+	int32 bExit;
+
+	void Wakeup();
+	static void Complete( FCurlTransfer* Transfer, int32 Result);
+};
+
+FHTTPCurlEngine* GetHTTPCurlEngine(); //Game thread, nullptr if libcurl is unavailable
+
+
+//
+// Fetches the packages the engine will ask for next while the current one downloads.
+// Files wait in DownloadTemp until the engine requests them, so the hand-over order
+// is still decided by the engine.
+//
+#define PREFETCH_MAX_THREADS 8
+
+enum EPrefetchState
+{
+	PREFETCH_None,
+	PREFETCH_Queued,
+	PREFETCH_Active,
+	PREFETCH_Done,
+	PREFETCH_Failed,
+};
+
+struct FPrefetchEntry
+{
+	FGuid Guid;
+	FDownloadURL URL;
+	FString Filename;
+	int32 State;
+	int32 Size;
+	int32 PackageSize;
+	double StartTime;
+	double EndTime;
+};
+
+class FHTTPPrefetcher
+{
+public:
+	struct FWorker
+	{
+		CThread* Thread;
+		volatile int32 Done;
+	};
+
+	UNetConnection* Connection;
+	FWorker Workers[PREFETCH_MAX_THREADS];
+	int32 MaxThreads;
+	double Timeout;
+	double KeepAliveTimeout;
+	UBOOL bDecompress;
+	FHTTPCurlEngine* CurlEngine; //HTTPS entries, set on the game thread
+
+	// Aggregate stats of the current batch.
+	int32 BatchPackages;
+	int32 BatchBytes;
+	double BatchStart;
+
+	// Shared with workers.
+	volatile int32 Lock;
+	TArray<FPrefetchEntry> Entries;
+	TArray<FString> Messages;
+
+	FHTTPPrefetcher();
+
+	// Game thread.
+	void Schedule( UNetConnection* InConnection, int32 FromIndex, const TCHAR* Params, UBOOL bCompression);
+	int32 Claim( const FGuid& Guid, FString& Filename, int32& Size, int32& Compression);
+	void Update();
+
+	// Worker threads.
+	UBOOL PopEntry( FPrefetchEntry& Entry);
+	void PushResult( const FPrefetchEntry& Entry);
+	UBOOL Fetch( FPrefetchEntry& Entry);
+	void Log( const TCHAR* Message);
+
+private:
+	int32 Request( FPrefetchEntry& Entry, FArchive*& Ar, FString& Location, FValidatorEntry& Validator);
+	int32 RequestCurl( FPrefetchEntry& Entry, FArchive*& Ar);
+	void Unpack( FPrefetchEntry& Entry);
+	void Cancel();
+	void StartWorkers();
+};
+
+FHTTPPrefetcher* GetHTTPPrefetcher();
+
+UBOOL DecompressDownload( const TCHAR* Source, const TCHAR* Dest, int32 ExpectedSize, FString& Error);
+
+//
+// Unpacks a .lzma download while it's being received (see LzmaStream.cpp).
+// The package size is checked as it's written, nothing past it is decoded.
+//
+class FLzmaStream
+{
+public:
+	FString Filename; //Unpacked package
+	FString Error;
+
+	FLzmaStream();
+	~FLzmaStream();
+
+	UBOOL Open( const TCHAR* InFilename, int32 InExpectedSize);
+	UBOOL Write( const uint8* Data, int32 Count);
+	UBOOL Finish();
+
+private:
+	void* Decoder; //CLzmaDec
+	FArchive* Writer;
+	uint8 Header[13];
+	int32 HeaderSize;
+	int32 ExpectedSize;
+	int32 Written;
+};
+
+//
+// Work left once a download has been received: unpacking and the validator copy.
+// Runs on the worker without the downloader, results are handed back under GlobalLock.
+//
+struct FHTTPFinishJob
+{
+	FString Source;            //Received file
+	FString Dest;              //Unpacked package
+	FString PackageName;
+	int32 PackageSize;         //Unpacked size, 0 if there's nothing to unpack
+	FValidatorEntry Validator; //Stored if valid
+
+	// Results.
+	UBOOL bStreamed;           //Unpacked while receiving
+	UBOOL bDecompressed;
+	double Seconds;
+	FString Error;
+
+	FHTTPFinishJob() : PackageSize(0), bStreamed(0), bDecompressed(0), Seconds(0) {}
+	void Run();
+	void Discard(); //Downloader is gone
+};
+
+
 //
 // Simple asynchronous HTTP_Downloader
 //
@@ -54,16 +420,31 @@ public:
 	FStringNoInit ProxyServerHost;
 	int32         ProxyServerPort;
 	float         DownloadTimeout;
+	float         KeepAliveTimeout;
+	int32         ConcurrentDownloads;
+	UBOOL         DecompressDownloads;
+	int32         ValidatorCacheMB;
+	UBOOL         SaveRedirectMemo;
 
 	FDownloadURL DownloadURL;
 	FDownloadURL CurrentURL; //Does not use RequestedPackage/Compression fields
 	HTTP_Request Request;
 	HTTP_Response Response;
+	FHTTPParser Parser;
 	CSocket Socket;
 	IPEndpoint RemoteEndpoint;
 	volatile int32 LogLock;
 	FOutputDeviceAsyncStorage SavedLogs;
-	CScopedLibrary* CURL_Library;
+	UBOOL KeepAlive; //Connection can be reused after this response
+	int32 PrefetchState;
+	int32 ResumeFrom; //Size of partial file being resumed with a Range request
+	FValidatorEntry Validator; //Local copy this request is conditional on
+	FLzmaStream* LzmaStream; //Unpacking .lzma as it arrives
+	double StartTime;
+	int32 NetBytes; //Received over the network, for throughput metrics
+	volatile int32 WorkerBusy; //Workers using this downloader without GlobalLock, atomic
+	volatile int32 Cancelled;  //Set by Destroy under GlobalLock, atomic
+	FCurlTransfer* CurlTransfer; //Running HTTPS transfer, under GlobalLock
 
 public:
 	void StaticConstructor();
@@ -80,9 +461,26 @@ public:
 
 private:
 	void UpdateCurrentURL( const TCHAR* RelativeURI);
+	void DetectCompression( const BYTE* Data, INT Count);
+	FString DownloadTempName() const;
+	void PrepareResume();
+	void SaveResumeValidator();
+	UBOOL StartResume();
+	void PrepareConditional();
+	void UseLocalFile( const FString& Filename, int32 Size, int32 Compression);
+	void StartLzmaStream( const TCHAR* Partial=nullptr);
+	void FeedLzmaStream( const BYTE* Data, INT Count);
+	int32 ClaimPrefetch();
 
+	UBOOL AsyncBeginWork();
+	void AsyncEndWork();
+	UBOOL AsyncRestoreValidated();
+	UBOOL AsyncPrepareFinish( FHTTPFinishJob& Job);
+	void AsyncApplyFinish( const FHTTPFinishJob& Job);
 	bool AsyncReceive();
+	bool AsyncProcess( bool bShutdown);
 	bool AsyncLocalBind();
+	static int32 CurlReceive( FCurlTransfer* Transfer, const uint8* Data, int32 Count);
 };
 
 
@@ -0,0 +1,83 @@
+/*=============================================================================
+	XC_CompressCache.h
+	Author: Fernando Velazquez
+
+	Server side .uz/.lzma redirect cache, filled by worker threads.
+=============================================================================*/
+
+#ifndef XC_COMPRESSCACHE_H
+#define XC_COMPRESSCACHE_H
+
+#define COMPRESS_VARIANT_UZ    (1 << UZ_COMPRESSION)
+#define COMPRESS_VARIANT_LZMA  (1 << LZMA_COMPRESSION)
+#define COMPRESS_VARIANT_ALL   (COMPRESS_VARIANT_UZ | COMPRESS_VARIANT_LZMA)
+#define COMPRESS_MAX_THREADS   8
+
+//
+// Manifest entry, a compressed file is only valid for the package GUID it was made from.
+//
+struct FCompressEntry
+{
+	FGuid Guid;
+	FString Filename;
+	int32 Variants;
+};
+
+//
+// Compression job, Variants holds the requested variants and later the ones that succeeded.
+//
+struct FCompressJob
+{
+	FGuid Guid;
+	FString Source;
+	FString Filename;
+	int32 Variants;
+};
+
+class FCompressCache
+{
+public:
+	struct FWorker
+	{
+		CThread* Thread;
+		volatile int32 Done;
+	};
+
+	FString Directory;
+	int32 MaxThreads;
+	TArray<FCompressEntry> Manifest;
+	TArray<FString> InProgress; //Once per queued variant
+	FWorker Workers[COMPRESS_MAX_THREADS];
+	uint32 FilesCompressed;
+	uint32 FilesFailed;
+
+	// Shared with workers.
+	volatile int32 Lock;
+	TArray<FCompressJob> Pending;
+	TArray<FCompressJob> Completed;
+
+	FCompressCache( const TCHAR* InDirectory, int32 InMaxThreads);
+
+	// Game thread.
+	void Scan( UPackageMap* Map);
+	void Update();
+
+	// Worker threads.
+	UBOOL PopJob( FCompressJob& Job, UBOOL bTakeUz);
+	void PushResult( const FCompressJob& Job);
+	int32 CompressPackage( const FCompressJob& Job);
+
+private:
+	FString ManifestFilename() const;
+	FString VariantFilename( const FString& Filename, int32 Compression) const;
+	void LoadManifest();
+	void SaveManifest();
+	FCompressEntry* FindEntry( const FString& Filename);
+	void DeleteVariants( const FString& Filename, int32 Variants);
+	int32 FindForeignVariants( const FString& Filename);
+	void StartWorkers();
+};
+
+FCompressCache* GetCompressCache( const TCHAR* Directory, int32 MaxThreads);
+
+#endif
@@ -36,6 +36,7 @@ public:
 	FString String() const;
 	FString StringGet() const; //Must contain trailing '/'
 	FString StringHost( UBOOL bNoPort=0 ) const;
+	void Redirect( const TCHAR* RelativeURI);
 
 	static const TCHAR* GetCompressedExt( int32 Compression);
 
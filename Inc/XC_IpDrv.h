@@ -37,6 +37,7 @@ class FResolveInfo : public CThread
 public:
 	// Variables.
 	IPAddress Addr;
+	IPAddress AltAddr; //Other address family, Any if unavailable
 	TCHAR Error[256];
 	ANSICHAR HostName[256];
 
@@ -54,8 +55,26 @@ public:
 
 TArray<IPAddress> GetLocalBindAddress( FOutputDevice& Out);
 TArray<IPAddress> GetLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll);
+uint32 GetLocalAddressSerial(); //Changes when local addresses change
+UBOOL IsLocalAddress( const IPAddress& Address); //Still assigned to an interface
+UBOOL SetDualStack( CSocket& Socket); //IPv6 socket also takes IPv4 traffic
+UBOOL IsIPv4Address( const IPAddress& Address); //Includes IPv4-mapped
+void NormalizeEndpoint( IPEndpoint& Endpoint); //::ffff:1.2.3.4 -> 1.2.3.4
+UBOOL SocketReaches( CSocket& Socket, UBOOL bIPv4); //Socket can send to this family
+UBOOL WaitReadable( TArray<CSocket>& Sockets, double Seconds, uint32& WriteMask); //Any socket has data or room to send
+FString UnmappedAddress( const ANSICHAR* Address); //::ffff:1.2.3.4 -> 1.2.3.4
+UBOOL ExecHTTPBenchmark( const TCHAR* Cmd, FOutputDevice& Ar);
+UBOOL ParseGuid( const TCHAR* Str, FGuid& Guid); //32 hex digits, as written by FGuid::String
+TCHAR* ParseLine( TCHAR*& Pos); //Terminates the next non empty line in place, nullptr at the end
+int32 ParseTabFields( TCHAR* Line, TCHAR** Fields, int32 MaxFields); //Splits a line in place
 
 #include "XC_DownloadURL.h"
+#include "XC_CompressCache.h"
+#include "XC_LZ4.h"
+#include "XC_NetMetrics.h"
+#include "XC_Trace.h"
+#include "XC_ThreadEvent.h"
+#include "XC_XDP.h"
 #include "XC_IpDrvClasses.h"
 #include "XC_TcpNetDriver.h"
 
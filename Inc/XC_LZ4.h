@@ -0,0 +1,24 @@
+/*=============================================================================
+	XC_LZ4.h
+	Author: Fernando Velazquez
+
+	Minimal LZ4 block format codec for small network packets.
+=============================================================================*/
+
+#ifndef XC_LZ4_H
+#define XC_LZ4_H
+
+//
+// Compresses a single LZ4 block (no frame header).
+// Returns the compressed size, or 0 if the result doesn't fit in DstCapacity.
+// Input is limited to 64kb, which is plenty for a datagram.
+//
+int32 LZ4_CompressBlock( const uint8* Src, int32 SrcSize, uint8* Dst, int32 DstCapacity);
+
+//
+// Decompresses a single LZ4 block.
+// Returns the decompressed size, or -1 if the block is malformed or doesn't fit.
+//
+int32 LZ4_DecompressBlock( const uint8* Src, int32 SrcSize, uint8* Dst, int32 DstCapacity);
+
+#endif
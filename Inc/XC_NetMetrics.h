@@ -0,0 +1,69 @@
+/*=============================================================================
+	XC_NetMetrics.h
+	Author: Fernando Velazquez
+
+	Process-wide counters for the net driver and downloader, served
+	in Prometheus text format by a localhost-only listener thread.
+=============================================================================*/
+
+#ifndef XC_NETMETRICS_H
+#define XC_NETMETRICS_H
+
+#define METRICS_DISPATCH_BUCKETS 9
+#define METRICS_DOWNLOAD_RATE_BUCKETS 8
+#define METRICS_DOWNLOAD_TIME_BUCKETS 8
+
+//
+// Counters are written without atomics from the game and download threads,
+// a lost increment here and there is acceptable for monitoring purposes.
+// They are 64 bit so a long running server doesn't wrap them.
+//
+struct FNetMetrics
+{
+	// Net driver.
+	uint64 BytesSent;
+	uint64 BytesRecv;
+	uint64 PacketsSent;
+	uint64 PacketsRecv;
+	uint64 SendFailures;
+	uint64 SendQueued;
+	uint64 SendQueueDrops;
+	uint64 PortUnreach;
+	uint64 ConnectionsAccepted;
+	uint64 AcceptRejected;
+	int32  Connections;     //Sum over the drivers
+	uint64 BandwidthIncreases;
+	uint64 BandwidthDecreases;
+
+	// TickDispatch time histogram.
+	uint64 DispatchBuckets[METRICS_DISPATCH_BUCKETS];
+	uint64 DispatchCount;
+	double DispatchSeconds;
+
+	// Local address registry.
+	uint64 ResolverCacheHits;
+	uint64 ResolverCacheMisses;
+
+	// HTTP downloader.
+	uint64 DownloadsStarted;
+	uint64 DownloadsCompleted;
+	uint64 DownloadsFailed;
+	uint64 DownloadBytes;
+
+	// Finished download throughput (bytes/s) and duration histograms.
+	uint64 DownloadRateBuckets[METRICS_DOWNLOAD_RATE_BUCKETS];
+	uint64 DownloadTimeBuckets[METRICS_DOWNLOAD_TIME_BUCKETS];
+	uint64 DownloadTimed;
+	double DownloadRateSum;
+	double DownloadSeconds;
+
+	void AddDispatchTime( double Seconds );
+	void AddDownload( int32 Bytes, double Seconds );
+};
+
+extern FNetMetrics GNetMetrics;
+
+UBOOL StartMetricsServer( int32 Port ); //True if the caller holds a reference
+void StopMetricsServer(); //Closes the listener once the last reference is gone
+
+#endif
@@ -10,8 +10,174 @@
 	UXC_TcpipConnection.
 -----------------------------------------------------------------------------*/
 
+class UXC_TcpipConnection;
+class UXC_TcpNetDriver;
+
 #include "UnNet.h"
 
+//
+// Compact per-connection traffic counters.
+// RTT and loss are taken from the engine's own stats (AvgLag, InLoss, OutLoss).
+//
+struct FConnectionStats
+{
+	double StartTime;
+	uint64 BytesSent;
+	uint64 BytesRecv;
+	uint32 PacketsSent;
+	uint32 PacketsRecv;
+	uint32 SendFailures;
+	uint32 PortUnreach;
+	uint32 QueuedSends;
+	uint32 QueueDrops;
+	int32  LastSendError;
+
+	FConnectionStats();
+};
+
+//
+// Driver level packets, these end with a zero byte so that legacy peers discard them.
+// (UNetConnection::ReceivedRawPacket requires a trailing 1 bit)
+// Layout: [Payload][Type][0]
+//
+enum EDriverPacket
+{
+	XCPACKET_Hello    = 1, // Payload: 'X','C',Version,Caps
+	XCPACKET_HelloAck = 2, // Payload: 'X','C',Version,Caps
+	XCPACKET_LZ4      = 3, // Payload: LZ4 block
+};
+
+#define XCPACKET_VERSION 1
+#define XCCAPS_LZ4       0x01
+
+//
+// Network conditions applied by the driver's emulation layer.
+//
+struct FNetEmulation
+{
+	int32 PktLag;         // Milliseconds added to every packet
+	int32 PktLagVariance; // Jitter, up to this many extra milliseconds
+	int32 PktLoss;        // Percentage of packets dropped
+	int32 PktDup;         // Percentage of packets sent twice
+	int32 PktOrder;       // Percentage of packets held back so they arrive out of order
+	int32 Bandwidth;      // Bytes per second per direction, 0 = unlimited
+
+	UBOOL IsActive() const;
+	void Validate();
+	FString String() const;
+};
+
+//
+// Spreads outgoing packets over time on a sender thread.
+// Each connection is paced at its net speed, this smooths the
+// end-of-tick replication burst without delaying data past a tick.
+// On Linux the kernel can hold the packets instead (SO_TXTIME), this
+// only delays them if the interface uses the fq or etf qdisc.
+//
+#define PACER_MAX_PACKETS 1024
+#define PACER_MAX_SIZE    576
+
+class FPacketPacer : public CThread
+{
+public:
+	struct FPacedPacket
+	{
+		double SendTime;
+		uint32 Sequence; //Same SendTime goes out in queue order
+		UXC_TcpipConnection* Connection; //Null once destroyed
+		CSocket Socket;
+		IPEndpoint Endpoint;
+		int32 Size;
+		uint8 Data[PACER_MAX_SIZE];
+	};
+
+	UXC_TcpNetDriver* Driver;
+	volatile int32 Lock;
+	volatile int32 bExit;
+	volatile int32 bBlocked; //Send buffer full, packets go back to the send queues (written under Lock)
+	FThreadEvent Event;
+	int32 NumQueued;
+	int32 NumFree;
+	double NextSendTime; //Pacer thread wakes up at this time
+	uint32 NextSequence;
+	int32 FreeList[PACER_MAX_PACKETS];
+	uint8 Used[PACER_MAX_PACKETS]; //Send only writes to unused slots
+	FPacedPacket Packets[PACER_MAX_PACKETS];
+	int32 DueList[PACER_MAX_PACKETS]; //Pacer thread, or whoever holds Lock while bBlocked
+	int32 NumTxTimeSockets;
+	struct { CSocket Socket; int32 Family; } TxTimeSockets[8];
+
+	// Stats.
+	uint32 TickBurst;       //Packets handed over during current tick
+	uint32 TickImmediate;   //Packets sent right away during current tick
+	uint32 MaxTickBurst;    //Largest end-of-tick burst seen (before pacing)
+	uint32 MaxPacedBurst;   //Largest burst sent by the pacer (after pacing), written under Lock
+	uint32 PacedPackets;
+	uint32 TxTimePackets;   //Handed to the kernel with a send time
+	uint32 BlockedSends;    //Returned to the send queues on a full send buffer (EAGAIN)
+	uint32 SendErrors;
+	int32 LastSendError;
+
+	FPacketPacer( UXC_TcpNetDriver* InDriver );
+	~FPacketPacer();
+
+	UBOOL EnableTxTime( TArray<CSocket>& Sockets );
+	UBOOL Send( UXC_TcpipConnection* Connection, const uint8* Data, int32 Count, double TickInterval );
+	void EndTick();
+	void ReturnBlocked();
+	void Forget( UXC_TcpipConnection* Connection );
+	double Flush();
+
+private:
+	int32 CollectDue( double Now, double& Next );
+	int32 SortDue( double Now, double& Next );
+	int32 SendDue( int32 NumDue, UBOOL& bStopped );
+	UBOOL SendTxTime( CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Count, double Delay );
+};
+
+//
+// Packet held by the emulation layer until ReleaseTime.
+//
+struct FDelayedPacket
+{
+	double ReleaseTime;
+	CSocket Socket;
+	IPEndpoint Endpoint;
+	UBOOL bOutgoing;
+	TArray<uint8> Data;
+};
+
+//
+// Per connection bandwidth estimate (see Bandwidth.cpp).
+//
+#define BWE_MINRTT_SLOTS 10
+
+struct FBandwidthEstimate
+{
+	float Rate;           // Bytes per second
+	float MinRtt;         // Base round trip time, lowest in RttWindow
+	float RttWindow[BWE_MINRTT_SLOTS]; // Lowest RTT per slot, 0 = no sample
+	int32 RttSlot;        // Slot taking samples
+	double RttSlotTime;   // When RttSlot started
+	float SmoothRtt;
+	float QueueDelay;     // SmoothRtt above base, in seconds
+	double SampleTime;    // StatUpdateTime of the last sample
+	int32 AppliedSpeed;   // Last CurrentNetSpeed set by the estimator
+	int32 RequestedSpeed; // Client's own net speed, upper bound
+	uint32 Increases;
+	uint32 Decreases;
+};
+
+//
+// Packet waiting for send buffer space (EAGAIN).
+//
+struct FQueuedPacket
+{
+	IPEndpoint Endpoint;
+	UBOOL bReliable; //Carries acks or reliable bunches
+	TArray<uint8> Data;
+};
+
 //
 // Windows socket class.
 //
@@ -25,19 +191,53 @@ class UXC_TcpipConnection : public UNetConnection
 	CSocket			Socket;
 	UBOOL			OpenedLocally;
 	FResolveInfo*	ResolveInfo;
+	FConnectionStats Stats;
+	uint8			PeerCaps;
+	uint8			HellosSent;
+	double			LastHelloTime;
+	UBOOL			PooledName;
+	IPAddress		AltAddress; //Happy eyeballs candidate, Any once committed
+	double			ResolvedTime;
+	UBOOL			ReceivedReply;
+	UBOOL			UseEmulation; //Overrides driver's emulation settings
+	FNetEmulation	Emulation;
+	double			EmulationLinkTime[2]; //Bandwidth cap: incoming, outgoing
+	double			PacingTime; //Earliest time the next paced packet may leave
+	UXC_TcpipConnection* HashNext; //Driver's endpoint hash chain
+	TArray<FQueuedPacket> SendQueue;
+	int32			SendQueueBytes;
+	FBandwidthEstimate Bandwidth;
 
 	// Constructors and destructors.
 	UXC_TcpipConnection( CSocket InSocket, UNetDriver* InDriver, IPEndpoint InRemoteAddress, EConnectionState InState, UBOOL InOpenedLocally, const FURL& InURL );
 
+	// UObject interface.
+	void Destroy();
+
+	// UNetConnection interface.
+	void Tick();
 	void LowLevelSend( void* Data, INT Count );
 	FString LowLevelGetRemoteAddress();
 	FString LowLevelDescribe();
+
+	// UXC_TcpipConnection interface.
+	void SendRawPacket( const uint8* Data, int32 Count );
+	void SendToRemote( const uint8* Data, int32 Count );
+	UBOOL FlushSendQueue();
+	void QueuePacket( const uint8* Data, int32 Count );
+	UBOOL IsReliablePacket( const uint8* Data, int32 Count );
+	void UpdateBandwidthEstimate();
+	void SendDriverPacket( uint8 Type, const uint8* Payload, int32 PayloadSize );
+	void ReceivedDriverPacket( uint8* Data, int32 Count );
+	UBOOL MatchesServerEndpoint( const IPEndpoint& Endpoint, UBOOL bHasData );
 };
 
 /*-----------------------------------------------------------------------------
 	UXC_TcpNetDriver.
 -----------------------------------------------------------------------------*/
 
+#define CONNECTION_HASH_SIZE 1024
+
 class UXC_TcpNetDriver : public UNetDriver
 {
 	DECLARE_CLASS(UXC_TcpNetDriver,UNetDriver,CLASS_Transient|CLASS_Config,XC_IpDrv)
@@ -47,14 +247,62 @@ class UXC_TcpNetDriver : public UNetDriver
 	UBOOL LogPortUnreach;
 	UBOOL RedirectInternal;
 	UBOOL UseIPv6;
+	UBOOL DualStackSocket; //With IPv6 on all addresses, one socket serves IPv4 too
 	int32 RedirectRate; //Not implemented
 	int32 RedirectPort; //Not implemented
 	int32 ConnectionLimit;
+	float StatsDumpInterval;
+	FStringNoInit StatsDumpFile;
+	int32 MetricsPort; //Localhost Prometheus endpoint, 0 = off
+	UBOOL CompressPackets;
+	int32 CompressThreshold;
+	FNetEmulation Emulation;
+	UBOOL PacedSend;
+	UBOOL PacedSendTxTime; //Linux, needs the fq qdisc on the interface
+	int32 SendQueueSize; //Bytes per connection held on EAGAIN, 0 = drop
+	UBOOL CompressCache; //Produce .uz/.lzma redirect files in the background
+	FStringNoInit CompressCacheDir;
+	int32 CompressCacheThreads;
+	UBOOL AdaptiveNetSpeed; //Estimate bandwidth and drive CurrentNetSpeed
+	int32 AdaptiveMinNetSpeed;
+	int32 AdaptiveMaxNetSpeed; //0 = MaxClientRate
+	int32 AdaptiveDelayMs; //Queueing delay considered congestion
+	UBOOL UseAFXDP; //Linux servers built with AFXDP=1
+	FStringNoInit AFXDPInterface;
 
 	// Variables.
 	IPEndpoint LocalAddress;
 	TArray<CSocket> Sockets;
+	TArray<IPAddress> SocketAddresses; //Bind address of each socket
+	uint32 LostSocketAddresses; //Bit per socket whose address went away
 //	CSocket Socket;
+	float LastStatsDumpTime;
+	float LastAddressCheckTime;
+	uint32 LocalAddressSerial;
+	DWORD CompressCycles;
+	uint32 CompressedPackets;
+	uint64 CompressBytesIn;
+	uint64 CompressBytesOut;
+	TArray<uint8> CapturedPackets; //Uncompressed outgoing packets for NETSTATS LZ4BENCH
+	int32 CaptureLeft;
+	TArray<FName> FreeConnectionNames;
+	uint32 ConnectionsCreated;
+	uint32 PooledNamesUsed;
+	TArray<FDelayedPacket> DelayedPackets;
+	int32 DelayedHead; //Packets before this one were released
+	UBOOL ConnectionEmulation;
+	double EmulationLinkTime[2];
+	uint32 EmulationDrops; //Queue overflow
+	FPacketPacer* Pacer;
+	FXDPSocket* XDP;
+	int32 XDPSocketIndex; //Socket that answers whatever XDP can't send
+	UXC_TcpipConnection* ConnectionHash[CONNECTION_HASH_SIZE];
+	int32 CompressScanCount; //MasterMap size at the last cache scan
+	uint32 QueuedSends;
+	uint32 QueueDropsUnreliable;
+	uint32 QueueDropsReliable;
+	UBOOL MetricsStarted; //Holds a reference on the metrics listener
+	int32 MetricsConnections; //Added to GNetMetrics.Connections
 
 	// Constructor.
 	void StaticConstructor();
@@ -62,15 +310,57 @@ class UXC_TcpNetDriver : public UNetDriver
 	// UObject interface
 	void PostEditChange();
 
+	// FExec interface
+	UBOOL Exec( const TCHAR* Cmd, FOutputDevice& Ar=*GLog );
+
 	// UNetDriver interface.
 	UBOOL InitConnect( FNetworkNotify* InNotify, FURL& ConnectURL, FString& Error );
 	UBOOL InitListen( FNetworkNotify* InNotify, FURL& LocalURL, FString& Error );
 	void TickDispatch( FLOAT DeltaTime );
+	void TickFlush();
 	FString LowLevelGetNetworkNumber();
 	void LowLevelDestroy();
 
 	// UTcpNetDriver interface.
 	UBOOL InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL& URL, FString& Error );
 	UXC_TcpipConnection* GetServerConnection();
+	void PrewarmConnectionPool();
+	UXC_TcpipConnection* CreateClientConnection( CSocket& Socket, const IPEndpoint& Endpoint );
+	void CheckLocalAddresses();
+	UXC_TcpipConnection* FindConnection( const IPEndpoint& Endpoint, UBOOL bHasData );
+	void HashConnection( UXC_TcpipConnection* Connection );
+	void UnhashConnection( UXC_TcpipConnection* Connection );
+	void ReceivedPortUnreach( const IPEndpoint& Endpoint );
+	void DispatchPacket( CSocket& Socket, const IPEndpoint& Endpoint, uint8* Data, int32 Size );
+	CSocket* FindSocketFor( const IPAddress& Address );
+	UBOOL TransmitPacket( CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Count, UBOOL& bBlocked );
+	uint32 GetSendQueueMask();
+	void FlushSendQueues( uint32 WriteMask );
+
+	// Emulation interface.
+	UBOOL EmulationActive() const;
+	UBOOL EmulatePacket( UXC_TcpipConnection* Connection, CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Size, UBOOL bOutgoing );
+	void ReleaseDelayedPackets();
+	int32 NumDelayedPackets() const;
+	UBOOL ExecEmulation( const TCHAR* Cmd, FOutputDevice& Ar );
+
+	// Bandwidth estimation interface.
+	UBOOL ExecBandwidth( FOutputDevice& Ar );
+
+	// Wake-on-packet interface.
+	UBOOL WaitForPacket( double Seconds );
+
+	// Stats interface.
+	void GetSortedConnections( TArray<UXC_TcpipConnection*>& Result, const TCHAR* SortBy );
+	FString ExportStats( UBOOL bJSON );
+	UBOOL ExecJoinBenchmark( const TCHAR* Str, FOutputDevice& Ar );
+	UBOOL DumpStats( const TCHAR* Filename );
+	void CapturePacket( const uint8* Data, int32 Count );
+	UBOOL ExecCompressBenchmark( const TCHAR* Str, FOutputDevice& Ar );
 };
 
+//
+// Lets the engine's idle sleep wake up as soon as server data arrives.
+// Returns true if a packet is ready to be processed by TickDispatch.
+//
+extern "C" XC_IPDRV_API UBOOL XC_WaitForNetPacket( UNetDriver* Driver, FLOAT Seconds );
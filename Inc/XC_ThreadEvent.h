@@ -0,0 +1,23 @@
+/*=============================================================================
+	XC_ThreadEvent.h
+	Author: Fernando Velazquez
+
+	Auto-reset event, lets worker threads sleep until there's work
+	instead of polling.
+=============================================================================*/
+
+#ifndef XC_THREADEVENT_H
+#define XC_THREADEVENT_H
+
+class FThreadEvent
+{
+	void* Handle; //Platform event
+public:
+	FThreadEvent();
+	~FThreadEvent();
+
+	void Signal();
+	UBOOL Wait( double Seconds=-1.0); //Negative waits forever, returns false on timeout
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*=============================================================================
+	XC_Trace.h
+	Author: Fernando Velazquez
+
+	Scoped timeline zones for the net driver and downloader.
+	When disabled a zone costs a single flag check.
+=============================================================================*/
+
+#ifndef XC_TRACE_H
+#define XC_TRACE_H
+
+#define TRACE_BUFFER_EVENTS 16384
+
+extern volatile int32 GTraceEnabled;
+
+uint64 TraceNow(); //Nanoseconds
+void TraceRecord( const char* Name, uint64 Start, uint64 End);
+UBOOL ExecTrace( const TCHAR* Cmd, FOutputDevice& Ar);
+
+class FTraceScope
+{
+	const char* Name;
+	uint64 Start;
+public:
+	FTraceScope( const char* InName)
+		: Name( GTraceEnabled ? InName : nullptr)
+	{
+		if ( Name )
+			Start = TraceNow();
+	}
+	~FTraceScope()
+	{
+		if ( Name )
+			TraceRecord( Name, Start, TraceNow());
+	}
+};
+
+#define XC_TRACE_CONCAT_INNER(A,B) A##B
+#define XC_TRACE_CONCAT(A,B) XC_TRACE_CONCAT_INNER(A,B)
+#define XC_TRACE_SCOPE(Name) FTraceScope XC_TRACE_CONCAT(TraceScope,__LINE__)(Name)
+
+#endif
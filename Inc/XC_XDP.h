@@ -0,0 +1,43 @@
+/*=============================================================================
+	XC_XDP.h
+	Author: Fernando Velazquez
+
+	Optional AF_XDP packet path for servers (Linux, make AFXDP=1).
+=============================================================================*/
+
+#ifndef XC_XDP_H
+#define XC_XDP_H
+
+//
+// An XDP program attached in generic (SKB) mode redirects IPv4 UDP traffic
+// for the game port and the game socket's address into UMEMs shared with
+// the driver, one AF_XDP socket per RX queue. Everything else keeps going
+// to the sockets. Replies to peers seen on this path are written straight
+// into the TX ring of the queue they came from.
+// Create returns nullptr if any step fails, the driver then stays on the
+// socket path.
+//
+class FXDPSocket
+{
+public:
+	static FXDPSocket* Create( const TCHAR* Interface, int32 Port, CSocket& Socket, FString& Error);
+	~FXDPSocket();
+
+	int32 NumQueues() const;
+	int32 Recv( uint8* Data, int32 MaxSize, IPEndpoint& Endpoint); //-1 if there's nothing left
+	UBOOL Send( const IPEndpoint& Endpoint, const uint8* Data, int32 Count, UBOOL& bFull); //False if not sent, the socket path must send it unless bFull
+	void Flush();
+	UBOOL Wait( double Seconds, TArray<CSocket>& Sockets, uint32& WriteMask);
+
+	uint32 PacketsRecv;
+	uint32 PacketsSent;
+	uint32 SendFallbacks; //Unknown peer or oversized
+	uint32 TxFull;        //Ring out of room, sender retries later
+
+private:
+	struct FXDPState* State;
+
+	FXDPSocket();
+};
+
+#endif
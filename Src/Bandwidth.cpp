@@ -0,0 +1,129 @@
+/*=============================================================================
+	Bandwidth.cpp
+	Author: Fernando Velazquez
+
+	Delay based bandwidth estimation for UXC_TcpNetDriver.
+	A rising round trip time means packets are sitting in a queue somewhere
+	along the path, so the rate backs off before loss appears; otherwise it
+	probes upwards until the client's requested net speed is reached.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+
+#define BWE_DECREASE      0.85f  // Rate multiplier on congestion
+#define BWE_INCREASE      0.05f  // Rate fraction added per clean sample
+#define BWE_MIN_INCREASE  500.f  // Bytes per second
+#define BWE_LOSS          0.05f  // OutLoss considered congestion
+#define BWE_MINRTT_WINDOW 10.0   // Seconds the base RTT is taken from, lets it follow route changes
+
+/*-----------------------------------------------------------------------------
+	UXC_TcpipConnection.
+-----------------------------------------------------------------------------*/
+
+void UXC_TcpipConnection::Tick()
+{
+	Super::Tick();
+
+	// Engine updates AvgLag and OutLoss once per StatPeriod, take one sample each time.
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+	if ( TcpDriver->AdaptiveNetSpeed && !OpenedLocally && (State == USOCK_Open) && (StatUpdateTime != Bandwidth.SampleTime) )
+	{
+		Bandwidth.SampleTime = StatUpdateTime;
+		UpdateBandwidthEstimate();
+	}
+}
+
+void UXC_TcpipConnection::UpdateBandwidthEstimate()
+{
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+	FBandwidthEstimate& Bwe = Bandwidth;
+
+	// Net speed changed by someone else (NETSPEED command), it becomes the new cap.
+	if ( CurrentNetSpeed != Bwe.AppliedSpeed )
+	{
+		Bwe.RequestedSpeed = CurrentNetSpeed;
+		if ( Bwe.Rate <= 0 )
+			Bwe.Rate = (float)CurrentNetSpeed;
+	}
+
+	if ( AvgLag <= 0 )
+		return;
+
+	// Base RTT is the lowest seen within the window, a standing queue doesn't pull it up.
+	// Each slot holds the lowest sample of its share of the window, expired ones are cleared.
+	double SlotTime = BWE_MINRTT_WINDOW / BWE_MINRTT_SLOTS;
+	int32 Steps = Min( appFloor( (Bwe.SampleTime - Bwe.RttSlotTime) / SlotTime), BWE_MINRTT_SLOTS);
+	for ( int32 i=0; i<Steps; i++)
+	{
+		Bwe.RttSlot = (Bwe.RttSlot + 1) % BWE_MINRTT_SLOTS;
+		Bwe.RttWindow[Bwe.RttSlot] = 0;
+	}
+	if ( Steps > 0 )
+		Bwe.RttSlotTime = Bwe.SampleTime;
+	if ( (Bwe.RttWindow[Bwe.RttSlot] <= 0) || (AvgLag < Bwe.RttWindow[Bwe.RttSlot]) )
+		Bwe.RttWindow[Bwe.RttSlot] = AvgLag;
+	Bwe.MinRtt = AvgLag;
+	for ( int32 i=0; i<BWE_MINRTT_SLOTS; i++)
+		if ( (Bwe.RttWindow[i] > 0) && (Bwe.RttWindow[i] < Bwe.MinRtt) )
+			Bwe.MinRtt = Bwe.RttWindow[i];
+	Bwe.SmoothRtt = (Bwe.SmoothRtt <= 0) ? AvgLag : Bwe.SmoothRtt + (AvgLag - Bwe.SmoothRtt) * 0.25f;
+	Bwe.QueueDelay = Max( Bwe.SmoothRtt - Bwe.MinRtt, 0.f);
+
+	// Never above what the client asked for.
+	int32 MaxSpeed = TcpDriver->AdaptiveMaxNetSpeed ? Min( TcpDriver->AdaptiveMaxNetSpeed, TcpDriver->MaxClientRate) : TcpDriver->MaxClientRate;
+	MaxSpeed = Min( MaxSpeed, Bwe.RequestedSpeed);
+	int32 MinSpeed = Min( TcpDriver->AdaptiveMinNetSpeed, MaxSpeed);
+
+	float Threshold = TcpDriver->AdaptiveDelayMs * 0.001f;
+	if ( (OutLoss > BWE_LOSS) || (Bwe.QueueDelay > Threshold) )
+	{
+		Bwe.Rate *= BWE_DECREASE;
+		Bwe.Decreases++;
+		GNetMetrics.BandwidthDecreases++;
+	}
+	else if ( (Bwe.QueueDelay < Threshold * 0.5f) && (Bwe.Rate < (float)MaxSpeed) )
+	{
+		Bwe.Rate += Max( Bwe.Rate * BWE_INCREASE, BWE_MIN_INCREASE);
+		Bwe.Increases++;
+		GNetMetrics.BandwidthIncreases++;
+	}
+
+	Bwe.Rate = Clamp( Bwe.Rate, (float)MinSpeed, (float)MaxSpeed);
+	CurrentNetSpeed = appRound( Bwe.Rate);
+	Bwe.AppliedSpeed = CurrentNetSpeed;
+}
+
+/*-----------------------------------------------------------------------------
+	UXC_TcpNetDriver.
+-----------------------------------------------------------------------------*/
+
+//
+// NETSTATS BWE
+//
+UBOOL UXC_TcpNetDriver::ExecBandwidth( FOutputDevice& Ar )
+{
+	guard(UXC_TcpNetDriver::ExecBandwidth);
+	if ( !AdaptiveNetSpeed )
+		Ar.Logf( TEXT("Adaptive net speed is disabled, estimates are not being updated"));
+
+	TArray<UXC_TcpipConnection*> Connections;
+	GetSortedConnections( Connections, nullptr);
+	Ar.Logf( TEXT("%-40s %7s %7s %6s %6s %6s %6s %5s %5s"), TEXT("Address"), TEXT("Rate"), TEXT("Req"), TEXT("MinRTT"), TEXT("SRTT"), TEXT("Queue"), TEXT("OutL%"), TEXT("Up"), TEXT("Down") );
+	for ( int32 i=0; i<Connections.Num(); i++)
+	{
+		UXC_TcpipConnection* Connection = Connections(i);
+		FBandwidthEstimate& Bwe = Connection->Bandwidth;
+		Ar.Logf( TEXT("%-40s %7i %7i %6i %6i %6i %6.2f %5u %5u")
+			, *Connection->LowLevelGetRemoteAddress()
+			, Connection->CurrentNetSpeed
+			, Bwe.RequestedSpeed
+			, appRound( Bwe.MinRtt * 1000.f)
+			, appRound( Bwe.SmoothRtt * 1000.f)
+			, appRound( Bwe.QueueDelay * 1000.f)
+			, Connection->OutLoss * 100.f
+			, Bwe.Increases
+			, Bwe.Decreases );
+	}
+	return 1;
+	unguard;
+}
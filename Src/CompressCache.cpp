@@ -0,0 +1,397 @@
+/*=============================================================================
+	CompressCache.cpp
+	Author: Fernando Velazquez
+
+	Produces the .uz and .lzma variants of every package a server sends,
+	so redirects don't depend on admins running UCC compress by hand.
+	Work happens on a small pool of threads, the game thread only scans
+	the package map and records finished files in the manifest.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "XC_LZMA.h"
+#include "Cacus/Atomics.h"
+
+static FCompressCache* GCompressCache = nullptr;
+
+FCompressCache* GetCompressCache( const TCHAR* Directory, int32 MaxThreads)
+{
+	if ( !GCompressCache )
+		GCompressCache = new FCompressCache( Directory, MaxThreads);
+	return GCompressCache;
+}
+
+/*-----------------------------------------------------------------------------
+	Worker threads.
+-----------------------------------------------------------------------------*/
+
+//
+// FCodecBWT encodes through static buffers, so only the first worker takes .uz jobs.
+// The others only run LZMA, which is safe to run in parallel.
+//
+static unsigned long CompressThreadEntry( void* Arg, CThread* Handler)
+{
+	FCompressCache::FWorker* Worker = (FCompressCache::FWorker*)Arg;
+	UBOOL bUzWorker = (Worker == &GCompressCache->Workers[0]);
+	FCompressJob Job;
+	while ( GCompressCache->PopJob( Job, bUzWorker) )
+	{
+		Job.Variants = GCompressCache->CompressPackage( Job);
+		GCompressCache->PushResult( Job);
+	}
+	Worker->Done = 1;
+	return THREAD_END_OK;
+}
+
+UBOOL FCompressCache::PopJob( FCompressJob& Job, UBOOL bTakeUz)
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=0; i<Pending.Num(); i++)
+		if ( bTakeUz || !(Pending(i).Variants & COMPRESS_VARIANT_UZ) )
+		{
+			Job = Pending(i);
+			Pending.Remove( i);
+			return 1;
+		}
+	return 0;
+}
+
+void FCompressCache::PushResult( const FCompressJob& Job)
+{
+	CSpinLock SL(&Lock);
+	Completed.AddItem( Job);
+}
+
+//
+// Writes to a temporary file first, a redirect never serves a partial file.
+// Returns the variants that were produced.
+//
+int32 FCompressCache::CompressPackage( const FCompressJob& Job)
+{
+	int32 Produced = 0;
+
+	if ( Job.Variants & COMPRESS_VARIANT_UZ )
+	{
+		FString Dest = VariantFilename( Job.Filename, UZ_COMPRESSION);
+		FString Temp = Dest + TEXT(".tmp");
+		FArchive* Reader = GFileManager->CreateFileReader( *Job.Source);
+		FArchive* Writer = Reader ? GFileManager->CreateFileWriter( *Temp) : nullptr;
+		if ( Reader && Writer )
+		{
+			// Same layout as UCC compress.
+			INT Signature = 1234;
+			FString OriginalName = Job.Filename;
+			*Writer << Signature << OriginalName;
+			FCodecFull Codec;
+			Codec.AddCodec( new FCodecRLE);
+			Codec.AddCodec( new FCodecBWT);
+			Codec.AddCodec( new FCodecMTF);
+			Codec.AddCodec( new FCodecRLE);
+			Codec.AddCodec( new FCodecHuffman);
+			Codec.Encode( *Reader, *Writer);
+			UBOOL bError = Reader->IsError() || Writer->IsError();
+			delete Writer;
+			Writer = nullptr;
+			if ( !bError && GFileManager->Move( *Dest, *Temp, 1) )
+				Produced |= COMPRESS_VARIANT_UZ;
+		}
+		if ( Writer )
+			delete Writer;
+		if ( Reader )
+			delete Reader;
+		GFileManager->Delete( *Temp);
+	}
+
+	if ( Job.Variants & COMPRESS_VARIANT_LZMA )
+	{
+		FString Dest = VariantFilename( Job.Filename, LZMA_COMPRESSION);
+		FString Temp = Dest + TEXT(".tmp");
+		TCHAR Error[256];
+		Error[0] = '\0';
+		if ( LzmaCompress( *Job.Source, *Temp, Error) && GFileManager->Move( *Dest, *Temp, 1) )
+			Produced |= COMPRESS_VARIANT_LZMA;
+		GFileManager->Delete( *Temp);
+	}
+
+	return Produced;
+}
+
+/*-----------------------------------------------------------------------------
+	FCompressCache.
+-----------------------------------------------------------------------------*/
+
+FCompressCache::FCompressCache( const TCHAR* InDirectory, int32 InMaxThreads)
+	: Directory(InDirectory)
+	, MaxThreads( Clamp( InMaxThreads, 1, COMPRESS_MAX_THREADS))
+	, FilesCompressed(0)
+	, FilesFailed(0)
+	, Lock(0)
+{
+	appMemzero( Workers, sizeof(Workers));
+	GFileManager->MakeDirectory( *Directory, 1);
+	LoadManifest();
+}
+
+//
+// Queues every package whose variants are missing or were made from another GUID.
+//
+void FCompressCache::Scan( UPackageMap* Map)
+{
+	guard(FCompressCache::Scan);
+	UBOOL ManifestChanged = 0;
+	int32 Queued = 0;
+	for ( int32 i=0; i<Map->List.Num(); i++)
+	{
+		FPackageInfo& Info = Map->List(i);
+		if ( !Info.Parent || !Info.URL.Len() )
+			continue;
+		TCHAR Source[256];
+		if ( !appFindPackageFile( Info.Parent->GetName(), &Info.Guid, Source) )
+			continue;
+		if ( InProgress.FindItemIndex( Info.URL) != INDEX_NONE )
+			continue;
+
+		// Files made from an older package go away right now, before a client asks for them.
+		FCompressEntry* Entry = FindEntry( Info.URL);
+		if ( Entry && (Entry->Guid != Info.Guid) )
+		{
+			DeleteVariants( Info.URL, Entry->Variants);
+			Manifest.Remove( Entry - &Manifest(0));
+			Entry = nullptr;
+			ManifestChanged = 1;
+		}
+
+		// Files the cache didn't make are never replaced.
+		int32 Have = Entry ? Entry->Variants : FindForeignVariants( Info.URL);
+		if ( (Have & COMPRESS_VARIANT_UZ) && GFileManager->FileSize( *VariantFilename( Info.URL, UZ_COMPRESSION)) <= 0 )
+			Have &= ~COMPRESS_VARIANT_UZ;
+		if ( (Have & COMPRESS_VARIANT_LZMA) && GFileManager->FileSize( *VariantFilename( Info.URL, LZMA_COMPRESSION)) <= 0 )
+			Have &= ~COMPRESS_VARIANT_LZMA;
+
+		// One job per variant, see CompressThreadEntry.
+		int32 Missing = COMPRESS_VARIANT_ALL & ~Have;
+		for ( int32 Variant=COMPRESS_VARIANT_UZ; Variant<=COMPRESS_VARIANT_LZMA; Variant<<=1)
+			if ( Missing & Variant )
+			{
+				FCompressJob Job;
+				Job.Guid = Info.Guid;
+				Job.Source = Source;
+				Job.Filename = Info.URL;
+				Job.Variants = Variant;
+				InProgress.AddItem( Info.URL);
+				CSpinLock SL(&Lock);
+				Pending.AddItem( Job);
+			}
+		if ( Missing )
+			Queued++;
+	}
+	if ( ManifestChanged )
+		SaveManifest();
+	if ( Queued )
+	{
+		debugf( NAME_DevNet, TEXT("CompressCache: %i packages queued for compression into %s"), Queued, *Directory);
+		StartWorkers();
+	}
+	unguard;
+}
+
+//
+// Records finished jobs and reaps idle workers, called every tick.
+//
+void FCompressCache::Update()
+{
+	guard(FCompressCache::Update);
+	TArray<FCompressJob> Results;
+	if ( Completed.Num() )
+	{
+		CSpinLock SL(&Lock);
+		ExchangeArray( Results, Completed);
+	}
+
+	for ( int32 i=0; i<Results.Num(); i++)
+	{
+		FCompressJob& Job = Results(i);
+		InProgress.Remove( InProgress.FindItemIndex( Job.Filename)); //The other variant may still be running
+		if ( !Job.Variants )
+		{
+			FilesFailed++;
+			debugf( NAME_DevNet, TEXT("CompressCache: failed to compress %s"), *Job.Filename);
+			continue;
+		}
+		FCompressEntry* Entry = FindEntry( Job.Filename);
+		if ( Entry && (Entry->Guid != Job.Guid) )
+			Entry->Variants = 0;
+		else if ( !Entry )
+		{
+			Entry = &Manifest( Manifest.AddZeroed());
+			Entry->Filename = Job.Filename;
+		}
+		Entry->Guid = Job.Guid;
+		Entry->Variants |= Job.Variants;
+		FilesCompressed++;
+	}
+	if ( Results.Num() )
+		SaveManifest();
+
+	for ( int32 i=0; i<MaxThreads; i++)
+		if ( Workers[i].Thread && Workers[i].Done )
+		{
+			while ( !Workers[i].Thread->WaitFinish( 0.01f) );
+			delete Workers[i].Thread;
+			Workers[i].Thread = nullptr;
+		}
+	if ( Pending.Num() )
+		StartWorkers();
+	unguard;
+}
+
+//
+// The first worker runs whenever there's work, the rest only for LZMA jobs.
+//
+void FCompressCache::StartWorkers()
+{
+	int32 Jobs = 0;
+	int32 LzmaJobs = 0;
+	{
+		CSpinLock SL(&Lock);
+		Jobs = Pending.Num();
+		for ( int32 i=0; i<Pending.Num(); i++)
+			if ( !(Pending(i).Variants & COMPRESS_VARIANT_UZ) )
+				LzmaJobs++;
+	}
+	for ( int32 i=0; i<MaxThreads; i++)
+	{
+		if ( Workers[i].Thread || ((i == 0) ? !Jobs : (LzmaJobs <= 0)) )
+			continue;
+		Workers[i].Done = 0;
+		Workers[i].Thread = new CThread();
+		Workers[i].Thread->Run( &CompressThreadEntry, &Workers[i]);
+		if ( i > 0 )
+			LzmaJobs--;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+	Manifest.
+	One line per file: GUID <tab> variant mask <tab> package filename
+-----------------------------------------------------------------------------*/
+
+FString FCompressCache::ManifestFilename() const
+{
+	return Directory * TEXT("XC_CompressCache.txt");
+}
+
+FString FCompressCache::VariantFilename( const FString& Filename, int32 Compression) const
+{
+	return (Directory * Filename) + FDownloadURL::GetCompressedExt( Compression);
+}
+
+UBOOL ParseGuid( const TCHAR* Str, FGuid& Guid)
+{
+	DWORD* Parts = &Guid.A;
+	for ( int32 i=0; i<4; i++)
+	{
+		DWORD Value = 0;
+		for ( int32 j=0; j<8; j++)
+		{
+			TCHAR C = *Str++;
+			if ( C >= '0' && C <= '9' )      Value = (Value << 4) | (C - '0');
+			else if ( C >= 'A' && C <= 'F' ) Value = (Value << 4) | (C - 'A' + 10);
+			else if ( C >= 'a' && C <= 'f' ) Value = (Value << 4) | (C - 'a' + 10);
+			else return 0;
+		}
+		Parts[i] = Value;
+	}
+	return 1;
+}
+
+TCHAR* ParseLine( TCHAR*& Pos)
+{
+	while ( *Pos == '\r' || *Pos == '\n' )
+		Pos++;
+	if ( !*Pos )
+		return nullptr;
+	TCHAR* Line = Pos;
+	while ( *Pos && *Pos != '\r' && *Pos != '\n' )
+		Pos++;
+	if ( *Pos )
+		*Pos++ = '\0';
+	return Line;
+}
+
+int32 ParseTabFields( TCHAR* Line, TCHAR** Fields, int32 MaxFields)
+{
+	int32 Count = 0;
+	while ( Count < MaxFields )
+	{
+		Fields[Count++] = Line;
+		while ( *Line && *Line != '\t' )
+			Line++;
+		if ( !*Line )
+			break;
+		*Line++ = '\0';
+	}
+	return Count;
+}
+
+void FCompressCache::LoadManifest()
+{
+	FString Text;
+	if ( !appLoadFileToString( Text, *ManifestFilename()) )
+		return;
+
+	TCHAR* Pos = (TCHAR*)*Text;
+	while ( TCHAR* Line = ParseLine( Pos) )
+	{
+		TCHAR* Fields[3];
+		FGuid Guid;
+		if ( (ParseTabFields( Line, Fields, ARRAY_COUNT(Fields)) == ARRAY_COUNT(Fields)) && (appStrlen( Fields[0]) == 32) && ParseGuid( Fields[0], Guid) )
+		{
+			FCompressEntry& New = Manifest( Manifest.AddZeroed());
+			New.Guid = Guid;
+			New.Variants = appAtoi( Fields[1]) & COMPRESS_VARIANT_ALL;
+			New.Filename = Fields[2];
+		}
+	}
+}
+
+void FCompressCache::SaveManifest()
+{
+	FString Text;
+	for ( int32 i=0; i<Manifest.Num(); i++)
+		Text += FString::Printf( TEXT("%s\t%i\t%s\r\n"), *Manifest(i).Guid.String(), Manifest(i).Variants, *Manifest(i).Filename);
+	appSaveStringToFile( Text, *ManifestFilename());
+}
+
+FCompressEntry* FCompressCache::FindEntry( const FString& Filename)
+{
+	for ( int32 i=0; i<Manifest.Num(); i++)
+		if ( Manifest(i).Filename == Filename )
+			return &Manifest(i);
+	return nullptr;
+}
+
+void FCompressCache::DeleteVariants( const FString& Filename, int32 Variants)
+{
+	if ( Variants & COMPRESS_VARIANT_UZ )
+		GFileManager->Delete( *VariantFilename( Filename, UZ_COMPRESSION));
+	if ( Variants & COMPRESS_VARIANT_LZMA )
+		GFileManager->Delete( *VariantFilename( Filename, LZMA_COMPRESSION));
+}
+
+//
+// Looks for compressed files that were already in the directory (UCC compress, older setups).
+// Their headers don't tell which package GUID they came from, so they stay out of
+// the manifest: never replaced, never deleted, and the admin keeps them current.
+//
+int32 FCompressCache::FindForeignVariants( const FString& Filename)
+{
+	int32 Present = 0;
+	if ( GFileManager->FileSize( *VariantFilename( Filename, UZ_COMPRESSION)) > 0 )
+		Present |= COMPRESS_VARIANT_UZ;
+	if ( GFileManager->FileSize( *VariantFilename( Filename, LZMA_COMPRESSION)) > 0 )
+		Present |= COMPRESS_VARIANT_LZMA;
+	if ( Present )
+		debugf( NAME_DevNet, TEXT("CompressCache: leaving compressed files of %s alone, the cache didn't make them"), *Filename);
+	return Present;
+}
@@ -0,0 +1,399 @@
+/*=============================================================================
+	CurlEngine.cpp
+	Author: Fernando Velazquez
+
+	Process-wide libcurl engine for HTTPS downloads.
+	libcurl is loaded once, a single thread drives every transfer through a
+	multi handle and a share handle keeps the DNS cache, TLS sessions and
+	connections alive across packages, so repeat downloads from the same
+	redirect skip both name resolution and the TLS handshake.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+#include "Cacus/Atomics.h"
+#include "Cacus/TCharBuffer.h"
+
+/*----------------------------------------------------------------------------
+	LibCurl utils.
+----------------------------------------------------------------------------*/
+
+typedef int32 (*curl_global_init_PROC)(int32);
+typedef void* (*curl_easy_init_PROC)(void);
+typedef void (*curl_easy_cleanup_PROC)(void*);
+typedef int32 (*curl_easy_setopt_PROC)(void*, int32, ...);
+typedef const char* (*curl_easy_strerror_PROC)(int32);
+typedef int32 (*curl_easy_getinfo_PROC)(void*,int32,...);
+typedef void* (*curl_multi_init_PROC)(void);
+typedef int32 (*curl_multi_add_handle_PROC)(void*, void*);
+typedef int32 (*curl_multi_remove_handle_PROC)(void*, void*);
+typedef int32 (*curl_multi_perform_PROC)(void*, int32*);
+typedef int32 (*curl_multi_wait_PROC)(void*, void*, uint32, int32, int32*);
+typedef int32 (*curl_multi_poll_PROC)(void*, void*, uint32, int32, int32*);
+typedef int32 (*curl_multi_wakeup_PROC)(void*);
+typedef struct CURLMsg_* (*curl_multi_info_read_PROC)(void*, int32*);
+typedef void* (*curl_share_init_PROC)(void);
+typedef int32 (*curl_share_setopt_PROC)(void*, int32, ...);
+
+struct CURLMsg_
+{
+	int32 msg; //CURLMSG_DONE = 1
+	void* easy_handle;
+	union
+	{
+		void* whatever;
+		int32 result;
+	} data;
+};
+
+// Loaded once, read-only afterwards.
+static curl_global_init_PROC curl_global_init;
+static curl_easy_init_PROC curl_easy_init;
+static curl_easy_cleanup_PROC curl_easy_cleanup;
+static curl_easy_setopt_PROC curl_easy_setopt;
+static curl_easy_strerror_PROC curl_easy_strerror;
+static curl_easy_getinfo_PROC curl_easy_getinfo;
+static curl_multi_init_PROC curl_multi_init;
+static curl_multi_add_handle_PROC curl_multi_add_handle;
+static curl_multi_remove_handle_PROC curl_multi_remove_handle;
+static curl_multi_perform_PROC curl_multi_perform;
+static curl_multi_wait_PROC curl_multi_wait;
+static curl_multi_poll_PROC curl_multi_poll;     //7.66, optional
+static curl_multi_wakeup_PROC curl_multi_wakeup; //7.68, optional
+static curl_multi_info_read_PROC curl_multi_info_read;
+static curl_share_init_PROC curl_share_init;
+static curl_share_setopt_PROC curl_share_setopt;
+
+static UBOOL LibCurl_GetProcs( CScopedLibrary* LibHandle)
+{
+	curl_global_init         = LibHandle->Get<curl_global_init_PROC>("curl_global_init");
+	curl_easy_init           = LibHandle->Get<curl_easy_init_PROC>("curl_easy_init");
+	curl_easy_cleanup        = LibHandle->Get<curl_easy_cleanup_PROC>("curl_easy_cleanup");
+	curl_easy_setopt         = LibHandle->Get<curl_easy_setopt_PROC>("curl_easy_setopt");
+	curl_easy_strerror       = LibHandle->Get<curl_easy_strerror_PROC>("curl_easy_strerror");
+	curl_easy_getinfo        = LibHandle->Get<curl_easy_getinfo_PROC>("curl_easy_getinfo");
+	curl_multi_init          = LibHandle->Get<curl_multi_init_PROC>("curl_multi_init");
+	curl_multi_add_handle    = LibHandle->Get<curl_multi_add_handle_PROC>("curl_multi_add_handle");
+	curl_multi_remove_handle = LibHandle->Get<curl_multi_remove_handle_PROC>("curl_multi_remove_handle");
+	curl_multi_perform       = LibHandle->Get<curl_multi_perform_PROC>("curl_multi_perform");
+	curl_multi_wait          = LibHandle->Get<curl_multi_wait_PROC>("curl_multi_wait");
+	curl_multi_poll          = LibHandle->Get<curl_multi_poll_PROC>("curl_multi_poll");
+	curl_multi_wakeup        = LibHandle->Get<curl_multi_wakeup_PROC>("curl_multi_wakeup");
+	if ( !curl_multi_poll || !curl_multi_wakeup )
+	{
+		curl_multi_poll = nullptr;
+		curl_multi_wakeup = nullptr;
+	}
+	curl_multi_info_read     = LibHandle->Get<curl_multi_info_read_PROC>("curl_multi_info_read");
+	curl_share_init          = LibHandle->Get<curl_share_init_PROC>("curl_share_init");
+	curl_share_setopt        = LibHandle->Get<curl_share_setopt_PROC>("curl_share_setopt");
+	return curl_global_init
+		&& curl_easy_init
+		&& curl_easy_cleanup
+		&& curl_easy_setopt
+		&& curl_easy_strerror
+		&& curl_easy_getinfo
+		&& curl_multi_init
+		&& curl_multi_add_handle
+		&& curl_multi_remove_handle
+		&& curl_multi_perform
+		&& curl_multi_wait
+		&& curl_multi_info_read
+		&& curl_share_init
+		&& curl_share_setopt;
+}
+
+static size_t WriteCallback( void* Data, size_t Size, size_t Elems, void* Arg)
+{
+	FCurlTransfer* Transfer = (FCurlTransfer*)Arg;
+	int32 Received = (int32)(Size * Elems);
+	if ( Transfer->ContentLength < 0 )
+	{
+		/*CURLINFO_CONTENT_LENGTH_DOWNLOAD_T*/
+		SQWORD ContentLength = -1;
+		if ( !curl_easy_getinfo( Transfer->Easy, 0x600000 + 15, &ContentLength) && (ContentLength >= 0) )
+			Transfer->ContentLength = (int32)ContentLength;
+		else
+			Transfer->ContentLength = 0;
+	}
+	if ( Transfer->Receive && !Transfer->Receive( Transfer, (const uint8*)Data, Received) )
+		return 0; //Aborts with CURLE_WRITE_ERROR
+	return (size_t)Received;
+}
+
+static int ProgressCallback( void* Arg, SQWORD DownloadTotal, SQWORD DownloadNow, SQWORD UploadTotal, SQWORD UploadNow)
+{
+	FCurlTransfer* Transfer = (FCurlTransfer*)Arg;
+	return FPlatformAtomics::AtomicRead( &Transfer->Cancelled); //Non zero aborts with CURLE_ABORTED_BY_CALLBACK
+}
+
+/*----------------------------------------------------------------------------
+	Engine.
+----------------------------------------------------------------------------*/
+
+static FHTTPCurlEngine* GHTTPCurlEngine = nullptr;
+static UBOOL GHTTPCurlFailed = 0;
+
+FHTTPCurlEngine* GetHTTPCurlEngine()
+{
+	if ( !GHTTPCurlEngine && !GHTTPCurlFailed )
+	{
+		FHTTPCurlEngine* Engine = new FHTTPCurlEngine();
+		if ( Engine->Init() )
+			GHTTPCurlEngine = Engine;
+		else
+		{
+			delete Engine;
+			GHTTPCurlFailed = 1; //Don't retry on every download
+		}
+	}
+	return GHTTPCurlEngine;
+}
+
+//
+// Stops the engine thread when the module is unloaded.
+//
+static struct FHTTPCurlEngineExit
+{
+	~FHTTPCurlEngineExit()
+	{
+		if ( GHTTPCurlEngine )
+			GHTTPCurlEngine->Shutdown();
+	}
+} GHTTPCurlEngineExit;
+
+static unsigned long CurlThreadEntry( void* Arg, CThread* Handler)
+{
+	FHTTPCurlEngine* Engine = (FHTTPCurlEngine*)Arg;
+	while ( Engine->Run() );
+	return THREAD_END_OK;
+}
+
+FHTTPCurlEngine::FHTTPCurlEngine()
+	: Library(nullptr)
+	, Multi(nullptr)
+	, Share(nullptr)
+	, Thread(nullptr)
+	, Lock(0)
+	, bExit(0)
+{}
+
+FHTTPCurlEngine::~FHTTPCurlEngine()
+{
+	// Only reached if Init failed, the engine lives as long as the process otherwise.
+	if ( Library )
+		delete Library;
+}
+
+UBOOL FHTTPCurlEngine::Init()
+{
+	guard(FHTTPCurlEngine::Init);
+	Library = new CScopedLibrary( "libcurl" CACUSLIB_LIBRARY_EXTENSION);
+	if ( !Library->Handle )
+	{
+		debugf( NAME_DevNet, TEXT("HTTPS: unable to load libcurl"));
+		return 0;
+	}
+	if ( !LibCurl_GetProcs( Library) )
+	{
+		debugf( NAME_DevNet, TEXT("HTTPS: unable to retrieve libcurl entry points"));
+		return 0;
+	}
+	int32 GlobalInitCode = curl_global_init(0b11);
+	if ( GlobalInitCode )
+	{
+		TCharWideBuffer<256> Reason = curl_easy_strerror(GlobalInitCode); // Convert to UNICODE
+		debugf( NAME_DevNet, TEXT("HTTPS: CURL error: %s"), *Reason);
+		return 0;
+	}
+	Multi = curl_multi_init();
+	Share = curl_share_init();
+	if ( !Multi || !Share )
+	{
+		debugf( NAME_DevNet, TEXT("HTTPS: CURL multi/share init error"));
+		return 0;
+	}
+	// All transfers run in the engine thread, the share needs no lock callbacks.
+	// Connections are already pooled by the multi handle.
+	curl_share_setopt( Share, 1 /*SHARE*/, 3 /*CURL_LOCK_DATA_DNS*/);
+	curl_share_setopt( Share, 1 /*SHARE*/, 4 /*CURL_LOCK_DATA_SSL_SESSION*/);
+
+	Thread = new CThread();
+	Thread->Run( &CurlThreadEntry, this);
+	debugf( NAME_DevNet, TEXT("HTTPS: libcurl engine started"));
+	return 1;
+	unguard;
+}
+
+//
+// Hands the transfer to the engine thread and waits for it to end.
+// Returns the CURLcode, 0 on success.
+//
+int32 FHTTPCurlEngine::Perform( FCurlTransfer& Transfer)
+{
+	void* Easy = curl_easy_init();
+	if ( !Easy )
+		return Transfer.Result = 2; /*CURLE_FAILED_INIT*/
+
+	TChar8Buffer<1024> RequestURL = *Transfer.URL;
+	curl_easy_setopt( Easy, 10000 +   2 /*URL*/, *RequestURL);
+	curl_easy_setopt( Easy, 00000 +  64 /*SSL_VERIFYPEER*/, 0);
+	curl_easy_setopt( Easy, 00000 +  81 /*SSL_VERIFYHOST*/, 0);
+	curl_easy_setopt( Easy, 00000 +  13 /*TIMEOUT*/, appCeil(Transfer.Timeout));
+	curl_easy_setopt( Easy, 00000 +  45 /*FAILONERROR*/, 1);
+	curl_easy_setopt( Easy, 00000 +  99 /*NOSIGNAL*/, 1);
+	curl_easy_setopt( Easy, 20000 +  11 /*WRITEFUNCTION*/, WriteCallback);
+	curl_easy_setopt( Easy, 10000 +   1 /*WRITEDATA*/, &Transfer);
+	curl_easy_setopt( Easy, 10000 + 103 /*PRIVATE*/, &Transfer);
+	curl_easy_setopt( Easy, 10000 + 100 /*SHARE*/, Share);
+	curl_easy_setopt( Easy, 20000 + 219 /*XFERINFOFUNCTION*/, ProgressCallback);
+	curl_easy_setopt( Easy, 10000 +  57 /*XFERINFODATA*/, &Transfer);
+	curl_easy_setopt( Easy, 00000 +  43 /*NOPROGRESS*/, 0);
+
+	Transfer.Easy = Easy;
+	Transfer.Done = 0;
+	{
+		CSpinLock SL(&Lock);
+		if ( bExit )
+		{
+			curl_easy_cleanup( Easy);
+			Transfer.Easy = nullptr;
+			return Transfer.Result = 42; /*CURLE_ABORTED_BY_CALLBACK*/
+		}
+		Pending.AddItem( &Transfer);
+	}
+	Wakeup();
+	Transfer.DoneEvent.Wait(); //Only signaled by Complete
+	return Transfer.Result;
+}
+
+void FHTTPCurlEngine::Shutdown()
+{
+	{
+		CSpinLock SL(&Lock);
+		bExit = 1;
+	}
+	Wakeup();
+	if ( Thread && !Thread->WaitFinish( 2.f) )
+		Thread->Detach();
+}
+
+//
+// Wakes the engine thread whether it's idle or polling transfers.
+//
+void FHTTPCurlEngine::Wakeup()
+{
+	Event.Signal();
+	if ( curl_multi_wakeup )
+		curl_multi_wakeup( Multi);
+}
+
+//
+// Caller owns Transfer again once the event is signaled, nothing may touch it afterwards.
+//
+void FHTTPCurlEngine::Complete( FCurlTransfer* Transfer, int32 Result)
+{
+	Transfer->Result = Result;
+	Transfer->Easy = nullptr;
+	Transfer->Done = 1;
+	Transfer->DoneEvent.Signal();
+}
+
+//
+// Engine thread, one pass over all transfers.
+// Sleeps on the event while idle and inside libcurl while transfers run.
+//
+UBOOL FHTTPCurlEngine::Run()
+{
+	TArray<FCurlTransfer*> New;
+	UBOOL bExiting;
+	{
+		CSpinLock SL(&Lock);
+		ExchangeArray( New, Pending);
+		bExiting = bExit;
+	}
+	for ( int32 i=0; i<New.Num(); i++)
+	{
+		if ( bExiting || curl_multi_add_handle( Multi, New(i)->Easy) )
+		{
+			curl_easy_cleanup( New(i)->Easy);
+			Complete( New(i), bExiting ? 42 /*CURLE_ABORTED_BY_CALLBACK*/ : 2 /*CURLE_FAILED_INIT*/);
+		}
+		else
+			Active.AddItem( New(i));
+	}
+	if ( bExiting )
+	{
+		for ( int32 i=0; i<Active.Num(); i++)
+		{
+			curl_multi_remove_handle( Multi, Active(i)->Easy);
+			curl_easy_cleanup( Active(i)->Easy);
+			Complete( Active(i), 42 /*CURLE_ABORTED_BY_CALLBACK*/);
+		}
+		Active.Empty();
+		return 0;
+	}
+	if ( !Active.Num() )
+	{
+		Event.Wait();
+		return 1;
+	}
+
+	int32 Running = 0;
+	curl_multi_perform( Multi, &Running);
+
+	CURLMsg_* Msg;
+	int32 Queued = 0;
+	while ( (Msg = curl_multi_info_read( Multi, &Queued)) != nullptr )
+		if ( Msg->msg == 1 /*CURLMSG_DONE*/ )
+		{
+			void* Easy = Msg->easy_handle;
+			FCurlTransfer* Transfer = nullptr;
+			long ResponseCode = 0;
+			curl_easy_getinfo( Easy, 0x100000 + 21 /*PRIVATE*/, &Transfer);
+			curl_easy_getinfo( Easy, 0x200000 +  2 /*RESPONSE_CODE*/, &ResponseCode);
+			Transfer->ResponseCode = (int32)ResponseCode;
+			curl_multi_remove_handle( Multi, Easy);
+			curl_easy_cleanup( Easy);
+			Active.RemoveItem( Transfer);
+			Complete( Transfer, Msg->data.result);
+		}
+
+	// Without curl_multi_wakeup new transfers wait for the poll timeout.
+	if ( Running )
+	{
+		int32 NumFds = 0;
+		if ( curl_multi_poll )
+			curl_multi_poll( Multi, nullptr, 0, 1000, &NumFds);
+		else
+			curl_multi_wait( Multi, nullptr, 0, 50, &NumFds);
+	}
+	return 1;
+}
+
+/*----------------------------------------------------------------------------
+	Downloader.
+----------------------------------------------------------------------------*/
+
+//
+// Engine thread, the downloader is only pinned while this data is written.
+//
+int32 UXC_HTTPDownload::CurlReceive( FCurlTransfer* Transfer, const uint8* Data, int32 Count)
+{
+	FDownloadAsyncProcessor* Proc = (FDownloadAsyncProcessor*)Transfer->Owner;
+	UXC_HTTPDownload* Download = (UXC_HTTPDownload*)Proc->Download;
+	{
+		CSleepLock SL(&UXC_Download::GlobalLock);
+		if ( !Proc->DownloadActive() || !Download->AsyncBeginWork() )
+			return 0;
+	}
+	if ( !Download->Transfered && !Download->RecvFileAr && (Transfer->ContentLength > 0) )
+		Download->RealFileSize = Transfer->ContentLength;
+	int32 RealSize = Download->RealFileSize ? Download->RealFileSize : Download->Info->FileSize;
+	int32 Received = (Download->Transfered + Count > RealSize) ? RealSize - Download->Transfered : Count;
+	if ( Received > 0 )
+		Download->ReceiveData( (BYTE*)Data, Received);
+	Download->AsyncEndWork();
+	return 1;
+}
+
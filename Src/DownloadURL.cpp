@@ -77,6 +77,19 @@ FString FDownloadURL::StringHost( UBOOL bNoPort ) const
 	return Result;
 }
 
+void FDownloadURL::Redirect( const TCHAR* RelativeURI)
+{
+	//Merge modifiers into path
+	if ( RequestedPackage.Len() )
+	{
+		Path += RequestedPackage;
+		Path += GetCompressedExt( Compression);
+		RequestedPackage.Empty();
+		Compression = 0;
+	}
+	*(FURI*)this = FURI( *this, RelativeURI);
+}
+
 const TCHAR* FDownloadURL::GetCompressedExt(int32 Compression)
 {
 	if ( Compression < 0 || Compression >= ARRAY_COUNT(CompressionArray) )
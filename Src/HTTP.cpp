@@ -9,85 +9,13 @@
 
 #include "XC_IpDrv.h"
 #include "HTTPDownload.h"
+#include "XC_LZMA.h"
 #include "Cacus/CacusBase.h"
-#include "Cacus/DynamicLinking.h"
 #include "Cacus/Atomics.h"
 #include "Cacus/TCharBuffer.h"
 
-/*----------------------------------------------------------------------------
-	LibCurl utils.
-----------------------------------------------------------------------------*/
-
-typedef int32 (*curl_global_init_PROC)(int32);
-typedef void* (*curl_easy_init_PROC)(void);
-typedef void (*curl_easy_cleanup_PROC)(void*);
-typedef int32 (*curl_easy_setopt_PROC)(void*, int32, ...);
-typedef int32 (*curl_easy_perform_PROC)(void*);
-typedef const char* (*curl_easy_strerror_PROC)(int32);
-typedef int32 (*curl_easy_getinfo_PROC)(void*,int32,...);
-
-static UXC_HTTPDownload* CallbackDownload = nullptr;
-static void* CURLEasy = nullptr;
-static int32 ContentLengthQuery = 0;
-static curl_global_init_PROC curl_global_init;
-static curl_easy_init_PROC curl_easy_init;
-static curl_easy_cleanup_PROC curl_easy_cleanup;
-static curl_easy_setopt_PROC curl_easy_setopt;
-static curl_easy_perform_PROC curl_easy_perform;
-static curl_easy_strerror_PROC curl_easy_strerror;
-static curl_easy_getinfo_PROC curl_easy_getinfo;
-
-static UBOOL LibCurl_GetProcs( CScopedLibrary* LibHandle)
-{
-	curl_global_init   = LibHandle->Get<curl_global_init_PROC>("curl_global_init");
-	curl_easy_init     = LibHandle->Get<curl_easy_init_PROC>("curl_easy_init");
-	curl_easy_cleanup  = LibHandle->Get<curl_easy_cleanup_PROC>("curl_easy_cleanup");
-	curl_easy_setopt   = LibHandle->Get<curl_easy_setopt_PROC>("curl_easy_setopt");
-	curl_easy_perform  = LibHandle->Get<curl_easy_perform_PROC>("curl_easy_perform");
-	curl_easy_strerror = LibHandle->Get<curl_easy_strerror_PROC>("curl_easy_strerror");
-	curl_easy_getinfo  = LibHandle->Get<curl_easy_getinfo_PROC>("curl_easy_getinfo");
-	return curl_global_init 
-		&& curl_easy_init 
-		&& curl_easy_cleanup 
-		&& curl_easy_setopt 
-		&& curl_easy_perform 
-		&& curl_easy_strerror
-		&& curl_easy_getinfo;
-}
-
-static size_t TestCallback( void* Data, size_t Size, size_t Elems, void* Arg)
-{
-	int32 Received = (int32)(Size * Elems);
-	if ( CallbackDownload )
-	{
-		if ( ContentLengthQuery )
-		{
-			/*CURLINFO_CONTENT_LENGTH_DOWNLOAD_T*/
-			int_p ContentLength;
-			if ( !curl_easy_getinfo( CURLEasy, 0x600000 + 15, &ContentLength) )
-			{
-				CallbackDownload->RealFileSize = (int32)ContentLength;
-				ContentLengthQuery = 0;
-			}
-		}
-		int32 RealSize = CallbackDownload->RealFileSize ? CallbackDownload->RealFileSize : CallbackDownload->Info->FileSize;
-		int32 Count = (CallbackDownload->Transfered + Received > RealSize) ? RealSize - CallbackDownload->Transfered : Received;
-		if ( Count > 0 )
-			CallbackDownload->ReceiveData( (uint8*)Data, Count);
-	}
-	return (size_t)Received;
-}
-
-static size_t HeaderCallback( void* Data, size_t Size, size_t Elems, void* Arg)
-{
-	size_t Received = Size * Elems;
-	/*if ( CallbackDownload )
-	{
-		TCharWideBuffer<2048> Buffer = (char*)Data;
-		CallbackDownload->SavedLogs.Logf( NAME_DevNet, *Buffer);
-	}*/
-	return Received;
-}
+// Most data received while a worker pins the downloader, Destroy waits for at most this much.
+#define HTTP_RECEIVE_SLICE (256*1024)
 
 /*----------------------------------------------------------------------------
 	HTTP Request utils.
@@ -103,6 +31,62 @@ FString HTTP_Request::String()
 	return Result;
 }
 
+/*----------------------------------------------------------------------------
+	Keep-alive pool.
+	Sequential packages from the same redirect reuse one warm connection.
+----------------------------------------------------------------------------*/
+
+FHTTPConnectionPool GHTTPConnectionPool;
+
+UBOOL FHTTPConnectionPool::Acquire( const IPEndpoint& Endpoint, CSocket& OutSocket, double IdleTimeout)
+{
+	while ( true )
+	{
+		CSocket Socket;
+		{
+			CSpinLock SL(&Lock);
+			double Now = appSecondsNew();
+			int32 Found = INDEX_NONE;
+			for ( int32 i=Idle.Num()-1; i>=0; i--)
+				if ( Now - Idle(i).IdleSince > IdleTimeout )
+				{
+					Idle(i).Socket.Close();
+					Idle.Remove( i);
+					if ( Found != INDEX_NONE )
+						Found--;
+				}
+				else if ( (Found == INDEX_NONE) && (Idle(i).Endpoint == Endpoint) )
+					Found = i;
+			if ( Found == INDEX_NONE )
+				return 0;
+			Socket = Idle(Found).Socket;
+			Idle.Remove( Found);
+		}
+
+		// An idle connection has nothing to say, if readable the server closed it.
+		if ( Socket.CheckState( SOCKET_Readable, 0) == SOCKET_Timeout )
+		{
+			OutSocket = Socket;
+			return 1;
+		}
+		Socket.Close();
+	}
+}
+
+void FHTTPConnectionPool::Release( const IPEndpoint& Endpoint, CSocket& Socket)
+{
+	CSpinLock SL(&Lock);
+	if ( Idle.Num() >= HTTP_POOL_MAX )
+	{
+		Idle(0).Socket.Close();
+		Idle.Remove( 0);
+	}
+	FIdleConnection& Connection = Idle( Idle.AddZeroed());
+	Connection.Endpoint = Endpoint;
+	Connection.Socket = Socket;
+	Connection.IdleSince = appSecondsNew();
+}
+
 /*----------------------------------------------------------------------------
 	HTTP Downloader.
 ----------------------------------------------------------------------------*/
@@ -115,6 +99,11 @@ void UXC_HTTPDownload::StaticConstructor()
 	new(Class,TEXT("ProxyServerHost"),		RF_Public)UStrProperty(CPP_PROPERTY(ProxyServerHost		), TEXT("Settings"), CPF_Config );
 	new(Class,TEXT("ProxyServerPort"),		RF_Public)UIntProperty(CPP_PROPERTY(ProxyServerPort		), TEXT("Settings"), CPF_Config );
 	new(Class,TEXT("DownloadTimeout"),		RF_Public)UFloatProperty(CPP_PROPERTY(DownloadTimeout	), TEXT("Settings"), CPF_Config );
+	new(Class,TEXT("KeepAliveTimeout"),		RF_Public)UFloatProperty(CPP_PROPERTY(KeepAliveTimeout	), TEXT("Settings"), CPF_Config );
+	new(Class,TEXT("ConcurrentDownloads"),	RF_Public)UIntProperty(CPP_PROPERTY(ConcurrentDownloads	), TEXT("Settings"), CPF_Config );
+	new(Class,TEXT("DecompressDownloads"),	RF_Public)UBoolProperty(CPP_PROPERTY(DecompressDownloads	), TEXT("Settings"), CPF_Config );
+	new(Class,TEXT("ValidatorCacheMB"),		RF_Public)UIntProperty(CPP_PROPERTY(ValidatorCacheMB	), TEXT("Settings"), CPF_Config );
+	new(Class,TEXT("SaveRedirectMemo"),		RF_Public)UBoolProperty(CPP_PROPERTY(SaveRedirectMemo	), TEXT("Settings"), CPF_Config );
 	new(Class,TEXT("RedirectToURL"),		RF_Public)UStrProperty(CPP_PROPERTY(DownloadParams		), TEXT("Settings"), CPF_Config );
 	new(Class,TEXT("UseCompression"),		RF_Public)UBoolProperty(CPP_PROPERTY(UseCompression		), TEXT("Settings"), CPF_Config );
 
@@ -123,6 +112,10 @@ void UXC_HTTPDownload::StaticConstructor()
 	Defaults->IsLZMA = 1;
 	Defaults->IsCompressed = 1;
 	Defaults->DownloadTimeout = 4.0f;
+	Defaults->KeepAliveTimeout = 5.0f;
+	Defaults->ConcurrentDownloads = 3;
+	Defaults->DecompressDownloads = 1;
+	Defaults->ValidatorCacheMB = 128;
 }
 
 UXC_HTTPDownload::UXC_HTTPDownload()
@@ -130,16 +123,56 @@ UXC_HTTPDownload::UXC_HTTPDownload()
 	Socket.SetInvalid();
 	IsCompressed = 0;
 	IsLZMA = 0;
+	LzmaStream = nullptr;
+	CurlTransfer = nullptr;
 }
 
 void UXC_HTTPDownload::Destroy()
 {
-	if ( CURL_Library )
+	//Let the worker step out of this downloader first, it drops its pin after the
+	//buffer it's writing (see AsyncReceive) and the HTTPS transfer aborts on its own
 	{
-		delete CURL_Library;
-		CURL_Library = nullptr;
+		CSleepLock SL(&UXC_Download::GlobalLock);
+		FPlatformAtomics::InterlockedExchange( &Cancelled, 1);
+		if ( CurlTransfer )
+			FPlatformAtomics::InterlockedExchange( &CurlTransfer->Cancelled, 1);
+	}
+	while ( FPlatformAtomics::AtomicRead( &WorkerBusy) )
+		appSleep( 0.f);
+
+	if ( Error[0] )
+		GNetMetrics.DownloadsFailed++;
+	else if ( Transfered )
+	{
+		GNetMetrics.DownloadsCompleted++;
+		GNetMetrics.AddDownload( NetBytes, appSecondsNew() - StartTime);
 	}
 	Socket.Close();
+	if ( LzmaStream )
+	{
+		delete LzmaStream;
+		LzmaStream = nullptr;
+	}
+
+	//Incomplete transfer with a validator, keep it for a Range request later
+	if ( TempFilename[0] && (Transfered > 0) && (Transfered < RealFileSize) )
+	{
+		CSleepLock SL(&UXC_Download::GlobalLock);
+		FString Name = DownloadTempName();
+		if ( GFileManager->FileSize( *(Name + TEXT(".resume"))) > 0 )
+		{
+			if ( RecvFileAr )
+			{
+				delete RecvFileAr;
+				RecvFileAr = nullptr;
+			}
+			if ( GFileManager->Move( *(Name + TEXT(".partial")), TempFilename, 1) )
+			{
+				debugf( NAME_DevNet, TEXT("Keeping %i/%i bytes of %s for resume"), Transfered, RealFileSize, *DownloadURL.RequestedPackage);
+				TempFilename[0] = '\0';
+			}
+		}
+	}
 	Super::Destroy();
 }
 
@@ -178,6 +211,9 @@ void UXC_HTTPDownload::ReceiveFile( UNetConnection* InConnection, INT InPackageI
 		return;
 	}
 
+	GNetMetrics.DownloadsStarted++;
+	StartTime = appSecondsNew();
+	NetBytes = 0;
 	if ( InCompression )
 		DownloadURL.Compression = LZMA_COMPRESSION;
 	DownloadURL.ProxyHostname = ProxyServerHost;
@@ -186,19 +222,27 @@ void UXC_HTTPDownload::ReceiveFile( UNetConnection* InConnection, INT InPackageI
 
 	if ( DownloadURL.Scheme == TEXT("http") )
 	{
+		//Skip variants this redirect is known not to have
+		FHTTPRedirectMemo* Memo = GetHTTPRedirectMemo();
+		Memo->bSave = SaveRedirectMemo;
+		DownloadURL.Compression = Memo->PickCompression( DownloadURL);
+		CurrentURL = DownloadURL;
+
 		Request = HTTP_Request();
 		Request.Hostname = CurrentURL.StringHost();
 		Request.Method = TEXT("GET");
 		Request.Path = CurrentURL.StringGet();
 		Request.Headers.Set( TEXT("User-Agent")  , TEXT("Unreal"));
 		Request.Headers.Set( TEXT("Accept")      , TEXT("*/*"));
-		Request.Headers.Set( TEXT("Connection")  , TEXT("close")); //Proxy with auth require [Proxy-Connection: close]
+		if ( ProxyServerHost.Len() )
+			Request.Headers.Set( TEXT("Connection"), TEXT("close")); //Proxy with auth require [Proxy-Connection: close]
+		else
+			Request.Headers.Set( TEXT("Connection"), TEXT("keep-alive"));
 		Request.RedirectsLeft = 5;
 	}
 	else if ( DownloadURL.Scheme == TEXT("https") )
 	{
-		CURL_Library = new CScopedLibrary( "libcurl" CACUSLIB_LIBRARY_EXTENSION);
-		if ( !CURL_Library->Handle )
+		if ( !GetHTTPCurlEngine() )
 		{
 			IsInvalid = 1;
 			Finished = 1;
@@ -211,6 +255,20 @@ void UXC_HTTPDownload::ReceiveFile( UNetConnection* InConnection, INT InPackageI
 		Finished = 1;
 		return;
 	}
+
+	//Other missing packages are fetched in parallel, this one may already be done
+	//HTTPS ones share the curl engine, which runs all of its transfers at once
+	FHTTPPrefetcher* Prefetcher = GetHTTPPrefetcher();
+	Prefetcher->MaxThreads = Clamp( ConcurrentDownloads - 1, 0, PREFETCH_MAX_THREADS);
+	Prefetcher->Timeout = Max<double>( DownloadTimeout, 2.0);
+	Prefetcher->KeepAliveTimeout = KeepAliveTimeout;
+	Prefetcher->bDecompress = DecompressDownloads;
+	if ( DownloadURL.Scheme == TEXT("https") )
+		Prefetcher->CurlEngine = GetHTTPCurlEngine();
+	GetHTTPValidatorCache()->MaxSizeMB = Clamp( ValidatorCacheMB, 0, 65536);
+	if ( Prefetcher->MaxThreads > 0 )
+		Prefetcher->Schedule( InConnection, PackageIndex, Params, InCompression);
+	PrefetchState = ClaimPrefetch();
 	FString Msg1 = FString::Printf( (Info.PackageFlags&PKG_ClientOptional)?LocalizeProgress(TEXT("ReceiveOptionalFile"),TEXT("Engine")):LocalizeProgress(TEXT("ReceiveFile"),TEXT("Engine")), Info.Parent->GetName() );
 	Connection->Driver->Notify->NotifyProgress( *Msg1, TEXT(""), 4.f );
 
@@ -223,89 +281,100 @@ void UXC_HTTPDownload::ReceiveFile( UNetConnection* InConnection, INT InPackageI
 void UXC_HTTPDownload::Tick()
 {
 	SavedLogs.Flush();
+	GetHTTPPrefetcher()->Update();
+	GetHTTPValidatorCache()->Update();
+	GetHTTPRedirectMemo()->Update();
 	Super::Tick();
 
+	//*****************************
+	// Package is being prefetched, or was handed over already
+	if ( PrefetchState == PREFETCH_Active && !Finished && !AsyncAction )
+		PrefetchState = ClaimPrefetch();
+	if ( PrefetchState != PREFETCH_None )
+		return;
+
 	/* HTTPS */
-	if ( !Finished && !AsyncAction && (CurrentURL.Scheme == TEXT("https")) && CURL_Library && CURL_Library->Handle )
+	if ( !Finished && !AsyncAction && (CurrentURL.Scheme == TEXT("https")) && GetHTTPCurlEngine() )
 	{
 		Request.Hostname = CurrentURL.String();
 		debugf( NAME_DevNet, TEXT("Requesting %s..."), *Request.Hostname);
 
 		//***********
-		// Setup CURL
+		// Hand over to the CURL engine
 		new FDownloadAsyncProcessor( [](FDownloadAsyncProcessor* Proc)
 		{
 			//STAGE 1, setup local environment.
 			FString Error;
 			UXC_HTTPDownload* Download = (UXC_HTTPDownload*)Proc->Download;
+			FHTTPCurlEngine* Engine = GetHTTPCurlEngine();
+			FCurlTransfer Transfer;
+			Transfer.URL = Download->Request.Hostname;
+			Transfer.Timeout = Download->DownloadTimeout;
+			Transfer.Receive = &UXC_HTTPDownload::CurlReceive;
+			Transfer.Owner = Proc;
+			Download->CurlTransfer = &Transfer; //Destroy cancels it from here
+
+			//STAGE 2, let main go (no longer safe to use Download from now on)
+			Proc->Detach();
+
+			//STAGE 3, transfer runs without the downloader, callbacks pin it for each write
+			int32 DownloadResult;
+			{
+				XC_TRACE_SCOPE("HTTPS Perform");
+				DownloadResult = Engine->Perform( Transfer);
+			}
 
-			if ( LibCurl_GetProcs(Download->CURL_Library) )
+			//STAGE 4, validate and pin downloader to hand over the result
+			FHTTPFinishJob Job;
+			UBOOL bActive;
 			{
-				//STAGE 2, let main go (no longer safe to use Download from now on)
-				Proc->Detach();
-				int32 GlobalInitCode = curl_global_init(0b11);
-				if ( !GlobalInitCode )
+				CSleepLock SL(&UXC_Download::GlobalLock);
+				bActive = Proc->DownloadActive();
+				if ( bActive )
+					Download->CurlTransfer = nullptr;
+				bActive = bActive && Download->AsyncBeginWork();
+			}
+			if ( bActive )
+			{
+				if ( DownloadResult == 2 ) /*CURLE_FAILED_INIT*/
+					Error = TEXT("CURL easy init error");
+				else if ( DownloadResult )
 				{
-					CURLEasy = curl_easy_init();
-					if ( CURLEasy )
+					// Timed out, this redirect is unreachable
+					if ( DownloadResult == 28 ) 
 					{
-						TChar8Buffer<1024> RequestURL = *Download->Request.Hostname;
-						curl_easy_setopt( CURLEasy, 10000 +  2 /*URL*/, *RequestURL);
-						curl_easy_setopt( CURLEasy, 00000 + 64 /*SSL_VERIFYPEER*/, 0);
-						curl_easy_setopt( CURLEasy, 00000 + 81 /*SSL_VERIFYHOST*/, 0);
-						curl_easy_setopt( CURLEasy, 00000 + 13,/*TIMEOUT*/ appCeil(Download->DownloadTimeout));
-						curl_easy_setopt( CURLEasy, 00000 + 45,/*FAILONERROR*/ 1); 
-						curl_easy_setopt( CURLEasy, 00000 + 41,/*VERBOSE*/ 1);
-						curl_easy_setopt( CURLEasy, 20000 + 11,/*WRITEFUNCTION*/ TestCallback);
-						curl_easy_setopt( CURLEasy, 20000 + 79,/*HEADERFUNCTION*/ HeaderCallback);
-
-						{
-							//STAGE 3, validate downloader and lock
-							CSpinLock SL(&UXC_Download::GlobalLock);
-							if ( Proc->DownloadActive() )
-							{
-								CallbackDownload = Download;
-								ContentLengthQuery = 1;
-								int32 DownloadResult = curl_easy_perform(CURLEasy);
-//								Download->SavedLogs.Logf( *FString::Printf(TEXT("LibCurl status %i (%s)"), DownloadResult, appFromAnsi(curl_easy_strerror(DownloadResult))) );
-								if ( DownloadResult )
-								{
-									// Timed out, this redirect is unreachable
-									if ( DownloadResult == 28 ) 
-									{
-										Download->IsInvalid = 1;
-										Error = UXC_Download::ConnectionFailedError;
-									}
-									// If LZMA fails, try UZ, then no compression.
-									else if ( Download->CurrentURL.Compression > 0 )
-										Download->CurrentURL.Compression--;
-									// All methods failed, this redirect doesn't have this file.
-									else
-										Error = FString::Printf( *UXC_Download::InvalidUrlError, *Download->CurrentURL.String());
-								}
-
-								if ( Download->RecvFileAr )
-								{
-									delete Download->RecvFileAr;
-									Download->RecvFileAr = nullptr;
-								}
-
-								CallbackDownload = nullptr;
-							}
-						}
-						curl_easy_cleanup(CURLEasy);
-						CURLEasy = nullptr;
+						Download->IsInvalid = 1;
+						Error = UXC_Download::ConnectionFailedError;
 					}
-					else Error = TEXT("CURL easy init error");
+					// If LZMA fails, try UZ, then no compression.
+					else if ( Download->CurrentURL.Compression > 0 )
+						Download->CurrentURL.Compression--;
+					// All methods failed, this redirect doesn't have this file.
+					else
+						Error = FString::Printf( *UXC_Download::InvalidUrlError, *Download->CurrentURL.String());
 				}
-				else
+
+				if ( Download->RecvFileAr )
+				{
+					delete Download->RecvFileAr;
+					Download->RecvFileAr = nullptr;
+				}
+				UBOOL bFinish = !Error.Len() && !DownloadResult && Download->AsyncPrepareFinish( Job);
+				Download->AsyncEndWork();
+
+				//STAGE 5: Unpack and keep a validated copy while AsyncAction still holds off completion
+				if ( bFinish )
 				{
-					TCharWideBuffer<256> Reason = curl_easy_strerror(GlobalInitCode); // Convert to UNICODE
-					Error = FString::Printf( TEXT("CURL error: %s"), *Reason);
+					Job.Run();
+					CSleepLock SL(&UXC_Download::GlobalLock);
+					if ( Proc->DownloadActive() )
+						Download->AsyncApplyFinish( Job);
+					else
+						Job.Discard();
 				}
 			}
-			else Error = TEXT("Unable to retrieve libcurl entry points.");
 
+		CSleepLock SL(&UXC_Download::GlobalLock);
 		if ( Proc->DownloadActive() && Error.Len() )
 			Download->DownloadError(*Error);
 
@@ -326,6 +395,18 @@ void UXC_HTTPDownload::Tick()
 	//  The async processor blocks destruction of downloaders and begins to update them.
 	if ( !Finished && !AsyncAction )
 	{
+		//******************************
+		//Follow known permanent redirects
+		if ( CurrentURL.RequestedPackage.Len() )
+		{
+			FString MovedTo = GetHTTPRedirectMemo()->FindMove( CurrentURL);
+			if ( MovedTo.Len() )
+			{
+				debugf( NAME_DevNet, TEXT("Using known redirect to %s"), *MovedTo);
+				UpdateCurrentURL( *MovedTo);
+			}
+		}
+
 		//******************************
 		//Setup hostname and update port
 		FString NewHostname = CurrentURL.StringHost( 1 );
@@ -348,7 +429,11 @@ void UXC_HTTPDownload::Tick()
 
 				//STAGE 2, let main go (no longer safe to use Download from now on)
 				Proc->Detach();
-				IPAddress Address = CSocket::ResolveHostname( appToAnsi(*Hostname));
+				IPAddress Address;
+				{
+					XC_TRACE_SCOPE("HTTP Resolve");
+					Address = CSocket::ResolveHostname( appToAnsi(*Hostname));
+				}
 
 				//STAGE 3, validate downloader and lock
 				CSpinLock SL(&UXC_Download::GlobalLock);
@@ -370,12 +455,18 @@ void UXC_HTTPDownload::Tick()
 		else if ( Request.Path.Len() )
 		{
 			Response = HTTP_Response();
+			Parser.Reset();
 			Request.Path = CurrentURL.StringGet();
+			PrepareResume();
+			PrepareConditional();
 			new FDownloadAsyncProcessor( [](FDownloadAsyncProcessor* Proc)
 			{
 				//STAGE 1, setup local environment.
 				UXC_HTTPDownload* Download = (UXC_HTTPDownload*)Proc->Download;
-				if ( !Download->AsyncLocalBind() )
+				Download->Socket.Close();
+				Download->KeepAlive = 0;
+				UBOOL Reused = GHTTPConnectionPool.Acquire( Download->RemoteEndpoint, Download->Socket, Download->KeepAliveTimeout);
+				if ( !Reused && !Download->AsyncLocalBind() )
 					return;
 				CSocket Socket               = Download->Socket;
 				double Timeout               = Max<double>( Download->DownloadTimeout, 2.0);
@@ -385,32 +476,35 @@ void UXC_HTTPDownload::Tick()
 
 				//STAGE 2, let main go (no longer safe to use Download from now on)
 				Proc->Detach();
-				Socket.SetNonBlocking();
-				appSleep( 0.2f); //Don't try to connect so quickly (a previous download's connection may not be closed)
 				ESocketState State = SOCKET_MAX;
-				if ( !Socket.Connect(RemoteEndpoint) && !Socket.IsNonBlocking(Socket.LastError) )
+				if ( !Reused )
 				{
-					TCharWideBuffer<64> ErrorCode = Socket.ErrorText(Socket.LastError);
-					ConnectError = TEXT("XC_HTTPDownload: connect() failed ");
-					ConnectError += *ErrorCode;
-				}	
-				else
-				{
-					State = Socket.CheckState( SOCKET_Writable, Timeout);
-					if ( State == SOCKET_HasError )
-						ConnectError = TEXT("XC_HTTPDownload: select() failed");
-					else if ( State == SOCKET_Timeout )
-						ConnectError = TEXT("XC_HTTPDownload: connection timed out");
+					XC_TRACE_SCOPE("HTTP Connect");
+					Socket.SetNonBlocking();
+					if ( !Socket.Connect(RemoteEndpoint) && !Socket.IsNonBlocking(Socket.LastError) )
+					{
+						TCharWideBuffer<64> ErrorCode = Socket.ErrorText(Socket.LastError);
+						ConnectError = TEXT("XC_HTTPDownload: connect() failed ");
+						ConnectError += *ErrorCode;
+					}	
+					else
+					{
+						State = Socket.CheckState( SOCKET_Writable, Timeout);
+						if ( State == SOCKET_HasError )
+							ConnectError = TEXT("XC_HTTPDownload: select() failed");
+						else if ( State == SOCKET_Timeout )
+							ConnectError = TEXT("XC_HTTPDownload: connection timed out");
+					}
 				}
 
 				if ( ConnectError[0] != '\0')
 				{
 					//STAGE 3: Tell downloader (if still exists) of failure to connect to server
+					appSleep( 0.1f);
 					CSleepLock SL(&UXC_Download::GlobalLock); 
 					if ( Proc->DownloadActive() )
 					{
 						Download->SavedLogs.Log( NAME_DevNet, *ConnectError);
-						appSleep( 0.1f);
 						Download->DownloadError( *UXC_Download::ConnectionFailedError );
 						Download->IsInvalid = (State == SOCKET_Timeout); //If the server timed out, do not try to connect again for another download
 					}
@@ -418,57 +512,99 @@ void UXC_HTTPDownload::Tick()
 				}
 				else
 				{
-					//STAGE 3: Send request to server and unlock again (back to stage 2)
+					//STAGE 3: Send request to server, only report back under lock
+					bool bSent;
+					{
+						XC_TRACE_SCOPE("HTTP Send");
+						int32 Sent = 0;
+						const ANSICHAR* RequestHeaderAnsi = appToAnsi( *RequestHeader);
+						bSent = Socket.Send( (const uint8*)RequestHeaderAnsi, RequestHeader.Len(), Sent) && (Sent >= RequestHeader.Len());
+					}
+					if ( !bSent && !Reused )
+						appSleep( 0.1f);
 					CSleepLock SL(&UXC_Download::GlobalLock); 
 					if ( !Proc->DownloadActive() )
 						return;
-
-					int32 Sent = 0;
-					const ANSICHAR* RequestHeaderAnsi = appToAnsi( *RequestHeader);
-					bool bSent = Socket.Send( (const uint8*)RequestHeaderAnsi, RequestHeader.Len(), Sent) && (Sent >= RequestHeader.Len());
+					if ( !bSent && Reused ) //Server dropped the idle connection, next Tick requests again on a new one
+					{
+						Download->SavedLogs.Log( NAME_DevNetTraffic, TEXT("Reused connection was closed, reconnecting..."));
+						Download->Socket.Close();
+						return;
+					}
 					if ( !bSent ) //Produce proper log!
 					{
 						ConnectError = TEXT("XC_HTTPDownload: send() failed with ");
 						TCharWideBuffer<64> ErrorCode = Socket.ErrorText(Socket.LastError);
 						ConnectError += *ErrorCode;
 						Download->SavedLogs.Log( NAME_DevNet, *ConnectError);
-						appSleep( 0.1f);
 						Download->DownloadError( *UXC_Download::ConnectionFailedError );
 						return;
 					}
-					Download->SavedLogs.Log( NAME_DevNetTraffic, TEXT("Connected..."));
+					Download->SavedLogs.Log( NAME_DevNetTraffic, Reused ? TEXT("Reusing connection...") : TEXT("Connected..."));
 				}
 
 				double LastRecvTime = appSecondsNew();
 				while ( true )
 				{
-					//STAGE 3: Receive data from server
-					CSleepLock SL(&UXC_Download::GlobalLock); 
-					if ( !Proc->DownloadActive() )
-						return;
+					//Block until the server sends something, wake up periodically to notice cancellation and timeouts
+					double WaitTime = Clamp( Timeout - (appSecondsNew() - LastRecvTime), 0.0, 0.1);
+					ESocketState State = Socket.CheckState( SOCKET_Readable, WaitTime);
+
+					//STAGE 3: Pin downloader, then receive and write to disk without GlobalLock
+					{
+						CSleepLock SL(&UXC_Download::GlobalLock);
+						if ( !Proc->DownloadActive() || !Download->AsyncBeginWork() )
+							return;
+					}
 					int32 OldTransfered = Download->Transfered;
-					if ( Download->AsyncReceive() )
+					bool bDone = (State != SOCKET_Timeout) && Download->AsyncReceive();
+					if ( bDone )
 					{
 						if ( Download->Error[0] )
 							Download->SavedLogs.Log( Download->Error);
-						break;
 					}
-					if ( OldTransfered != Download->Transfered )
+					else if ( OldTransfered != Download->Transfered )
 						LastRecvTime = appSecondsNew();
 					else if ( appSecondsNew() - LastRecvTime > Timeout )
 					{
 						Download->SavedLogs.Log( NAME_DevNet, TEXT("XC_HTTPDownload: connection timed out") );
 						Download->DownloadError( *UXC_Download::ConnectionFailedError );
-						break;
+						bDone = true;
 					}
-					appSleep( 0); //Poll aggresively to prevent bandwidth loss
+					Download->AsyncEndWork();
+					if ( bDone )
+						break;
 				}
-				CSleepLock SL(&UXC_Download::GlobalLock); 
-				if ( Proc->DownloadActive() && Download->RecvFileAr )
+				{
+					CSleepLock SL(&UXC_Download::GlobalLock); 
+					if ( !Proc->DownloadActive() || !Download->AsyncBeginWork() )
+						return;
+				}
+				if ( Download->RecvFileAr )
 				{
 					delete Download->RecvFileAr;
 					Download->RecvFileAr = nullptr;
 				}
+				//Response ended exactly at the message boundary, hand the connection over
+				if ( Download->KeepAlive && !Download->Error[0] )
+				{
+					GHTTPConnectionPool.Release( RemoteEndpoint, Socket);
+					Download->Socket.SetInvalid();
+				}
+				FHTTPFinishJob Job;
+				UBOOL bFinish = Download->AsyncPrepareFinish( Job);
+				Download->AsyncEndWork();
+
+				//STAGE 4: Unpack and keep a validated copy while AsyncAction still holds off completion
+				if ( bFinish )
+				{
+					Job.Run();
+					CSleepLock SL(&UXC_Download::GlobalLock);
+					if ( Proc->DownloadActive() )
+						Download->AsyncApplyFinish( Job);
+					else
+						Job.Discard();
+				}
 			}, this);
 		}
 	}
@@ -478,17 +614,430 @@ void UXC_HTTPDownload::Tick()
 	Downloader utils.
 ----------------------------------------------------------------------------*/
 
+//
+// Unpacks a .uz (UCC compress) or .lzma download, the result must match the package size.
+// Runs on worker threads so the game thread doesn't stall on large packages.
+// Returns 0 if the file isn't in a format handled here, caller keeps the compressed file.
+//
+UBOOL DecompressDownload( const TCHAR* Source, const TCHAR* Dest, int32 ExpectedSize, FString& Error)
+{
+	XC_TRACE_SCOPE("HTTP Decompress");
+	if ( ExpectedSize <= 0 )
+		return 0;
+
+	BYTE Header[13];
+	FArchive* Reader = GFileManager->CreateFileReader( Source);
+	if ( !Reader )
+		return 0;
+	int32 HeaderSize = Min<int32>( Reader->TotalSize(), sizeof(Header));
+	Reader->Serialize( Header, HeaderSize);
+	UBOOL bUZ = (HeaderSize >= 4) && (*(INT*)&Header[0] == 1234);
+	UBOOL bLZMA = (HeaderSize >= 13) && (*(QWORD*)&Header[5] == (QWORD)ExpectedSize);
+
+	UBOOL bDone = 0;
+	if ( bUZ )
+	{
+		FArchive* Writer = GFileManager->CreateFileWriter( Dest);
+		if ( Writer )
+		{
+			// Same layout as UCC decompress.
+			INT Signature;
+			FString OriginalName;
+			Reader->Seek( 0);
+			*Reader << Signature << OriginalName;
+			FCodecFull Codec;
+			Codec.AddCodec( new FCodecRLE);
+			Codec.AddCodec( new FCodecBWT);
+			Codec.AddCodec( new FCodecMTF);
+			Codec.AddCodec( new FCodecRLE);
+			Codec.AddCodec( new FCodecHuffman);
+			bDone = Codec.Decode( *Reader, *Writer) && !Reader->IsError() && !Writer->IsError();
+			delete Writer;
+		}
+	}
+	delete Reader;
+
+	if ( bLZMA )
+	{
+		TCHAR LzmaError[256];
+		LzmaError[0] = '\0';
+		bDone = LzmaDecompress( Source, Dest, LzmaError);
+		if ( !bDone )
+			Error = LzmaError;
+	}
+
+	if ( !bUZ && !bLZMA )
+		return 0;
+	int32 Size = GFileManager->FileSize( Dest);
+	if ( bDone && (Size != ExpectedSize) )
+	{
+		Error = FString::Printf( TEXT("Decompressed size %i doesn't match package size %i"), Size, ExpectedSize);
+		bDone = 0;
+	}
+	if ( !bDone )
+		GFileManager->Delete( Dest);
+	return bDone;
+}
+
+//
+// Replaces the finished compressed file with the package itself and keeps
+// a copy for conditional requests. No downloader access here.
+//
+void FHTTPFinishJob::Run()
+{
+	if ( PackageSize && !bStreamed )
+	{
+		double StartTime = appSecondsNew();
+		bDecompressed = DecompressDownload( *Source, *Dest, PackageSize, Error);
+		Seconds = appSecondsNew() - StartTime;
+	}
+	if ( bDecompressed )
+		GFileManager->Delete( *Source);
+	if ( Validator.IsValid() )
+	{
+		const FString& Stored = bDecompressed ? Dest : Source;
+		if ( bDecompressed )
+			Validator.Compression = NO_COMPRESSION;
+		Validator.Size = GFileManager->FileSize( *Stored);
+		GetHTTPValidatorCache()->Store( Validator, *Stored);
+	}
+}
+
+void FHTTPFinishJob::Discard()
+{
+	GFileManager->Delete( *Source);
+	if ( bDecompressed )
+		GFileManager->Delete( *Dest);
+}
+
+//
+// Game thread isn't done with the download until AsyncAction ends.
+// Returns true if there's work for FHTTPFinishJob.
+//
+UBOOL UXC_HTTPDownload::AsyncPrepareFinish( FHTTPFinishJob& Job)
+{
+	if ( Error[0] || !RealFileSize || (Transfered < RealFileSize) )
+		return 0;
+	Job.Source = TempFilename;
+	Job.Dest = FString::Printf( TEXT("../DownloadTemp/%s"), *DownloadURL.RequestedPackage);
+	Job.PackageName = Info->Parent->GetName();
+	if ( LzmaStream )
+	{
+		if ( LzmaStream->Finish() )
+		{
+			Job.Dest = LzmaStream->Filename;
+			Job.PackageSize = Info->FileSize;
+			Job.bStreamed = 1;
+			Job.bDecompressed = 1;
+		}
+		else
+			SavedLogs.Logf( NAME_DevNet, TEXT("Decompression of '%s' failed: %s"), *Job.PackageName, *LzmaStream->Error);
+		delete LzmaStream;
+		LzmaStream = nullptr;
+	}
+	else if ( DecompressDownloads && IsCompressed && !IsLZMA ) //.uz is unpacked after the transfer
+		Job.PackageSize = Info->FileSize;
+	if ( ((Response.Status == 200) || (Response.Status == 206)) && Validator.IsValid() )
+	{
+		Job.Validator = Validator;
+		Job.Validator.Guid = Info->Guid;
+		Job.Validator.Compression = IsCompressed ? DownloadURL.Compression : NO_COMPRESSION;
+	}
+	return Job.PackageSize || Job.Validator.IsValid();
+}
+
+//
+// GlobalLock is held.
+//
+void UXC_HTTPDownload::AsyncApplyFinish( const FHTTPFinishJob& Job)
+{
+	if ( Job.bDecompressed )
+	{
+		appStrncpy( TempFilename, *Job.Dest, 255);
+		IsCompressed = 0;
+		IsLZMA = 0;
+		RealFileSize = Job.PackageSize;
+		Transfered = Job.PackageSize;
+		if ( Job.bStreamed )
+			SavedLogs.Logf( NAME_DevNet, TEXT("Decompressed '%s' while receiving"), *Job.PackageName);
+		else
+			SavedLogs.Logf( NAME_DevNet, TEXT("Decompressed '%s' in %.2fs"), *Job.PackageName, Job.Seconds);
+	}
+	else if ( Job.Error.Len() )
+		SavedLogs.Logf( NAME_DevNet, TEXT("Decompression of '%s' failed: %s"), *Job.PackageName, *Job.Error);
+}
+
+//
+// 304 response, the local copy becomes the download.
+//
+UBOOL UXC_HTTPDownload::AsyncRestoreValidated()
+{
+	FString Dest = FString::Printf( TEXT("../DownloadTemp/%s%s"), *DownloadURL.RequestedPackage, FDownloadURL::GetCompressedExt(Validator.Compression) );
+	GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
+	if ( !GetHTTPValidatorCache()->Restore( Validator, *Dest) )
+		return 0;
+	UseLocalFile( Dest, Validator.Size, Validator.Compression);
+	SavedLogs.Logf( NAME_DevNet, TEXT("Package '%s' not modified, using local copy (%i bytes)"), Info->Parent->GetName(), Validator.Size);
+	return 1;
+}
+
 void UXC_HTTPDownload::UpdateCurrentURL( const TCHAR* RelativeURI)
 {
-	//Merge modifiers into path
-	if ( CurrentURL.RequestedPackage.Len() )
+	CurrentURL.Redirect( RelativeURI);
+}
+
+void UXC_HTTPDownload::DetectCompression( const BYTE* Data, INT Count)
+{
+	if ( Count >= 13 )
+	{
+		QWORD* LZMASize = (QWORD*)&Data[5];
+		if ( Info->FileSize == *LZMASize )
+		{
+			IsCompressed = 1;
+			IsLZMA = 1;
+			SavedLogs.Logf( NAME_DevNet, TEXT("USES LZMA"));
+		}
+		INT* UzSignature = (INT*)&Data[0];
+		if ( *UzSignature == 1234 || *UzSignature == 5678 )
+		{
+			IsCompressed = 1;
+			SavedLogs.Logf( NAME_DevNet, TEXT("USES UZ: Signature %i"), *UzSignature);
+		}
+	}
+}
+
+//
+// Workers pin the downloader under GlobalLock, then release the lock for
+// a single receive or write. The game thread only waits for them in Destroy.
+//
+UBOOL UXC_HTTPDownload::AsyncBeginWork()
+{
+	if ( FPlatformAtomics::AtomicRead( &Cancelled) )
+		return 0;
+	FPlatformAtomics::InterlockedIncrement( &WorkerBusy);
+	return 1;
+}
+
+void UXC_HTTPDownload::AsyncEndWork()
+{
+	FPlatformAtomics::InterlockedDecrement( &WorkerBusy);
+}
+
+FString UXC_HTTPDownload::DownloadTempName() const
+{
+	return FString::Printf( TEXT("../DownloadTemp/%s%s"), *DownloadURL.RequestedPackage, DownloadURL.GetCompressedExt(DownloadURL.Compression) );
+}
+
+//
+// Resume validator file: package GUID, ETag and Last-Modified, one per line.
+// Partial data lives next to it with a .partial extension.
+//
+void UXC_HTTPDownload::PrepareResume()
+{
+	Request.Headers.Remove( TEXT("Range"));
+	Request.Headers.Remove( TEXT("If-Range"));
+	ResumeFrom = 0;
+	if ( Transfered || RecvFileAr )
+		return;
+
+	FString Name = DownloadTempName();
+	FString PartialName = Name + TEXT(".partial");
+	FString ResumeName = Name + TEXT(".resume");
+	int32 Size = GFileManager->FileSize( *PartialName);
+	if ( Size <= 0 )
+		return;
+
+	FString Text;
+	TArray<FString> Lines;
+	if ( appLoadFileToString( Text, *ResumeName) )
+		for ( int32 i=Text.InStr(TEXT("\n")); i>=0; i=Text.InStr(TEXT("\n")) )
+		{
+			Lines.AddItem( Text.Left(i));
+			Text = Text.Mid(i+1);
+		}
+
+	// If-Range only takes strong validators, a weak ETag falls back to Last-Modified.
+	FString RangeValidator;
+	if ( Lines.Num() >= 3 )
+		RangeValidator = (Lines(1).Len() && (Lines(1).Left(2) != TEXT("W/"))) ? Lines(1) : Lines(2);
+	if ( (Lines.Num() < 3) || (Lines(0) != Info->Guid.String()) || !RangeValidator.Len() )
+	{
+		GFileManager->Delete( *PartialName);
+		GFileManager->Delete( *ResumeName);
+		return;
+	}
+
+	ResumeFrom = Size;
+	Request.Headers.Set( TEXT("Range"), *FString::Printf( TEXT("bytes=%i-"), Size));
+	Request.Headers.Set( TEXT("If-Range"), *RangeValidator);
+	debugf( NAME_DevNet, TEXT("Resuming %s from %i bytes"), *DownloadURL.RequestedPackage, Size);
+}
+
+void UXC_HTTPDownload::SaveResumeValidator()
+{
+	FString ResumeName = DownloadTempName() + TEXT(".resume");
+	FString* ETag = Response.Headers.Find( TEXT("ETag"));
+	FString* LastModified = Response.Headers.Find( TEXT("Last-Modified"));
+	if ( (!ETag || !ETag->Len()) && (!LastModified || !LastModified->Len()) )
+	{
+		GFileManager->Delete( *ResumeName);
+		return;
+	}
+	FString Text = Info->Guid.String() + TEXT("\n");
+	Text += FString(ETag ? **ETag : TEXT("")) + TEXT("\n");
+	Text += FString(LastModified ? **LastModified : TEXT("")) + TEXT("\n");
+	GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
+	appSaveStringToFile( Text, *ResumeName);
+}
+
+//
+// 206 response, continue writing the partial file.
+//
+UBOOL UXC_HTTPDownload::StartResume()
+{
+	FString Name = DownloadTempName();
+	FString* ContentRange = Response.Headers.Find( TEXT("Content-Range"));
+	int32 Start = -1;
+	int32 Total = 0;
+	if ( ContentRange && !appStrnicmp( **ContentRange, TEXT("bytes "), 6) )
+	{
+		Start = appAtoi( **ContentRange + 6);
+		const TCHAR* Slash = appStrchr( **ContentRange, '/');
+		if ( Slash )
+			Total = appAtoi( Slash + 1);
+	}
+	if ( (Start != ResumeFrom) || (Total <= ResumeFrom) || !GFileManager->Move( *Name, *(Name + TEXT(".partial")), 1) )
+		return 0;
+
+	RecvFileAr = GFileManager->CreateFileWriter( *Name, FILEWRITE_Append);
+	if ( !RecvFileAr )
+		return 0;
+	appStrncpy( TempFilename, *Name, 255);
+	FArchive* Ar = GFileManager->CreateFileReader( *Name);
+	if ( Ar )
+	{
+		BYTE Header[13];
+		int32 HeaderSize = Min<int32>( ResumeFrom, sizeof(Header));
+		Ar->Serialize( Header, HeaderSize);
+		delete Ar;
+		DetectCompression( Header, HeaderSize);
+	}
+	StartLzmaStream( *Name);
+	RealFileSize = Total;
+	Transfered = ResumeFrom;
+	SavedLogs.Logf( NAME_DevNet, TEXT("Resumed package '%s' at %i/%i bytes"), Info->Parent->GetName(), ResumeFrom, Total);
+	return 1;
+}
+
+//
+// Requests for a package downloaded before carry its validators.
+// Resumed transfers already use the partial file's validators in If-Range.
+//
+void UXC_HTTPDownload::PrepareConditional()
+{
+	Request.Headers.Remove( TEXT("If-None-Match"));
+	Request.Headers.Remove( TEXT("If-Modified-Since"));
+	Validator = FValidatorEntry();
+	if ( ResumeFrom || Transfered || RecvFileAr )
+		return;
+	if ( GetHTTPValidatorCache()->Find( DownloadURL.String(), Info->Guid, Validator) )
+	{
+		Validator.SetHeaders( Request);
+		debugf( NAME_DevNet, TEXT("Validating local copy of %s"), *DownloadURL.RequestedPackage);
+	}
+}
+
+//
+// Takes a complete file in DownloadTemp as if it had been received by this downloader.
+//
+void UXC_HTTPDownload::UseLocalFile( const FString& Filename, int32 Size, int32 Compression)
+{
+	BYTE Header[13];
+	int32 HeaderSize = Min<int32>( Size, sizeof(Header));
+	FArchive* Ar = GFileManager->CreateFileReader( *Filename);
+	if ( Ar )
+	{
+		Ar->Serialize( Header, HeaderSize);
+		delete Ar;
+		DetectCompression( Header, HeaderSize);
+	}
+	appStrncpy( TempFilename, *Filename, 255);
+	DownloadURL.Compression = Compression;
+	RealFileSize = Size;
+	Transfered = Size;
+}
+
+//
+// .lzma downloads are unpacked as they arrive, the compressed file is still
+// written so an interrupted transfer can be resumed.
+// Resumed transfers feed the partial file first.
+//
+void UXC_HTTPDownload::StartLzmaStream( const TCHAR* Partial)
+{
+	if ( LzmaStream )
+	{
+		delete LzmaStream;
+		LzmaStream = nullptr;
+	}
+	if ( !DecompressDownloads || !IsLZMA )
+		return;
+
+	LzmaStream = new FLzmaStream();
+	FString Dest = FString::Printf( TEXT("../DownloadTemp/%s"), *DownloadURL.RequestedPackage);
+	if ( LzmaStream->Open( *Dest, Info->FileSize) && Partial )
 	{
-		CurrentURL.Path += CurrentURL.RequestedPackage;
-		CurrentURL.Path += CurrentURL.GetCompressedExt( CurrentURL.Compression);
-		CurrentURL.RequestedPackage.Empty();
-		CurrentURL.Compression = 0;
+		FArchive* Ar = GFileManager->CreateFileReader( Partial);
+		if ( Ar )
+		{
+			BYTE Buffer[16384];
+			for ( int32 Pos=0; LzmaStream && (Pos < ResumeFrom); )
+			{
+				int32 Count = Min<int32>( ResumeFrom - Pos, sizeof(Buffer));
+				Ar->Serialize( Buffer, Count);
+				FeedLzmaStream( Buffer, Count);
+				Pos += Count;
+			}
+			delete Ar;
+		}
 	}
-	*(FURI*)&CurrentURL = FURI( CurrentURL, RelativeURI);
+	if ( LzmaStream && LzmaStream->Error.Len() )
+		FeedLzmaStream( nullptr, 0);
+}
+
+//
+// On failure the compressed file is kept as it is.
+//
+void UXC_HTTPDownload::FeedLzmaStream( const BYTE* Data, INT Count)
+{
+	if ( LzmaStream && (LzmaStream->Error.Len() || !LzmaStream->Write( Data, Count)) )
+	{
+		SavedLogs.Logf( NAME_DevNet, TEXT("Decompression of '%s' failed: %s"), Info->Parent->GetName(), *LzmaStream->Error);
+		delete LzmaStream;
+		LzmaStream = nullptr;
+	}
+}
+
+//
+// Takes a finished prefetch as if it had been received by this downloader.
+//
+int32 UXC_HTTPDownload::ClaimPrefetch()
+{
+	FString Filename;
+	int32 Size = 0;
+	int32 Compression = 0;
+	int32 State = GetHTTPPrefetcher()->Claim( Info->Guid, Filename, Size, Compression);
+	if ( State != PREFETCH_Done )
+		return State;
+
+	FString Dest = FString::Printf( TEXT("../DownloadTemp/%s%s"), *DownloadURL.RequestedPackage, FDownloadURL::GetCompressedExt(Compression) );
+	if ( !GFileManager->Move( *Dest, *Filename, 1) )
+	{
+		GFileManager->Delete( *Filename);
+		return PREFETCH_None;
+	}
+	UseLocalFile( Dest, Size, Compression);
+	debugf( NAME_DevNet, TEXT("Using prefetched package '%s' (%i bytes)"), Info->Parent->GetName(), Size);
+	return PREFETCH_Done;
 }
 
 /*----------------------------------------------------------------------------
@@ -511,25 +1060,11 @@ void UXC_HTTPDownload::ReceiveData( BYTE* Data, INT Count )
 
 		GFileManager->MakeDirectory( *GSys->CachePath, 0 );
 		GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
-		FString Filename = FString::Printf( TEXT("../DownloadTemp/%s%s"), *DownloadURL.RequestedPackage, DownloadURL.GetCompressedExt(DownloadURL.Compression) );
+		FString Filename = DownloadTempName();
 		appStrncpy( TempFilename, *Filename, 255);
 		RecvFileAr = GFileManager->CreateFileWriter( TempFilename );
-		if ( Count >= 13 )
-		{
-			QWORD* LZMASize = (QWORD*)&Data[5];
-			if ( Info->FileSize == *LZMASize )
-			{
-				IsCompressed = 1;
-				IsLZMA = 1;
-				SavedLogs.Logf( NAME_DevNet, TEXT("USES LZMA"));
-			}
-			INT* UzSignature = (INT*)&Data[0];
-			if ( *UzSignature == 1234 || *UzSignature == 5678 )
-			{
-				IsCompressed = 1;
-				SavedLogs.Logf( NAME_DevNet, TEXT("USES UZ: Signature %i"), *UzSignature);
-			}
-		}
+		DetectCompression( Data, Count);
+		StartLzmaStream();
 	}
 
 	// Receive.
@@ -541,19 +1076,33 @@ void UXC_HTTPDownload::ReceiveData( BYTE* Data, INT Count )
 		if( RecvFileAr->IsError() )
 			DownloadError( *FString::Printf( *UXC_Download::NetWriteError, TempFilename ) );
 		else
+		{
 			Transfered += Count;
+			GNetMetrics.DownloadBytes += Count;
+			NetBytes += Count;
+			FeedLzmaStream( Data, Count);
+		}
 	}	
 }
 
 
 bool UXC_HTTPDownload::AsyncReceive()
 {
-	uint8 Buf[4096];
 	int32 Bytes = 0;
 	int32 TotalBytes = 0;
 	bool bShutdown = false;
-	while ( Socket.Recv( Buf, sizeof(Buf), Bytes) )
+	uint64 TraceStart = GTraceEnabled ? TraceNow() : 0;
+	while ( true )
 	{
+		uint8* Dest = Parser.GetWriteBuffer();
+		if ( !Dest )
+		{
+			Response.Status = -1; //Internal error
+			DownloadError( TEXT("Bad HTTP response") );
+			return true;
+		}
+		if ( !Socket.Recv( Dest, Parser.WriteSpace(), Bytes) )
+			break;
 		if ( Bytes == 0 )
 		{
 			bShutdown = true;
@@ -561,10 +1110,17 @@ bool UXC_HTTPDownload::AsyncReceive()
 			break;
 		}
 		TotalBytes += Bytes;
-		int32 Start = Response.ReceivedData.Add(Bytes);
-		appMemcpy( &Response.ReceivedData(Start), Buf, Bytes);
+		Parser.Commit( Bytes);
 		SavedLogs.Logf( NAME_DevNetTraffic, TEXT("Received %i bytes"), Bytes);
+		if ( AsyncProcess( false) )
+			return true;
+		if ( (TotalBytes >= HTTP_RECEIVE_SLICE) || FPlatformAtomics::AtomicRead( &Cancelled) ) //Rest comes on the next pin
+			break;
 	}
+	if ( TraceStart && TotalBytes ) //Empty polls are not worth a zone
+		TraceRecord( "HTTP Receive", TraceStart, TraceNow());
+	if ( TotalBytes >= HTTP_RECEIVE_SLICE )
+		return false;
 
 	if ( (Socket.LastError != 0) && !Socket.IsNonBlocking(Socket.LastError) )
 	{
@@ -572,60 +1128,68 @@ bool UXC_HTTPDownload::AsyncReceive()
 		return true;
 	}
 
-	//Process received bytes
-	if ( Response.Status == 0 ) //Header stage
-	{
-		for ( int32 i=0 ; i<Response.ReceivedData.Num()-1 ; i++ )
-			if ( (Response.ReceivedData(i) == '\r') && (Response.ReceivedData(i+1) == '\n') )
-			{
-				Response.HeaderLines.AddZeroed();
-				if ( i == 0 ) //Empty line: EOH
-				{
-					SavedLogs.Logf( NAME_DevNetTraffic, TEXT("HTTP Header END received") );
-					Response.ReceivedData.Remove( 0, 2);
-					break;
-				}
-				TArray<TCHAR>& NewLine = Response.HeaderLines.Last().GetCharArray();
-				NewLine.Add( i+1);
-				for ( int32 j=0 ; j<i ; j++ )
-					NewLine(j) = (TCHAR)Response.ReceivedData(j);
-				NewLine(i) = '\0';
-				SavedLogs.Logf( NAME_DevNetTraffic, TEXT("HTTP Header received: %s"), *Response.HeaderLines.Last() );
-
-				//Remove raw line and keep processing
-				Response.ReceivedData.Remove( 0, i+2);
-				i = -1;
-			}
+	if ( bShutdown )
+		AsyncProcess( true);
+	return bShutdown;
+}
 
-		//EOH included
-		if ( Response.HeaderLines.Num() && (Response.HeaderLines.Last().Len() == 0) )
+//
+// Parses whatever the last read left in the receive buffer.
+// Body bytes go to the file directly from there.
+//
+bool UXC_HTTPDownload::AsyncProcess( bool bShutdown)
+{
+	if ( Parser.State != HTTPPARSE_Body ) //Header stage
+	{
+		if ( !Parser.ParseHeaders( Response, &SavedLogs) )
 		{
-			if ( Response.HeaderLines.Num() < 2 )
+			if ( Parser.State == HTTPPARSE_Error )
 			{
 				Response.Status = -1; //Internal error
 				DownloadError( TEXT("Bad HTTP response") );
 				return true;
 			}
-			const TCHAR* Line = *Response.HeaderLines(0);
-			Response.Version = ParseToken( Line, 0);
-			Response.Status = appAtoi( *ParseToken( Line, 0) );
-			for ( int32 i=1 ; i<Response.HeaderLines.Num()-1 ; i++ )
-			{
-				Line = *Response.HeaderLines(i);
-				FString Key = ParseToken( Line, 0);
-				if ( Key[Key.Len()-1] == ':' )
-					Key.GetCharArray().Remove( Key.Len()-1 );
-				while ( *Line == ' ' )
-					Line++;
-				Response.Headers.Set( *Key, Line);
-			}
-			Response.HeaderLines.Empty();
+			return bShutdown;
 		}
+
+		//HTTP/1.1 keeps the connection unless told otherwise, chunked bodies can't be delimited here
+		FString* ConnectionHeader = Response.Headers.Find( TEXT("Connection"));
+		FString* TransferEncoding = Response.Headers.Find( TEXT("Transfer-Encoding"));
+		if ( ConnectionHeader )
+			KeepAlive = !appStricmp( **ConnectionHeader, TEXT("keep-alive")) || ((Response.Version == TEXT("HTTP/1.1")) && appStricmp( **ConnectionHeader, TEXT("close")));
 		else
-			return bShutdown;
+			KeepAlive = (Response.Version == TEXT("HTTP/1.1"));
+		if ( TransferEncoding && appStricmp( **TransferEncoding, TEXT("identity")) )
+			KeepAlive = 0;
+		FString* ContentLength = Response.Headers.Find( TEXT("Content-Length"));
+		if ( Response.Status == 304 ) //Never has a body
+			KeepAlive = KeepAlive && !bShutdown && !Parser.BodyBytes();
+		else if ( !ContentLength || bShutdown )
+			KeepAlive = 0;
+		else if ( ((Response.Status != 200) && (Response.Status != 206)) || !appAtoi( **ContentLength) ) //Only reuse if the whole redirect/error body is already here
+			KeepAlive = (appAtoi( **ContentLength) == Parser.BodyBytes());
+
+		if ( ResumeFrom && (Response.Status == 200) ) //Range ignored or validator changed, full download
+		{
+			GFileManager->Delete( *(DownloadTempName() + TEXT(".partial")));
+			ResumeFrom = 0;
+		}
 
 		AGAIN:
-		if ( Response.Status == 200 ) //OK
+		if ( Response.Status == 206 ) //Partial content
+		{
+			if ( !ResumeFrom || !StartResume() )
+			{
+				//Retry without Range
+				GFileManager->Delete( *(DownloadTempName() + TEXT(".partial")));
+				GFileManager->Delete( *(DownloadTempName() + TEXT(".resume")));
+				KeepAlive = 0;
+				return true;
+			}
+			Validator.URL = DownloadURL.String();
+			Validator.FromResponse( Response);
+		}
+		else if ( Response.Status == 200 ) //OK
 		{
 			//Cookie, only one supported for now
 			FString* SetCookie = Response.Headers.Find( TEXT("Set-Cookie"));
@@ -642,8 +1206,24 @@ bool UXC_HTTPDownload::AsyncReceive()
 					goto AGAIN;
 				}
 			}
+			SaveResumeValidator();
+			GetHTTPRedirectMemo()->Found( DownloadURL);
+			Validator.URL = DownloadURL.String();
+			Validator.FromResponse( Response);
 		}
-		else if ( Response.Status == 301 || Response.Status == 302 || Response.Status == 303 ||  Response.Status == 307 ) //Permanent redirect + Found + Temporary redirect
+		else if ( Response.Status == 304 ) //Not modified
+		{
+			if ( !Validator.IsValid() ) //Wasn't conditional
+				DownloadError( *FString::Printf( *UXC_Download::InvalidUrlError, *CurrentURL.String() ) );
+			else if ( !AsyncRestoreValidated() )
+			{
+				//Local copy is gone, next request goes without validators
+				SavedLogs.Logf( NAME_DevNet, TEXT("Local copy of '%s' unavailable, downloading"), Info->Parent->GetName());
+				GetHTTPValidatorCache()->Remove( DownloadURL.String());
+			}
+			return true;
+		}
+		else if ( Response.Status == 301 || Response.Status == 302 || Response.Status == 303 ||  Response.Status == 307 || Response.Status == 308 ) //Permanent redirect + Found + Temporary redirect
 		{
 			if ( Response.Status == 303 )
 				Request.Method = TEXT("GET");
@@ -655,13 +1235,19 @@ bool UXC_HTTPDownload::AsyncReceive()
 			else if (Request.RedirectsLeft-- <= 0 )
 				DownloadError( TEXT("Too many redirections") );
 			else
+			{
+				FDownloadURL From = CurrentURL;
 				UpdateCurrentURL( **Location);
+				if ( (Response.Status == 301 || Response.Status == 308) && From.RequestedPackage.Len() ) //First hop only
+					GetHTTPRedirectMemo()->Moved( From, *CurrentURL);
+			}
 			return true;
 		}
 		else if ( Response.Status == 404 )
 		{
 			if ( DownloadURL.Compression > 0 ) //Change compression and retry
 			{
+				GetHTTPRedirectMemo()->Missing( DownloadURL);
 				DownloadURL.Compression--;
 				CurrentURL = DownloadURL;
 			}
@@ -676,18 +1262,22 @@ bool UXC_HTTPDownload::AsyncReceive()
 		}
 	}
 	
-	if ( Response.Status == 200 )
+	if ( (Response.Status == 200) || (Response.Status == 206) )
 	{
 		int32 RealSize = RealFileSize ? RealFileSize : Info->FileSize;
-		int32 Count = (Transfered + Response.ReceivedData.Num() > RealSize) ? RealSize - Transfered : Response.ReceivedData.Num();
+		int32 Count = (Transfered + Parser.BodyBytes() > RealSize) ? RealSize - Transfered : Parser.BodyBytes();
+		if ( (Count < Parser.BodyBytes()) || bShutdown ) //Stray bytes past the body, or server closed
+			KeepAlive = 0;
 		if ( Count > 0 )
-			ReceiveData( &Response.ReceivedData(0), Count );
-		Response.ReceivedData.Empty();
+			ReceiveData( Parser.BodyData(), Count );
+		Parser.ConsumeBody( Parser.BodyBytes());
 		if ( ((Transfered >= RealSize) || bShutdown) && RecvFileAr )
 		{
 			delete RecvFileAr;
 			RecvFileAr = nullptr;
 			bShutdown = true;
+			if ( Transfered >= RealSize )
+				GFileManager->Delete( *(DownloadTempName() + TEXT(".resume")));
 		}
 	}
 
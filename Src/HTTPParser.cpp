@@ -0,0 +1,210 @@
+/*=============================================================================
+	HTTPParser.cpp
+	Author: Fernando Velazquez
+
+	Incremental HTTP response parser.
+	Socket reads go straight into a buffer owned by the parser, header lines
+	are consumed in place and body bytes are handed to the caller without
+	being copied into intermediate arrays.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+
+static FString WidenBytes( const uint8* Data, int32 Len)
+{
+	FString Result;
+	if ( Len > 0 )
+	{
+		TArray<TCHAR>& Chars = Result.GetCharArray();
+		Chars.Add( Len + 1);
+		for ( int32 i=0; i<Len; i++)
+			Chars(i) = (TCHAR)Data[i];
+		Chars(Len) = '\0';
+	}
+	return Result;
+}
+
+void FHTTPParser::Reset()
+{
+	State = HTTPPARSE_StatusLine;
+	Start = 0;
+	End = 0;
+	Scan = 0;
+}
+
+uint8* FHTTPParser::GetWriteBuffer()
+{
+	if ( !Buffer.Num() )
+		Buffer.Add( HTTP_RECV_BUFFER);
+
+	if ( Start == End )
+	{
+		Start = 0;
+		End = 0;
+		Scan = 0;
+	}
+	else if ( (End == Buffer.Num()) && (Start > 0) ) //Move partial line to the front
+	{
+		appMemmove( &Buffer(0), &Buffer(Start), End - Start);
+		End -= Start;
+		Scan -= Start;
+		Start = 0;
+	}
+
+	if ( End == Buffer.Num() )
+		return nullptr;
+	return &Buffer(End);
+}
+
+UBOOL FHTTPParser::ParseHeaders( HTTP_Response& Response, FOutputDevice* Log)
+{
+	while ( State < HTTPPARSE_Body )
+	{
+		//Resume CRLF search where the last read ended
+		int32 i = Max( Scan, Start);
+		while ( (i < End-1) && ((Buffer(i) != '\r') || (Buffer(i+1) != '\n')) )
+			i++;
+		if ( i >= End-1 )
+		{
+			Scan = Max( End-1, Start);
+			return 0;
+		}
+
+		const uint8* Line = &Buffer(Start);
+		int32 Len = i - Start;
+		Start = i + 2;
+		Scan = Start;
+
+		if ( State == HTTPPARSE_StatusLine ) //HTTP/1.1 200 OK
+		{
+			int32 Pos = 0;
+			while ( (Pos < Len) && (Line[Pos] != ' ') )
+				Pos++;
+			Response.Version = WidenBytes( Line, Pos);
+			while ( (Pos < Len) && (Line[Pos] == ' ') )
+				Pos++;
+			int32 Status = 0;
+			while ( (Pos < Len) && (Line[Pos] >= '0') && (Line[Pos] <= '9') )
+				Status = Status * 10 + (Line[Pos++] - '0');
+			if ( !Status || appStrnicmp( *Response.Version, TEXT("HTTP/"), 5) )
+			{
+				State = HTTPPARSE_Error;
+				return 0;
+			}
+			Response.Status = Status;
+			State = HTTPPARSE_Headers;
+			if ( Log )
+				Log->Logf( NAME_DevNetTraffic, TEXT("HTTP Status received: %s %i"), *Response.Version, Status);
+		}
+		else if ( Len == 0 ) //Empty line: EOH
+		{
+			State = HTTPPARSE_Body;
+			if ( Log )
+				Log->Logf( NAME_DevNetTraffic, TEXT("HTTP Header END received") );
+		}
+		else
+		{
+			int32 Colon = 0;
+			while ( (Colon < Len) && (Line[Colon] != ':') )
+				Colon++;
+			if ( (Colon == 0) || (Colon == Len) ) //Malformed, skip
+				continue;
+			int32 Value = Colon + 1;
+			while ( (Value < Len) && ((Line[Value] == ' ') || (Line[Value] == '\t')) )
+				Value++;
+			FString Key = WidenBytes( Line, Colon);
+			FString Text = WidenBytes( Line + Value, Len - Value);
+			if ( Log )
+				Log->Logf( NAME_DevNetTraffic, TEXT("HTTP Header received: %s: %s"), *Key, *Text);
+			Response.Headers.Set( Key, Text);
+		}
+	}
+	return State == HTTPPARSE_Body;
+}
+
+void FHTTPParser::ConsumeBody( int32 Count)
+{
+	Start += Count;
+	if ( Start >= End )
+	{
+		Start = 0;
+		End = 0;
+		Scan = 0;
+	}
+}
+
+/*----------------------------------------------------------------------------
+	Microbenchmark.
+	HTTPBENCH [COUNT=responses] [CHUNK=bytes per read] [BODY=bytes]
+----------------------------------------------------------------------------*/
+
+UBOOL ExecHTTPBenchmark( const TCHAR* Cmd, FOutputDevice& Ar)
+{
+	guard(ExecHTTPBenchmark);
+	int32 Count = 2000;
+	int32 Chunk = 1448; //Typical TCP segment payload
+	int32 BodySize = 65536;
+	Parse( Cmd, TEXT("COUNT="), Count);
+	Parse( Cmd, TEXT("CHUNK="), Chunk);
+	Parse( Cmd, TEXT("BODY="), BodySize);
+	Count = Clamp( Count, 1, 1000000);
+	Chunk = Clamp( Chunk, 1, HTTP_RECV_BUFFER);
+	BodySize = Clamp( BodySize, 0, 64 * 1024 * 1024);
+
+	//Redirect server response as seen in the wild
+	FString Header = FString::Printf( TEXT("HTTP/1.1 200 OK\r\n")
+		TEXT("Date: Mon, 19 Oct 2026 12:00:00 GMT\r\n")
+		TEXT("Server: Apache/2.4.41 (Ubuntu)\r\n")
+		TEXT("Last-Modified: Sat, 17 Oct 2026 08:30:00 GMT\r\n")
+		TEXT("ETag: \"10000-5b2a1c3e4f5d6\"\r\n")
+		TEXT("Accept-Ranges: bytes\r\n")
+		TEXT("Content-Length: %i\r\n")
+		TEXT("Cache-Control: max-age=86400\r\n")
+		TEXT("Expires: Tue, 20 Oct 2026 12:00:00 GMT\r\n")
+		TEXT("Keep-Alive: timeout=5, max=100\r\n")
+		TEXT("Connection: Keep-Alive\r\n")
+		TEXT("Content-Type: application/octet-stream\r\n")
+		TEXT("\r\n"), BodySize);
+	TArray<uint8> Raw;
+	Raw.Add( Header.Len() + BodySize);
+	for ( int32 i=0; i<Header.Len(); i++)
+		Raw(i) = (uint8)(*Header)[i];
+	if ( BodySize )
+		appMemzero( &Raw(Header.Len()), BodySize);
+
+	FHTTPParser Parser;
+	int32 HeaderCount = 0;
+	QWORD BodyBytes = 0;
+	double StartTime = appSecondsNew();
+	for ( int32 n=0; n<Count; n++)
+	{
+		HTTP_Response Response;
+		Parser.Reset();
+		for ( int32 Pos=0; Pos<Raw.Num(); )
+		{
+			uint8* Dest = Parser.GetWriteBuffer();
+			if ( !Dest )
+			{
+				Ar.Logf( TEXT("HTTPBENCH: header does not fit in receive buffer"));
+				return 1;
+			}
+			int32 Bytes = Min( Min( Chunk, Parser.WriteSpace()), Raw.Num() - Pos);
+			appMemcpy( Dest, &Raw(Pos), Bytes); //Stands in for recv()
+			Parser.Commit( Bytes);
+			Pos += Bytes;
+			if ( (Parser.State != HTTPPARSE_Body) && !Parser.ParseHeaders( Response) )
+				continue;
+			BodyBytes += Parser.BodyBytes();
+			Parser.ConsumeBody( Parser.BodyBytes());
+		}
+		HeaderCount = Response.Headers.Num();
+	}
+	double Seconds = Max( appSecondsNew() - StartTime, 0.000001);
+	double TotalMB = (double)Raw.Num() * Count / (1024.0 * 1024.0);
+
+	Ar.Logf( TEXT("HTTPBENCH: %i responses (%i headers, %i body bytes) in %i byte reads"), Count, HeaderCount, BodySize, Chunk);
+	Ar.Logf( TEXT("HTTPBENCH: %.3f sec, %.1f MB/s, %.0f responses/s, %.1f MB of body consumed"), Seconds, TotalMB / Seconds, Count / Seconds, (double)BodyBytes / (1024.0 * 1024.0));
+	return 1;
+	unguard;
+}
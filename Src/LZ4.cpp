@@ -0,0 +1,362 @@
+/*=============================================================================
+	LZ4.cpp
+	Author: Fernando Velazquez
+
+	Minimal LZ4 block format codec.
+	Greedy matcher with a small hash table, good enough for packets
+	no larger than a few hundred bytes.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT      12
+#define LZ4_HASH_LOG     12
+#define LZ4_MAX_INPUT    0xFFFF
+
+static inline uint32 LZ4_Read32( const uint8* P)
+{
+	return (uint32)P[0] | ((uint32)P[1] << 8) | ((uint32)P[2] << 16) | ((uint32)P[3] << 24);
+}
+
+static inline uint32 LZ4_Hash( uint32 Sequence)
+{
+	return (Sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes the 255-run length extension, returns false if out of space
+static inline bool LZ4_WriteLength( uint8*& Op, const uint8* OEnd, int32 Length)
+{
+	for ( ; Length >= 255; Length -= 255 )
+	{
+		if ( Op >= OEnd )
+			return false;
+		*Op++ = 255;
+	}
+	if ( Op >= OEnd )
+		return false;
+	*Op++ = (uint8)Length;
+	return true;
+}
+
+// Emits literals [Anchor,Ip) followed by an optional match
+static inline bool LZ4_WriteSequence( uint8*& Op, const uint8* OEnd, const uint8* Anchor, const uint8* Ip, int32 Offset, int32 MatchLength)
+{
+	int32 LiteralLength = (int32)(Ip - Anchor);
+	if ( Op >= OEnd )
+		return false;
+	uint8* Token = Op++;
+	*Token = (uint8)(Min( LiteralLength, 15) << 4);
+	if ( (LiteralLength >= 15) && !LZ4_WriteLength( Op, OEnd, LiteralLength - 15) )
+		return false;
+	if ( Op + LiteralLength > OEnd )
+		return false;
+	appMemcpy( Op, Anchor, LiteralLength);
+	Op += LiteralLength;
+
+	if ( MatchLength ) //Last sequence has no match
+	{
+		if ( Op + 2 > OEnd )
+			return false;
+		*Op++ = (uint8)(Offset & 0xFF);
+		*Op++ = (uint8)(Offset >> 8);
+		int32 Extra = MatchLength - LZ4_MINMATCH;
+		*Token |= (uint8)Min( Extra, 15);
+		if ( (Extra >= 15) && !LZ4_WriteLength( Op, OEnd, Extra - 15) )
+			return false;
+	}
+	return true;
+}
+
+int32 LZ4_CompressBlock( const uint8* Src, int32 SrcSize, uint8* Dst, int32 DstCapacity)
+{
+	if ( (SrcSize <= 0) || (SrcSize > LZ4_MAX_INPUT) || (DstCapacity <= 0) )
+		return 0;
+
+	uint16 HashTable[1 << LZ4_HASH_LOG];
+	appMemzero( HashTable, sizeof(HashTable));
+
+	const uint8* Ip         = Src;
+	const uint8* Anchor     = Src;
+	const uint8* IEnd       = Src + SrcSize;
+	const uint8* MFLimit    = IEnd - LZ4_MFLIMIT;
+	const uint8* MatchLimit = IEnd - LZ4_LASTLITERALS;
+	uint8* Op               = Dst;
+	const uint8* OEnd       = Dst + DstCapacity;
+
+	if ( SrcSize > LZ4_MFLIMIT )
+	{
+		while ( Ip < MFLimit )
+		{
+			uint32 Sequence = LZ4_Read32( Ip);
+			uint32 Hash = LZ4_Hash( Sequence);
+			const uint8* Ref = Src + HashTable[Hash];
+			HashTable[Hash] = (uint16)(Ip - Src);
+			if ( (Ref >= Ip) || (LZ4_Read32(Ref) != Sequence) )
+			{
+				Ip++;
+				continue;
+			}
+
+			int32 MatchLength = LZ4_MINMATCH;
+			while ( (Ip + MatchLength < MatchLimit) && (Ip[MatchLength] == Ref[MatchLength]) )
+				MatchLength++;
+
+			if ( !LZ4_WriteSequence( Op, OEnd, Anchor, Ip, (int32)(Ip - Ref), MatchLength) )
+				return 0;
+			Ip += MatchLength;
+			Anchor = Ip;
+		}
+	}
+
+	if ( !LZ4_WriteSequence( Op, OEnd, Anchor, IEnd, 0, 0) )
+		return 0;
+	return (int32)(Op - Dst);
+}
+
+int32 LZ4_DecompressBlock( const uint8* Src, int32 SrcSize, uint8* Dst, int32 DstCapacity)
+{
+	const uint8* Ip   = Src;
+	const uint8* IEnd = Src + SrcSize;
+	uint8* Op         = Dst;
+	uint8* OEnd       = Dst + DstCapacity;
+
+	while ( Ip < IEnd )
+	{
+		uint8 Token = *Ip++;
+
+		// Literals
+		int32 Length = Token >> 4;
+		if ( Length == 15 )
+		{
+			uint8 Byte;
+			do
+			{
+				if ( Ip >= IEnd )
+					return -1;
+				Byte = *Ip++;
+				Length += Byte;
+			} while ( Byte == 255 );
+		}
+		if ( (Length > IEnd - Ip) || (Length > OEnd - Op) )
+			return -1;
+		appMemcpy( Op, Ip, Length);
+		Ip += Length;
+		Op += Length;
+		if ( Ip == IEnd ) //Last sequence
+			break;
+
+		// Match
+		if ( IEnd - Ip < 2 )
+			return -1;
+		int32 Offset = (int32)Ip[0] | ((int32)Ip[1] << 8);
+		Ip += 2;
+		if ( (Offset == 0) || (Offset > Op - Dst) )
+			return -1;
+		Length = Token & 15;
+		if ( Length == 15 )
+		{
+			uint8 Byte;
+			do
+			{
+				if ( Ip >= IEnd )
+					return -1;
+				Byte = *Ip++;
+				Length += Byte;
+			} while ( Byte == 255 );
+		}
+		Length += LZ4_MINMATCH;
+		if ( Length > OEnd - Op )
+			return -1;
+		const uint8* Ref = Op - Offset;
+		while ( Length-- > 0 ) //Byte copy, ranges may overlap
+			*Op++ = *Ref++;
+	}
+	return (int32)(Op - Dst);
+}
+
+/*-----------------------------------------------------------------------------
+	Packet capture and benchmark.
+	Outgoing packets are captured before compression, the benchmark then
+	runs the codec over them so CompressThreshold can be chosen from real
+	traffic instead of guessed.
+	Capture files: [uint16 size][data] repeated, little endian.
+-----------------------------------------------------------------------------*/
+
+#define LZ4_BENCH_BUCKETS 5
+static const int32 LZ4BenchBounds[LZ4_BENCH_BUCKETS] = { 64, 128, 256, 512, LZ4_MAX_INPUT+1 };
+static const int32 LZ4BenchThresholds[] = { 32, 64, 96, 128, 192, 256, 384, 512 };
+
+void UXC_TcpNetDriver::CapturePacket( const uint8* Data, int32 Count)
+{
+	if ( (Count <= 0) || (Count > LZ4_MAX_INPUT) )
+		return;
+	int32 i = CapturedPackets.Add( Count + 2);
+	CapturedPackets(i)   = (uint8)Count;
+	CapturedPackets(i+1) = (uint8)(Count >> 8);
+	appMemcpy( &CapturedPackets(i+2), Data, Count);
+	if ( --CaptureLeft == 0 )
+		debugf( NAME_DevNet, TEXT("Packet capture complete, %i KB captured"), CapturedPackets.Num() / 1024);
+}
+
+//
+// NETSTATS CAPTURE [COUNT=n]
+// NETSTATS CAPTURE SAVE [FILE=Filename]
+// NETSTATS LZ4BENCH [FILE=Filename] [ROUNDS=n]
+//
+UBOOL UXC_TcpNetDriver::ExecCompressBenchmark( const TCHAR* Str, FOutputDevice& Ar)
+{
+	guard(UXC_TcpNetDriver::ExecCompressBenchmark);
+	FString Filename = TEXT("../Logs/XC_Packets.cap");
+	Parse( Str, TEXT("FILE="), Filename);
+
+	if ( ParseCommand( &Str, TEXT("CAPTURE")) )
+	{
+		if ( ParseCommand( &Str, TEXT("SAVE")) )
+		{
+			TArray<BYTE> Bytes;
+			Bytes.Add( CapturedPackets.Num());
+			if ( Bytes.Num() )
+				appMemcpy( &Bytes(0), &CapturedPackets(0), Bytes.Num());
+			if ( Bytes.Num() && appSaveArrayToFile( Bytes, *Filename) )
+				Ar.Logf( TEXT("%i KB of captured packets written to %s"), Bytes.Num() / 1024, *Filename);
+			else
+				Ar.Logf( TEXT("Unable to write captured packets to %s"), *Filename);
+			return 1;
+		}
+		int32 Count = 5000;
+		Parse( Str, TEXT("COUNT="), Count);
+		CaptureLeft = Clamp( Count, 1, 100000);
+		CapturedPackets.Empty();
+		Ar.Logf( TEXT("Capturing the next %i outgoing packets"), CaptureLeft);
+		return 1;
+	}
+
+	// Benchmark what was captured, or a capture file.
+	TArray<uint8> Packets;
+	if ( Parse( Str, TEXT("FILE="), Filename) )
+	{
+		TArray<BYTE> Bytes;
+		if ( !appLoadFileToArray( Bytes, *Filename) )
+		{
+			Ar.Logf( TEXT("Unable to read captured packets from %s"), *Filename);
+			return 1;
+		}
+		Packets.Add( Bytes.Num());
+		if ( Bytes.Num() )
+			appMemcpy( &Packets(0), &Bytes(0), Bytes.Num());
+	}
+	else
+		Packets = CapturedPackets;
+	int32 Rounds = 20;
+	Parse( Str, TEXT("ROUNDS="), Rounds);
+	Rounds = Clamp( Rounds, 1, 1000);
+
+	struct FBucket
+	{
+		int32 Packets;
+		uint64 BytesIn;
+		uint64 BytesOut; //What LowLevelSend would send, including the trailer
+		uint64 Compressed; //Packets that got smaller
+		DWORD CompressCycles;
+		DWORD DecompressCycles;
+	} Buckets[LZ4_BENCH_BUCKETS];
+	appMemzero( Buckets, sizeof(Buckets));
+	uint64 SavedAt[ARRAY_COUNT(LZ4BenchThresholds)] = {0};
+	double CostAt[ARRAY_COUNT(LZ4BenchThresholds)] = {0};
+	uint64 TotalBytes = 0;
+	int32 TotalPackets = 0;
+	int32 Errors = 0;
+
+	static uint8 Compressed[LZ4_MAX_INPUT];
+	static uint8 Decompressed[LZ4_MAX_INPUT];
+	for ( int32 Pos=0; Pos+2<=Packets.Num(); )
+	{
+		int32 Count = Packets(Pos) | (Packets(Pos+1) << 8);
+		const uint8* Data = &Packets(Pos+2);
+		Pos += 2 + Count;
+		if ( (Pos > Packets.Num()) || (Count > LZ4_MAX_INPUT) )
+			break;
+
+		// Same capacity rule as LowLevelSend.
+		int32 Capacity = Count - 3;
+		int32 CompressedSize = 0;
+		DWORD CompressCycles = 0;
+		DWORD DecompressCycles = 0;
+		for ( int32 r=0; r<Rounds; r++)
+		{
+			clockFast( CompressCycles);
+			CompressedSize = (Capacity > 0) ? LZ4_CompressBlock( Data, Count, Compressed, Capacity) : 0;
+			unclockFast( CompressCycles);
+		}
+		if ( CompressedSize > 0 )
+		{
+			int32 DecompressedSize = 0;
+			for ( int32 r=0; r<Rounds; r++)
+			{
+				clockFast( DecompressCycles);
+				DecompressedSize = LZ4_DecompressBlock( Compressed, CompressedSize, Decompressed, sizeof(Decompressed));
+				unclockFast( DecompressCycles);
+			}
+			if ( (DecompressedSize != Count) || appMemcmp( Decompressed, Data, Count) )
+				Errors++;
+		}
+
+		int32 b = 0;
+		while ( Count >= LZ4BenchBounds[b] )
+			b++;
+		FBucket& Bucket = Buckets[b];
+		int32 SentSize = (CompressedSize > 0) ? (CompressedSize + 2) : Count;
+		Bucket.Packets++;
+		Bucket.BytesIn += Count;
+		Bucket.BytesOut += SentSize;
+		Bucket.Compressed += (CompressedSize > 0);
+		Bucket.CompressCycles += CompressCycles / Rounds;
+		Bucket.DecompressCycles += DecompressCycles / Rounds;
+		for ( int32 t=0; t<ARRAY_COUNT(LZ4BenchThresholds); t++)
+			if ( Count >= LZ4BenchThresholds[t] )
+			{
+				SavedAt[t] += Count - SentSize;
+				CostAt[t] += (CompressCycles + DecompressCycles) * GSecondsPerCycle / Rounds;
+			}
+		TotalBytes += Count;
+		TotalPackets++;
+	}
+
+	if ( !TotalPackets )
+	{
+		Ar.Logf( TEXT("No captured packets, use NETSTATS CAPTURE first"));
+		return 1;
+	}
+	Ar.Logf( TEXT("LZ4 benchmark: %i packets, %i KB, %i rounds%s"), TotalPackets, (int32)(TotalBytes / 1024), Rounds, Errors ? *FString::Printf( TEXT(", %i ROUND TRIP ERRORS"), Errors) : TEXT(""));
+	Ar.Logf( TEXT("%-10s %7s %6s %8s %10s %10s"), TEXT("Size"), TEXT("Packets"), TEXT("Comp%"), TEXT("Saved%"), TEXT("Comp MB/s"), TEXT("Dec MB/s") );
+	for ( int32 b=0; b<LZ4_BENCH_BUCKETS; b++)
+	{
+		FBucket& Bucket = Buckets[b];
+		if ( !Bucket.Packets )
+			continue;
+		double CompressSeconds = Bucket.CompressCycles * GSecondsPerCycle;
+		double DecompressSeconds = Bucket.DecompressCycles * GSecondsPerCycle;
+		Ar.Logf( TEXT("%4i-%-5i %7i %6.1f %8.2f %10.1f %10.1f")
+			, b ? LZ4BenchBounds[b-1] : 0
+			, LZ4BenchBounds[b] - 1
+			, Bucket.Packets
+			, 100.0 * Bucket.Compressed / Bucket.Packets
+			, 100.0 * (double)(Bucket.BytesIn - Bucket.BytesOut) / (double)Bucket.BytesIn
+			, (CompressSeconds > 0) ? (Bucket.BytesIn / CompressSeconds / 1048576.0) : 0.0
+			, (DecompressSeconds > 0) ? (Bucket.BytesIn / DecompressSeconds / 1048576.0) : 0.0 );
+	}
+
+	// CPU per KB saved at each candidate threshold, both ends of the link.
+	Ar.Logf( TEXT("%-9s %8s %8s %10s"), TEXT("Threshold"), TEXT("Saved%"), TEXT("CPU ms"), TEXT("us/KB"));
+	for ( int32 t=0; t<ARRAY_COUNT(LZ4BenchThresholds); t++)
+		Ar.Logf( TEXT("%9i %8.2f %8.2f %10.2f%s")
+			, LZ4BenchThresholds[t]
+			, 100.0 * (double)SavedAt[t] / (double)TotalBytes
+			, CostAt[t] * 1000.0
+			, SavedAt[t] ? (CostAt[t] * 1000000.0 / (SavedAt[t] / 1024.0)) : 0.0
+			, (LZ4BenchThresholds[t] == CompressThreshold) ? TEXT(" <") : TEXT("") );
+	return 1;
+	unguard;
+}
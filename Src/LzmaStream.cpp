@@ -0,0 +1,146 @@
+/*=============================================================================
+	LzmaStream.cpp
+	Author: Fernando Velazquez
+
+	Unpacks .lzma downloads as they arrive using the LZMA SDK decoder.
+	Layout is the one written by LzmaCompress: 5 bytes of coder properties,
+	the uncompressed size as a QWORD, then the compressed stream.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+#include "LzmaDec.h"
+
+static void* LzmaAlloc( ISzAllocPtr, size_t Size)
+{
+	return appMalloc( (DWORD)Size, TEXT("LzmaStream"));
+}
+
+static void LzmaFree( ISzAllocPtr, void* Address)
+{
+	if ( Address )
+		appFree( Address);
+}
+
+static const ISzAlloc LzmaAllocator = { &LzmaAlloc, &LzmaFree };
+
+FLzmaStream::FLzmaStream()
+	: Decoder(nullptr)
+	, Writer(nullptr)
+	, HeaderSize(0)
+	, ExpectedSize(0)
+	, Written(0)
+{}
+
+//
+// Output that didn't reach its full size is deleted.
+//
+FLzmaStream::~FLzmaStream()
+{
+	if ( Decoder )
+	{
+		LzmaDec_Free( (CLzmaDec*)Decoder, &LzmaAllocator);
+		delete (CLzmaDec*)Decoder;
+	}
+	if ( Writer )
+	{
+		delete Writer;
+		GFileManager->Delete( *Filename);
+	}
+}
+
+UBOOL FLzmaStream::Open( const TCHAR* InFilename, int32 InExpectedSize)
+{
+	Filename = InFilename;
+	ExpectedSize = InExpectedSize;
+	Writer = GFileManager->CreateFileWriter( InFilename);
+	if ( !Writer )
+		Error = FString::Printf( TEXT("Unable to create %s"), InFilename);
+	return Writer != nullptr;
+}
+
+//
+// Returns false once the stream is broken, Error tells why.
+//
+UBOOL FLzmaStream::Write( const uint8* Data, int32 Count)
+{
+	if ( !Writer || Error.Len() )
+		return 0;
+
+	// Header first, the decoder is set up once it's complete.
+	if ( HeaderSize < (int32)sizeof(Header) )
+	{
+		int32 Copy = Min<int32>( Count, sizeof(Header) - HeaderSize);
+		appMemcpy( Header + HeaderSize, Data, Copy);
+		HeaderSize += Copy;
+		Data += Copy;
+		Count -= Copy;
+		if ( HeaderSize < (int32)sizeof(Header) )
+			return 1;
+		if ( *(QWORD*)&Header[LZMA_PROPS_SIZE] != (QWORD)ExpectedSize )
+		{
+			Error = TEXT("LZMA header doesn't match package size");
+			return 0;
+		}
+		CLzmaDec* NewDecoder = new CLzmaDec;
+		LzmaDec_Construct( NewDecoder);
+		if ( LzmaDec_Allocate( NewDecoder, Header, LZMA_PROPS_SIZE, &LzmaAllocator) != SZ_OK )
+		{
+			delete NewDecoder;
+			Error = TEXT("Bad LZMA properties");
+			return 0;
+		}
+		LzmaDec_Init( NewDecoder);
+		Decoder = NewDecoder;
+	}
+
+	// Never decode past the package size, an end marker may follow.
+	uint8 Out[16384];
+	while ( (Count > 0) && (Written < ExpectedSize) )
+	{
+		SizeT OutSize = Min<int32>( sizeof(Out), ExpectedSize - Written);
+		SizeT InSize = Count;
+		ELzmaStatus Status;
+		if ( LzmaDec_DecodeToBuf( (CLzmaDec*)Decoder, Out, &OutSize, Data, &InSize, LZMA_FINISH_ANY, &Status) != SZ_OK )
+		{
+			Error = TEXT("LZMA data error");
+			return 0;
+		}
+		Data += InSize;
+		Count -= (int32)InSize;
+		if ( OutSize )
+		{
+			Writer->Serialize( Out, (INT)OutSize);
+			if ( Writer->IsError() )
+			{
+				Error = FString::Printf( TEXT("Unable to write %s"), *Filename);
+				return 0;
+			}
+			Written += (int32)OutSize;
+		}
+		if ( Status == LZMA_STATUS_FINISHED_WITH_MARK )
+			break;
+		if ( !InSize && !OutSize ) //Needs more input
+			break;
+	}
+	return 1;
+}
+
+//
+// Closes the package, returns true if it has the expected size.
+//
+UBOOL FLzmaStream::Finish()
+{
+	if ( !Writer )
+		return 0;
+	if ( !Error.Len() && (Written != ExpectedSize) )
+		Error = FString::Printf( TEXT("Decompressed size %i doesn't match package size %i"), Written, ExpectedSize);
+	delete Writer;
+	Writer = nullptr;
+	if ( Error.Len() )
+	{
+		GFileManager->Delete( *Filename);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,359 @@
+/*=============================================================================
+	Metrics.cpp
+	Author: Fernando Velazquez
+
+	Lightweight Prometheus-style metrics listener.
+	Only binds to localhost and runs on its own thread, scraping
+	never touches the game thread.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef _WIN32
+	#include <ws2tcpip.h>
+	typedef SOCKET FRawSocket;
+	#define INVALID_RAW_SOCKET INVALID_SOCKET
+	#define CloseRawSocket closesocket
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+	#include <unistd.h>
+	#include <sys/time.h>
+	#include <poll.h>
+	typedef int FRawSocket;
+	#define INVALID_RAW_SOCKET -1
+	#define CloseRawSocket close
+#endif
+
+#define METRICS_CLIENT_TIMEOUT 2.0
+
+FNetMetrics GNetMetrics;
+
+//
+// Owned by the listener thread, which closes the socket on exit.
+//
+struct FMetricsListener
+{
+	FRawSocket Socket;
+	volatile int32 bExit;
+};
+
+static FMetricsListener* MetricsListener = nullptr;
+static CThread* MetricsThread = nullptr;
+static int32 MetricsUsers = 0; //Drivers holding the listener (game thread)
+
+// Upper bounds in seconds, last bucket is +Inf
+static const double DispatchBounds[METRICS_DISPATCH_BUCKETS-1] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025 };
+
+// Bytes per second and seconds, last bucket is +Inf
+static const double DownloadRateBounds[METRICS_DOWNLOAD_RATE_BUCKETS-1] = { 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864 };
+static const double DownloadTimeBounds[METRICS_DOWNLOAD_TIME_BUCKETS-1] = { 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+
+static int32 FindBucket( const double* Bounds, int32 NumBuckets, double Value)
+{
+	int32 i = 0;
+	while ( (i < NumBuckets-1) && (Value > Bounds[i]) )
+		i++;
+	return i;
+}
+
+void FNetMetrics::AddDispatchTime( double Seconds )
+{
+	DispatchBuckets[FindBucket( DispatchBounds, METRICS_DISPATCH_BUCKETS, Seconds)]++;
+	DispatchCount++;
+	DispatchSeconds += Seconds;
+}
+
+//
+// Finished download that came over the network.
+//
+void FNetMetrics::AddDownload( int32 Bytes, double Seconds )
+{
+	if ( (Bytes <= 0) || (Seconds <= 0) )
+		return;
+	double Rate = (double)Bytes / Seconds;
+	DownloadRateBuckets[FindBucket( DownloadRateBounds, METRICS_DOWNLOAD_RATE_BUCKETS, Rate)]++;
+	DownloadTimeBuckets[FindBucket( DownloadTimeBounds, METRICS_DOWNLOAD_TIME_BUCKETS, Seconds)]++;
+	DownloadTimed++;
+	DownloadRateSum += Rate;
+	DownloadSeconds += Seconds;
+}
+
+/*-----------------------------------------------------------------------------
+	Text exposition.
+-----------------------------------------------------------------------------*/
+
+struct FMetricsText
+{
+	char Buffer[8192];
+	int32 Len;
+
+	FMetricsText() : Len(0) { Buffer[0] = '\0'; }
+
+	void Printf( const char* Fmt, ...)
+	{
+		if ( Len >= (int32)sizeof(Buffer) - 1 )
+			return;
+		va_list Args;
+		va_start( Args, Fmt);
+		int32 Written = vsnprintf( Buffer + Len, sizeof(Buffer) - Len, Fmt, Args);
+		va_end( Args);
+		if ( Written > 0 )
+			Len = Min<int32>( Len + Written, sizeof(Buffer) - 1);
+	}
+
+	void Counter( const char* Name, const char* Help, double Value)
+	{
+		Printf( "# HELP %s %s\n# TYPE %s counter\n%s %.0f\n", Name, Help, Name, Name, Value);
+	}
+
+	void Gauge( const char* Name, const char* Help, double Value)
+	{
+		Printf( "# HELP %s %s\n# TYPE %s gauge\n%s %.0f\n", Name, Help, Name, Name, Value);
+	}
+
+	void Histogram( const char* Name, const char* Help, const double* Bounds, const uint64* Buckets, int32 NumBuckets, double Sum, uint64 Count)
+	{
+		Printf( "# HELP %s %s\n# TYPE %s histogram\n", Name, Help, Name);
+		uint64 Cumulative = 0;
+		for ( int32 i=0; i<NumBuckets; i++)
+		{
+			Cumulative += Buckets[i];
+			if ( i < NumBuckets-1 )
+				Printf( "%s_bucket{le=\"%g\"} %.0f\n", Name, Bounds[i], (double)Cumulative);
+			else
+				Printf( "%s_bucket{le=\"+Inf\"} %.0f\n", Name, (double)Cumulative);
+		}
+		Printf( "%s_sum %.6f\n%s_count %.0f\n", Name, Sum, Name, (double)Count);
+	}
+};
+
+static void ExportMetrics( FMetricsText& Out)
+{
+	// Take a copy so that the values are consistent with each other.
+	FNetMetrics M = GNetMetrics;
+
+	Out.Counter( "xc_net_sent_bytes_total",       "UDP bytes sent.", (double)M.BytesSent);
+	Out.Counter( "xc_net_received_bytes_total",   "UDP bytes received.", (double)M.BytesRecv);
+	Out.Counter( "xc_net_sent_packets_total",     "UDP packets sent.", (double)M.PacketsSent);
+	Out.Counter( "xc_net_received_packets_total", "UDP packets received.", (double)M.PacketsRecv);
+	Out.Counter( "xc_net_send_failures_total",    "Failed UDP sends.", (double)M.SendFailures);
+	Out.Counter( "xc_net_send_queued_total",      "UDP sends deferred on a full send buffer.", (double)M.SendQueued);
+	Out.Counter( "xc_net_send_queue_drops_total", "Deferred sends dropped by the queue limit.", (double)M.SendQueueDrops);
+	Out.Counter( "xc_net_port_unreach_total",     "ICMP port unreachable events.", (double)M.PortUnreach);
+	Out.Counter( "xc_net_accepted_total",         "Client connections accepted.", (double)M.ConnectionsAccepted);
+	Out.Counter( "xc_net_accept_rejected_total",  "Packets from unknown endpoints that were not accepted.", (double)M.AcceptRejected);
+	Out.Gauge  ( "xc_net_connections",            "Open client connections of all drivers.", M.Connections);
+	Out.Counter( "xc_net_bwe_increases_total",    "Adaptive net speed increases.", (double)M.BandwidthIncreases);
+	Out.Counter( "xc_net_bwe_decreases_total",    "Adaptive net speed decreases.", (double)M.BandwidthDecreases);
+
+	Out.Histogram( "xc_net_dispatch_seconds", "TickDispatch time per tick.", DispatchBounds, M.DispatchBuckets, METRICS_DISPATCH_BUCKETS, M.DispatchSeconds, M.DispatchCount);
+
+	Out.Counter( "xc_resolver_cache_hits_total",   "Local address registry hits.", (double)M.ResolverCacheHits);
+	Out.Counter( "xc_resolver_cache_misses_total", "Local address registry resolves.", (double)M.ResolverCacheMisses);
+
+	Out.Counter( "xc_http_downloads_started_total",   "HTTP downloads started.", (double)M.DownloadsStarted);
+	Out.Counter( "xc_http_downloads_completed_total", "HTTP downloads completed.", (double)M.DownloadsCompleted);
+	Out.Counter( "xc_http_downloads_failed_total",    "HTTP downloads failed.", (double)M.DownloadsFailed);
+	Out.Counter( "xc_http_download_bytes_total",      "HTTP bytes downloaded.", (double)M.DownloadBytes);
+	Out.Histogram( "xc_http_download_rate_bytes_per_second", "Throughput of finished HTTP downloads.", DownloadRateBounds, M.DownloadRateBuckets, METRICS_DOWNLOAD_RATE_BUCKETS, M.DownloadRateSum, M.DownloadTimed);
+	Out.Histogram( "xc_http_download_seconds", "Duration of finished HTTP downloads.", DownloadTimeBounds, M.DownloadTimeBuckets, METRICS_DOWNLOAD_TIME_BUCKETS, M.DownloadSeconds, M.DownloadTimed);
+}
+
+/*-----------------------------------------------------------------------------
+	Listener thread.
+-----------------------------------------------------------------------------*/
+
+static void SendAll( FRawSocket Socket, const char* Data, int32 Len)
+{
+	while ( Len > 0 )
+	{
+		int32 Sent = (int32)send( Socket, Data, Len, 0);
+		if ( Sent <= 0 )
+			return;
+		Data += Sent;
+		Len -= Sent;
+	}
+}
+
+//
+// A stalled client can't hold the single listener thread for longer than this.
+//
+static void SetClientTimeout( FRawSocket Client, double Seconds)
+{
+#ifdef _WIN32
+	DWORD Timeout = (DWORD)(Seconds * 1000.0);
+#else
+	timeval Timeout;
+	Timeout.tv_sec = (time_t)Seconds;
+	Timeout.tv_usec = (suseconds_t)((Seconds - (double)Timeout.tv_sec) * 1000000.0);
+#endif
+	setsockopt( Client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+	setsockopt( Client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&Timeout, sizeof(Timeout));
+}
+
+static void ServeClient( FRawSocket Client)
+{
+	// One request per connection, only the request line matters.
+	// Clients trickling bytes in are cut off at the deadline.
+	SetClientTimeout( Client, METRICS_CLIENT_TIMEOUT);
+	double Deadline = appSecondsNew() + METRICS_CLIENT_TIMEOUT;
+	char Request[1024];
+	int32 Len = 0;
+	while ( Len < (int32)sizeof(Request) - 1 )
+	{
+		int32 Received = (int32)recv( Client, Request + Len, sizeof(Request) - 1 - Len, 0);
+		if ( Received <= 0 )
+			break;
+		Len += Received;
+		Request[Len] = '\0';
+		if ( strstr( Request, "\r\n\r\n") )
+			break;
+		if ( appSecondsNew() > Deadline )
+		{
+			Len = 0;
+			break;
+		}
+	}
+	Request[Len] = '\0';
+	if ( !Len ) //Timed out or closed
+	{
+		CloseRawSocket( Client);
+		return;
+	}
+
+	if ( !strncmp( Request, "GET /metrics ", 13) || !strncmp( Request, "GET / ", 6) )
+	{
+		FMetricsText Body;
+		ExportMetrics( Body);
+		char Header[256];
+		int32 HeaderLen = snprintf( Header, sizeof(Header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %i\r\nConnection: close\r\n\r\n", Body.Len);
+		SendAll( Client, Header, HeaderLen);
+		SendAll( Client, Body.Buffer, Body.Len);
+	}
+	else
+	{
+		const char* NotFound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		SendAll( Client, NotFound, (int32)strlen(NotFound));
+	}
+	CloseRawSocket( Client);
+}
+
+//
+// Accept doesn't return when the listener is closed on every platform,
+// the thread checks for exit between short waits instead.
+//
+static UBOOL WaitClient( FRawSocket Listener, double Seconds)
+{
+#ifdef _WIN32
+	fd_set Readable;
+	FD_ZERO( &Readable);
+	FD_SET( Listener, &Readable);
+	timeval Timeout;
+	Timeout.tv_sec = 0;
+	Timeout.tv_usec = (long)(Seconds * 1000000.0);
+	return select( 0, &Readable, nullptr, nullptr, &Timeout) > 0;
+#else
+	pollfd Fd;
+	Fd.fd = Listener;
+	Fd.events = POLLIN;
+	Fd.revents = 0;
+	return poll( &Fd, 1, appRound( Seconds * 1000.0)) > 0;
+#endif
+}
+
+static unsigned long MetricsThreadEntry( void* Arg, CThread* Handler)
+{
+	FMetricsListener* Listener = (FMetricsListener*)Arg;
+	while ( !Listener->bExit )
+	{
+		if ( !WaitClient( Listener->Socket, 0.25) )
+			continue;
+		FRawSocket Client = accept( Listener->Socket, nullptr, nullptr);
+		if ( Client == INVALID_RAW_SOCKET )
+		{
+			appSleep( 0.1f);
+			continue;
+		}
+		ServeClient( Client);
+	}
+	CloseRawSocket( Listener->Socket);
+	delete Listener;
+	return THREAD_END_OK;
+}
+
+//
+// Process exit with a driver still holding the listener.
+//
+static struct FMetricsServerExit
+{
+	~FMetricsServerExit()
+	{
+		if ( MetricsUsers )
+		{
+			MetricsUsers = 1;
+			StopMetricsServer();
+		}
+	}
+} GMetricsServerExit;
+
+//
+// The listener is shared by all drivers, the first one opens it on its port.
+//
+UBOOL StartMetricsServer( int32 Port )
+{
+	if ( (Port <= 0) || (Port > 65535) )
+		return 0;
+	if ( MetricsUsers )
+	{
+		MetricsUsers++;
+		return 1;
+	}
+
+	FRawSocket Listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if ( Listener == INVALID_RAW_SOCKET )
+		return 0;
+
+	int32 ReUse = 1;
+	setsockopt( Listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&ReUse, sizeof(ReUse));
+
+	sockaddr_in Addr;
+	appMemzero( &Addr, sizeof(Addr));
+	Addr.sin_family      = AF_INET;
+	Addr.sin_port        = htons( (uint16)Port);
+	Addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+	if ( bind( Listener, (sockaddr*)&Addr, sizeof(Addr)) || listen( Listener, 8) )
+	{
+		debugf( NAME_DevNet, TEXT("Metrics: unable to listen on 127.0.0.1:%i"), Port);
+		CloseRawSocket( Listener);
+		return 0;
+	}
+
+	MetricsListener = new FMetricsListener;
+	MetricsListener->Socket = Listener;
+	MetricsListener->bExit = 0;
+	MetricsThread = new CThread();
+	MetricsThread->Run( &MetricsThreadEntry, MetricsListener);
+	debugf( NAME_Init, TEXT("Metrics: serving on http://127.0.0.1:%i/metrics"), Port);
+	MetricsUsers = 1;
+	return 1;
+}
+
+void StopMetricsServer()
+{
+	if ( !MetricsUsers || --MetricsUsers )
+		return;
+
+	// A client being served can hold the thread up to its timeout.
+	MetricsListener->bExit = 1;
+	if ( MetricsThread->WaitFinish( METRICS_CLIENT_TIMEOUT + 1.0) )
+		delete MetricsThread;
+	else
+		MetricsThread->Detach(); //Closes the listener when done
+	MetricsThread = nullptr;
+	MetricsListener = nullptr;
+}
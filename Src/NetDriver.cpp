@@ -5,6 +5,7 @@
 =============================================================================*/
 
 #include "XC_IpDrv.h"
+#include "Cacus/Atomics.h"
 
 /*-----------------------------------------------------------------------------
 	Declarations.
@@ -17,6 +18,19 @@
 #define WINSOCK_MAX_PACKET (512)
 #define NETWORK_MAX_PACKET (576)
 
+// Delay before trying the other address family (RFC 8305)
+#define CONNECTION_ATTEMPT_DELAY (0.25)
+
+/*-----------------------------------------------------------------------------
+	FConnectionStats.
+-----------------------------------------------------------------------------*/
+
+FConnectionStats::FConnectionStats()
+{
+	appMemzero( this, sizeof(FConnectionStats));
+	StartTime = appSeconds();
+}
+
 /*-----------------------------------------------------------------------------
 	UXC_TcpipConnection.
 -----------------------------------------------------------------------------*/
@@ -44,11 +58,17 @@ UXC_TcpipConnection::UXC_TcpipConnection( CSocket InSocket, UNetDriver* InDriver
 		if ( RemoteAddress.Address == IPAddress::Any )
 			ResolveInfo = new FResolveInfo( *InURL.Host);
 		RemoteAddress.Port = InURL.Port ? InURL.Port : 7777;
+		AltAddress = IPAddress::Any;
+		ResolvedTime = appSeconds();
 	}
 }
 
 void UXC_TcpipConnection::LowLevelSend( void* Data, int32 Count )
 {
+	XC_TRACE_SCOPE("LowLevelSend");
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+	if ( TcpDriver->CaptureLeft > 0 )
+		TcpDriver->CapturePacket( (uint8*)Data, Count);
 	if ( ResolveInfo )
 	{
 		if( !ResolveInfo->Resolved() )
@@ -66,28 +86,430 @@ void UXC_TcpipConnection::LowLevelSend( void* Data, int32 Count )
 		{
 			// Host name resolution just now succeeded.
 			RemoteAddress.Address = ResolveInfo->Addr;
-			debugf( TEXT("Resolved %s (%s)"), appFromAnsi(ResolveInfo->HostName), appFromAnsi(*RemoteAddress.Address) );
+			AltAddress = ResolveInfo->AltAddr;
+			CSocket* Matching = TcpDriver->FindSocketFor( RemoteAddress.Address);
+			if ( Matching )
+				Socket = *Matching;
+			ResolvedTime = appSeconds();
+			if ( AltAddress != IPAddress::Any )
+				debugf( TEXT("Resolved %s (%s, %s)"), appFromAnsi(ResolveInfo->HostName), appFromAnsi(*RemoteAddress.Address), appFromAnsi(*AltAddress) );
+			else
+				debugf( TEXT("Resolved %s (%s)"), appFromAnsi(ResolveInfo->HostName), appFromAnsi(*RemoteAddress.Address) );
 			delete ResolveInfo;
 			ResolveInfo = NULL;
 		}
 	}
-		// Send to remote.
+
+	if ( TcpDriver->CompressPackets )
+	{
+		// Advertise compression support to the server until it answers.
+		if ( OpenedLocally && !PeerCaps && (HellosSent < 8) && (appSeconds() - LastHelloTime >= 0.5) )
+		{
+			uint8 Hello[4] = { 'X', 'C', XCPACKET_VERSION, XCCAPS_LZ4 };
+			SendDriverPacket( XCPACKET_Hello, Hello, sizeof(Hello));
+			HellosSent++;
+			LastHelloTime = appSeconds();
+		}
+
+		// Compress large packets if the remote end can decompress them.
+		if ( (PeerCaps & XCCAPS_LZ4) && (Count >= TcpDriver->CompressThreshold) )
+		{
+			uint8 Compressed[NETWORK_MAX_PACKET];
+			clockFast(TcpDriver->CompressCycles);
+			int32 CompressedSize = LZ4_CompressBlock( (uint8*)Data, Count, Compressed, Min<int32>( Count - 3, sizeof(Compressed) - 2) );
+			unclockFast(TcpDriver->CompressCycles);
+			if ( CompressedSize > 0 )
+			{
+				TcpDriver->CompressedPackets++;
+				TcpDriver->CompressBytesIn += Count;
+				TcpDriver->CompressBytesOut += CompressedSize + 2;
+				Compressed[CompressedSize++] = XCPACKET_LZ4;
+				Compressed[CompressedSize++] = 0;
+				SendRawPacket( Compressed, CompressedSize);
+				return;
+			}
+		}
+	}
+
+	SendRawPacket( (uint8*)Data, Count);
+}
+
+void UXC_TcpipConnection::SendRawPacket( const uint8* Data, int32 Count )
+{
+	// Emulation layer may hold or drop the packet.
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+
+	// Dual stack host: once the preferred family had its head start, race the other one.
+	// Whichever answers first is kept (see MatchesServerEndpoint).
+	// The duplicate goes out of a socket of its family and isn't counted.
+	if ( !ReceivedReply && (AltAddress != IPAddress::Any) && (appSeconds() - ResolvedTime >= CONNECTION_ATTEMPT_DELAY) )
+	{
+		CSocket* AltSocket = TcpDriver->FindSocketFor( AltAddress);
+		IPEndpoint AltEndpoint( AltAddress, RemoteAddress.Port);
+		int32 Sent;
+		if ( !AltSocket )
+			AltAddress = IPAddress::Any; //No socket for that family, nothing to race
+		else if ( !TcpDriver->EmulationActive() || !TcpDriver->EmulatePacket( this, *AltSocket, AltEndpoint, Data, Count, 1) )
+			AltSocket->SendTo( Data, Count, Sent, AltEndpoint);
+	}
+
+	if ( TcpDriver->EmulationActive() && TcpDriver->EmulatePacket( this, Socket, RemoteAddress, Data, Count, 1) )
+		return;
+
+	SendToRemote( Data, Count);
+}
+
+//
+// Sends past the emulation layer, emulated packets come back here on release.
+// Paced and deferred packets share the send queue so none overtakes another.
+//
+void UXC_TcpipConnection::SendToRemote( const uint8* Data, int32 Count )
+{
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+
+	// Packets waiting for buffer space go first.
+	if ( TcpDriver->Pacer )
+		TcpDriver->Pacer->ReturnBlocked();
+	if ( SendQueue.Num() && !FlushSendQueue() )
+	{
+		QueuePacket( Data, Count);
+		return;
+	}
+
+	// Pacer may hold the packet for a few milliseconds.
+	if ( TcpDriver->Pacer && !OpenedLocally )
+	{
+		double TickInterval = 1.0 / Max( TcpDriver->NetServerMaxTickRate, 10);
+		if ( TcpDriver->Pacer->Send( this, Data, Count, TickInterval) )
+		{
+			Stats.PacketsSent++;
+			Stats.BytesSent += Count;
+			GNetMetrics.PacketsSent++;
+			GNetMetrics.BytesSent += Count;
+			return;
+		}
+	}
+
+	// Send to remote.
+	clockFast(Driver->SendCycles);
+	UBOOL bBlocked;
+	if ( TcpDriver->TransmitPacket( Socket, RemoteAddress, Data, Count, bBlocked) )
+	{
+		Stats.PacketsSent++;
+		Stats.BytesSent += Count;
+		GNetMetrics.PacketsSent++;
+		GNetMetrics.BytesSent += Count;
+	}
+	else if ( TcpDriver->SendQueueSize && bBlocked )
+		QueuePacket( Data, Count);
+	else
+	{
+		Stats.SendFailures++;
+		Stats.LastSendError = Socket.LastError;
+		GNetMetrics.SendFailures++;
+	}
+	unclockFast(Driver->SendCycles);
+}
+
+/*-----------------------------------------------------------------------------
+	Send queue.
+	When the socket's send buffer is full the packet is kept and retried
+	once the socket is writable (see FlushSendQueues), instead of being lost.
+-----------------------------------------------------------------------------*/
+
+//
+// Sends queued packets in order, returns true once the queue is empty.
+//
+UBOOL UXC_TcpipConnection::FlushSendQueue()
+{
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
 	clockFast(Driver->SendCycles);
-	int32 Sent;
-	Socket.SendTo( (uint8*)Data, Count, Sent, RemoteAddress); //Should evaluate Sent?
+	int32 Flushed = 0;
+	for ( ; Flushed<SendQueue.Num(); Flushed++)
+	{
+		FQueuedPacket& Packet = SendQueue(Flushed);
+		UBOOL bBlocked;
+		if ( TcpDriver->TransmitPacket( Socket, Packet.Endpoint, &Packet.Data(0), Packet.Data.Num(), bBlocked) )
+		{
+			Stats.PacketsSent++;
+			Stats.BytesSent += Packet.Data.Num();
+			GNetMetrics.PacketsSent++;
+			GNetMetrics.BytesSent += Packet.Data.Num();
+		}
+		else if ( bBlocked )
+			break; //Still full
+		else
+		{
+			Stats.SendFailures++;
+			Stats.LastSendError = Socket.LastError;
+			GNetMetrics.SendFailures++;
+		}
+		SendQueueBytes -= Packet.Data.Num();
+	}
+	if ( Flushed )
+		SendQueue.Remove( 0, Flushed);
 	unclockFast(Driver->SendCycles);
+	return SendQueue.Num() == 0;
+}
+
+//
+// Bit per driver socket that has deferred sends.
+//
+uint32 UXC_TcpNetDriver::GetSendQueueMask()
+{
+	uint32 Mask = 0;
+	for ( int32 i=-1; i<ClientConnections.Num(); i++)
+	{
+		UXC_TcpipConnection* Connection = (i < 0) ? GetServerConnection() : (UXC_TcpipConnection*)ClientConnections(i);
+		if ( Connection && Connection->SendQueue.Num() )
+			for ( int32 s=0; (s<Sockets.Num()) && (s<32); s++)
+				if ( Sockets(s).Socket == Connection->Socket.Socket )
+					Mask |= (1 << s);
+	}
+	return Mask;
+}
+
+//
+// Retries deferred sends on the sockets in WriteMask.
+// With no mask the sockets with deferred sends are polled for room first.
+//
+void UXC_TcpNetDriver::FlushSendQueues( uint32 WriteMask )
+{
+	if ( !WriteMask )
+	{
+		WriteMask = GetSendQueueMask();
+		if ( !WriteMask )
+			return;
+		if ( XDP )
+			XDP->Wait( 0.0, Sockets, WriteMask);
+		else
+			WaitReadable( Sockets, 0.0, WriteMask);
+		if ( !WriteMask )
+			return;
+	}
+
+	for ( int32 i=-1; i<ClientConnections.Num(); i++)
+	{
+		UXC_TcpipConnection* Connection = (i < 0) ? GetServerConnection() : (UXC_TcpipConnection*)ClientConnections(i);
+		if ( !Connection || !Connection->SendQueue.Num() )
+			continue;
+		for ( int32 s=0; (s<Sockets.Num()) && (s<32); s++)
+			if ( (WriteMask & (1 << s)) && (Sockets(s).Socket == Connection->Socket.Socket) )
+			{
+				Connection->FlushSendQueue();
+				break;
+			}
+	}
+}
+
+//
+// Adds a packet to the send queue, makes room by dropping unreliable data first.
+//
+void UXC_TcpipConnection::QueuePacket( const uint8* Data, int32 Count )
+{
+	UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+	UBOOL bReliable = IsReliablePacket( Data, Count);
+
+	while ( SendQueue.Num() && (SendQueueBytes + Count > TcpDriver->SendQueueSize) )
+	{
+		int32 Drop = INDEX_NONE;
+		for ( int32 i=0; i<SendQueue.Num(); i++)
+			if ( !SendQueue(i).bReliable )
+			{
+				Drop = i;
+				break;
+			}
+		if ( Drop == INDEX_NONE )
+		{
+			if ( !bReliable )
+				break; //Drop the incoming one instead
+			Drop = 0;
+		}
+		if ( SendQueue(Drop).bReliable )
+			TcpDriver->QueueDropsReliable++;
+		else
+			TcpDriver->QueueDropsUnreliable++;
+		Stats.QueueDrops++;
+		GNetMetrics.SendQueueDrops++;
+		SendQueueBytes -= SendQueue(Drop).Data.Num();
+		SendQueue.Remove( Drop);
+	}
+
+	if ( SendQueueBytes + Count > TcpDriver->SendQueueSize )
+	{
+		if ( bReliable )
+			TcpDriver->QueueDropsReliable++;
+		else
+			TcpDriver->QueueDropsUnreliable++;
+		Stats.QueueDrops++;
+		GNetMetrics.SendQueueDrops++;
+		return;
+	}
+
+	FQueuedPacket& Packet = SendQueue( SendQueue.AddZeroed() );
+	Packet.Endpoint = RemoteAddress;
+	Packet.bReliable = bReliable;
+	Packet.Data.Add( Count);
+	appMemcpy( &Packet.Data(0), Data, Count);
+	SendQueueBytes += Count;
+	Stats.QueuedSends++;
+	TcpDriver->QueuedSends++;
+	GNetMetrics.SendQueued++;
+}
+
+//
+// Peeks at the bunch headers (see UNetConnection::SendRawBunch).
+// Packets carrying acks or reliable bunches are expensive to lose, the
+// engine would have to wait for a timeout and retransmit them.
+//
+UBOOL UXC_TcpipConnection::IsReliablePacket( const uint8* Data, int32 Count )
+{
+	if ( Count <= 0 )
+		return 0;
+
+	// Driver packet, only compressed game packets are worth looking into.
+	uint8 Decompressed[NETWORK_MAX_PACKET*2];
+	if ( Data[Count-1] == 0 )
+	{
+		if ( (Count < 2) || (Data[Count-2] != XCPACKET_LZ4) )
+			return 1;
+		Count = LZ4_DecompressBlock( Data, Count-2, Decompressed, sizeof(Decompressed));
+		if ( Count <= 0 )
+			return 1;
+		Data = Decompressed;
+		if ( Data[Count-1] == 0 )
+			return 1;
+	}
+
+	// Trailing 1 bit marks the end of the packet.
+	uint8 LastByte = Data[Count-1];
+	int32 BitSize = Count*8 - 1;
+	while ( !(LastByte & 0x80) )
+	{
+		LastByte *= 2;
+		BitSize--;
+	}
+
+	FBitReader Reader( (BYTE*)Data, BitSize);
+	Reader.ReadInt( MAX_PACKETID);
+	uint8 Skip[NETWORK_MAX_PACKET*2];
+	while ( !Reader.AtEnd() && !Reader.IsError() )
+	{
+		if ( Reader.ReadBit() ) //Ack
+			return 1;
+		UBOOL bControl = Reader.ReadBit();
+		UBOOL bOpen    = bControl ? Reader.ReadBit() : 0;
+		if ( bControl )
+			Reader.ReadBit(); //bClose
+		if ( Reader.ReadBit() ) //bReliable
+			return 1;
+		Reader.ReadInt( MAX_CHANNELS);
+		if ( bOpen )
+			Reader.ReadInt( CHTYPE_MAX);
+		int32 BunchDataBits = Reader.ReadInt( MaxPacket*8);
+		if ( Reader.IsError() || (BunchDataBits > (int32)sizeof(Skip)*8) )
+			break;
+		Reader.SerializeBits( Skip, BunchDataBits);
+	}
+	return Reader.IsError();
+}
+
+void UXC_TcpipConnection::SendDriverPacket( uint8 Type, const uint8* Payload, int32 PayloadSize )
+{
+	uint8 Packet[64];
+	check(PayloadSize + 2 <= (int32)ARRAY_COUNT(Packet));
+	appMemcpy( Packet, Payload, PayloadSize);
+	Packet[PayloadSize]   = Type;
+	Packet[PayloadSize+1] = 0;
+	SendRawPacket( Packet, PayloadSize + 2);
+}
+
+void UXC_TcpipConnection::ReceivedDriverPacket( uint8* Data, int32 Count )
+{
+	if ( Count < 2 )
+		return;
+	uint8 Type = Data[Count-2];
+	int32 PayloadSize = Count - 2;
+
+	if ( Type == XCPACKET_LZ4 )
+	{
+		if ( ((UXC_TcpNetDriver*)Driver)->CompressPackets )
+		{
+			uint8 Decompressed[NETWORK_MAX_PACKET*2];
+			int32 DecompressedSize = LZ4_DecompressBlock( Data, PayloadSize, Decompressed, sizeof(Decompressed));
+			if ( DecompressedSize > 0 )
+				ReceivedRawPacket( Decompressed, DecompressedSize);
+		}
+	}
+	else if ( (Type == XCPACKET_Hello) || (Type == XCPACKET_HelloAck) )
+	{
+		UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+		if ( (PayloadSize < 4) || (Data[0] != 'X') || (Data[1] != 'C') || !TcpDriver->CompressPackets )
+			return;
+		uint8 Caps = Data[3] & XCCAPS_LZ4;
+		if ( Caps && !PeerCaps )
+			debugf( NAME_DevNet, TEXT("%s negotiated LZ4 packet compression"), *LowLevelGetRemoteAddress() );
+		PeerCaps = Caps;
+
+		// Answer every hello, acks may get lost as well.
+		if ( (Type == XCPACKET_Hello) && !OpenedLocally )
+		{
+			uint8 Ack[4] = { 'X', 'C', XCPACKET_VERSION, XCCAPS_LZ4 };
+			SendDriverPacket( XCPACKET_HelloAck, Ack, sizeof(Ack));
+		}
+	}
+}
+
+void UXC_TcpipConnection::Destroy()
+{
+	if ( Driver && Driver->IsA(UXC_TcpNetDriver::StaticClass()) )
+	{
+		UXC_TcpNetDriver* TcpDriver = (UXC_TcpNetDriver*)Driver;
+		TcpDriver->UnhashConnection( this);
+		if ( TcpDriver->Pacer )
+			TcpDriver->Pacer->Forget( this);
+		SendQueue.Empty();
+		SendQueueBytes = 0;
+		// Give name back to the pool, the next connection will reuse it.
+		if ( PooledName )
+			TcpDriver->FreeConnectionNames.AddItem( GetFName() );
+	}
+	Super::Destroy();
+}
+
+UBOOL UXC_TcpipConnection::MatchesServerEndpoint( const IPEndpoint& Endpoint, UBOOL bHasData )
+{
+	UBOOL bMatches = (RemoteAddress == Endpoint);
+	if ( !bHasData ) //ICMP errors don't decide the race
+		return bMatches;
+	if ( !bMatches && (AltAddress != IPAddress::Any) && (Endpoint.Port == RemoteAddress.Port) && (Endpoint.Address == AltAddress) )
+	{
+		// Other address family answered first, commit to it.
+		RemoteAddress.Address = AltAddress;
+		CSocket* Matching = ((UXC_TcpNetDriver*)Driver)->FindSocketFor( AltAddress);
+		if ( Matching )
+			Socket = *Matching;
+		bMatches = 1;
+	}
+	if ( bMatches && !ReceivedReply )
+	{
+		ReceivedReply = 1;
+		AltAddress = IPAddress::Any;
+		debugf( NAME_Log, TEXT("First reply from %s after %i ms"), appFromAnsi(*RemoteAddress.Address), appRound( (appSeconds() - ResolvedTime) * 1000.0) );
+	}
+	return bMatches;
 }
 
 FString UXC_TcpipConnection::LowLevelGetRemoteAddress()
 {
-	return appFromAnsi(*RemoteAddress);
+	return UnmappedAddress(*RemoteAddress);
 }
 
 FString UXC_TcpipConnection::LowLevelDescribe()
 {
 	return FString::Printf
 	(
-		TEXT("%s %s state: %s"), *URL.Host, appFromAnsi(*RemoteAddress),
+		TEXT("%s %s state: %s"), *URL.Host, *UnmappedAddress(*RemoteAddress),
 			State==USOCK_Pending	?	TEXT("Pending")
 		:	State==USOCK_Open		?	TEXT("Open")
 		:	State==USOCK_Closed		?	TEXT("Closed")
@@ -129,6 +551,8 @@ UBOOL UXC_TcpNetDriver::InitListen( FNetworkNotify* InNotify, FURL& LocalURL, FS
 	if( !InitBase( 0, InNotify, LocalURL, Error ) )
 		return 0;
 
+	PrewarmConnectionPool();
+
 	// Update result URL.
 	LocalURL.Host = appFromAnsi(*LocalAddress.Address);
 	LocalURL.Port = LocalAddress.Port;
@@ -139,16 +563,38 @@ UBOOL UXC_TcpNetDriver::InitListen( FNetworkNotify* InNotify, FURL& LocalURL, FS
 
 void UXC_TcpNetDriver::TickDispatch( float DeltaTime )
 {
+	XC_TRACE_SCOPE("TickDispatch");
 	if ( DeltaTime > 0 ) //Avoid unnecessary iterations, this is caused by connection handler doing extra polls
 		Super::TickDispatch( DeltaTime );
 
+	// Deferred sends whose socket took more since last tick.
+	FlushSendQueues( 0);
+
 	// Process all incoming packets.
 	uint8 Data[NETWORK_MAX_PACKET];
+	double DispatchStart = appSeconds();
 
 #ifdef __LINUX_X86__
 	INT LoopMax = (1+ClientConnections.Num()) * 1000; //See what's up in linux
 #endif
 
+	// Game port traffic redirected by the XDP program.
+	if ( XDP )
+	{
+		CSocket& Socket = Sockets(XDPSocketIndex);
+		for ( ; ; )
+		{
+			clockFast(RecvCycles);
+			IPEndpoint Endpoint;
+			int32 Size = XDP->Recv( Data, sizeof(Data), Endpoint);
+			unclockFast(RecvCycles);
+			if ( Size < 0 )
+				break;
+			if ( !EmulationActive() || !EmulatePacket( FindConnection(Endpoint,1), Socket, Endpoint, Data, Size, 0) )
+				DispatchPacket( Socket, Endpoint, Data, Size);
+		}
+	}
+
 	for( int32 s=0; s<Sockets.Num(); s++)
 	{
 		CSocket& Socket = Sockets(s);
@@ -159,6 +605,7 @@ void UXC_TcpNetDriver::TickDispatch( float DeltaTime )
 		int32 Size;
 		IPEndpoint Endpoint;
 		bool bHasData = Socket.RecvFrom( Data, sizeof(Data), Size, Endpoint);
+		NormalizeEndpoint( Endpoint);
 		unclockFast(RecvCycles);
 		
 
@@ -180,76 +627,213 @@ void UXC_TcpNetDriver::TickDispatch( float DeltaTime )
 				break;
 			}
 		}
-		// Figure out which socket the received data came from.
-		UXC_TcpipConnection* Connection = NULL;
-		if( GetServerConnection() && (GetServerConnection()->RemoteAddress == Endpoint) )
-			Connection = GetServerConnection();
-		for( int32 i=0; i<ClientConnections.Num() && !Connection; i++ )
-			if( ((UXC_TcpipConnection*)ClientConnections(i))->RemoteAddress == Endpoint )
-				Connection = (UXC_TcpipConnection*)ClientConnections(i);
-
 		if ( !bHasData )
+			ReceivedPortUnreach( Endpoint);
+		else if ( !EmulationActive() || !EmulatePacket( FindConnection(Endpoint,bHasData), Socket, Endpoint, Data, Size, 0) )
+			DispatchPacket( Socket, Endpoint, Data, Size);
+	}
+	}
+
+	// Packets held by the emulation layer.
+	if ( NumDelayedPackets() )
+		ReleaseDelayedPackets();
+
+	if ( Pacer )
+		Pacer->EndTick();
+	FlushSendQueues( 0);
+	if ( XDP )
+		XDP->Flush();
+
+	GNetMetrics.Connections += ClientConnections.Num() - MetricsConnections;
+	MetricsConnections = ClientConnections.Num();
+	GNetMetrics.AddDispatchTime( appSeconds() - DispatchStart);
+
+	// React to interface changes.
+	if ( Time - LastAddressCheckTime >= 1.f )
+	{
+		LastAddressCheckTime = Time;
+		CheckLocalAddresses();
+	}
+
+	// Fill the redirect compression cache once the package map is known.
+	if ( CompressCache && !ServerConnection && MasterMap )
+	{
+		if ( MasterMap->List.Num() != CompressScanCount )
 		{
-			if( Connection )
-			{
-				if( Connection != GetServerConnection() )
-				{
-					// We received an ICMP port unreachable from the client, meaning the client is no longer running the game
-					// (or someone is trying to perform a DoS attack on the client)
-
-					// rcg08182002 Some buggy firewalls get occasional ICMP port
-					// unreachable messages from legitimate players. Still, this code
-					// will drop them unceremoniously, so there's an option in the .INI
-					// file for servers with such flakey connections to let these
-					// players slide...which means if the client's game crashes, they
-					// might get flooded to some degree with packets until they timeout.
-					// Either way, this should close up the usual DoS attacks.
-					if ((Connection->State != USOCK_Open) || (!AllowPlayerPortUnreach))
-					{
-						if ( LogPortUnreach )
-							debugf( TEXT("Received ICMP port unreachable from client %s.  Disconnecting."), appFromAnsi(*Endpoint) );
-						delete Connection;
-					}
-				}
-			}
-			else
+			CompressScanCount = MasterMap->List.Num();
+			GetCompressCache( *CompressCacheDir, CompressCacheThreads)->Scan( MasterMap);
+		}
+		if ( CompressScanCount )
+			GetCompressCache( *CompressCacheDir, CompressCacheThreads)->Update();
+	}
+
+	// Periodic stats dump for capacity planning.
+	if ( (StatsDumpInterval > 0) && (Time - LastStatsDumpTime >= StatsDumpInterval) )
+	{
+		LastStatsDumpTime = Time;
+		DumpStats( *StatsDumpFile );
+	}
+}
+
+void UXC_TcpNetDriver::TickFlush()
+{
+	Super::TickFlush();
+
+	// XDP frames queued by this tick's sends.
+	if ( XDP )
+		XDP->Flush();
+}
+
+/*-----------------------------------------------------------------------------
+	Connection lookup.
+	Client connections are chained in a hash table keyed by endpoint,
+	a packet lookup no longer walks the whole connection list.
+-----------------------------------------------------------------------------*/
+
+static inline uint32 HashEndpoint( const IPEndpoint& Endpoint )
+{
+	return (appMemCrc( &Endpoint.Address, sizeof(IPAddress)) ^ Endpoint.Port) & (CONNECTION_HASH_SIZE-1);
+}
+
+void UXC_TcpNetDriver::HashConnection( UXC_TcpipConnection* Connection )
+{
+	UXC_TcpipConnection*& Bucket = ConnectionHash[HashEndpoint(Connection->RemoteAddress)];
+	Connection->HashNext = Bucket;
+	Bucket = Connection;
+}
+
+void UXC_TcpNetDriver::UnhashConnection( UXC_TcpipConnection* Connection )
+{
+	for ( UXC_TcpipConnection** Link=&ConnectionHash[HashEndpoint(Connection->RemoteAddress)]; *Link; Link=&(*Link)->HashNext )
+		if ( *Link == Connection )
+		{
+			*Link = Connection->HashNext;
+			break;
+		}
+	Connection->HashNext = nullptr;
+}
+
+//
+// Figure out which connection a packet came from.
+//
+UXC_TcpipConnection* UXC_TcpNetDriver::FindConnection( const IPEndpoint& Endpoint, UBOOL bHasData )
+{
+	if( GetServerConnection() && GetServerConnection()->MatchesServerEndpoint(Endpoint,bHasData) )
+		return GetServerConnection();
+	for ( UXC_TcpipConnection* Connection=ConnectionHash[HashEndpoint(Endpoint)]; Connection; Connection=Connection->HashNext )
+		if ( Connection->RemoteAddress == Endpoint )
+			return Connection;
+	return NULL;
+}
+
+void UXC_TcpNetDriver::ReceivedPortUnreach( const IPEndpoint& Endpoint )
+{
+	UXC_TcpipConnection* Connection = FindConnection( Endpoint, 0);
+	GNetMetrics.PortUnreach++;
+	if( Connection )
+	{
+		Connection->Stats.PortUnreach++;
+		if( Connection != GetServerConnection() )
+		{
+			// We received an ICMP port unreachable from the client, meaning the client is no longer running the game
+			// (or someone is trying to perform a DoS attack on the client)
+
+			// rcg08182002 Some buggy firewalls get occasional ICMP port
+			// unreachable messages from legitimate players. Still, this code
+			// will drop them unceremoniously, so there's an option in the .INI
+			// file for servers with such flakey connections to let these
+			// players slide...which means if the client's game crashes, they
+			// might get flooded to some degree with packets until they timeout.
+			// Either way, this should close up the usual DoS attacks.
+			if ((Connection->State != USOCK_Open) || (!AllowPlayerPortUnreach))
 			{
 				if ( LogPortUnreach )
-					debugf( TEXT("Received ICMP port unreachable from %s.  No matching connection found."), appFromAnsi(*Endpoint) );
+					debugf( TEXT("Received ICMP port unreachable from client %s.  Disconnecting."), *UnmappedAddress(*Endpoint) );
+				delete Connection;
 			}
 		}
-		else
+	}
+	else
+	{
+		if ( LogPortUnreach )
+			debugf( TEXT("Received ICMP port unreachable from %s.  No matching connection found."), *UnmappedAddress(*Endpoint) );
+	}
+}
+
+void UXC_TcpNetDriver::DispatchPacket( CSocket& Socket, const IPEndpoint& Endpoint, uint8* Data, int32 Size )
+{
+	XC_TRACE_SCOPE("DispatchPacket");
+	UXC_TcpipConnection* Connection = FindConnection( Endpoint, 1);
+
+	// If we didn't find a client connection, maybe create a new one.
+	if( !Connection && Notify->NotifyAcceptingConnection()==ACCEPTC_Accept )
+	{
+		if ( ClientConnections.Num() >= ConnectionLimit )
 		{
-			// If we didn't find a client connection, maybe create a new one.
-			if( !Connection && Notify->NotifyAcceptingConnection()==ACCEPTC_Accept )
-			{
-				if ( ClientConnections.Num() >= ConnectionLimit )
-				{
-					//Run bulk disconnect on bad/empty connections
-					guard( XC_IpDrv_DiscardConnections);
-					for ( int32 i=0 ; i<ClientConnections.Num() ; i++ )
-						if ( ClientConnections(i) && ClientConnections(i)->Channels[0] )
-							delete ClientConnections(i--);
-					unguard;
-				}
-
-				if ( ClientConnections.Num() < ConnectionLimit )
-				{
-					if ( UXC_TcpipConnection::StaticClass()->ClassUnique > (ClientConnections.Num() + ConnectionLimit) )
-						UXC_TcpipConnection::StaticClass()->ClassUnique = 0;
-					Connection = new UXC_TcpipConnection( Socket, this, Endpoint, USOCK_Open, 0, FURL() );
-					Connection->URL.Host = appFromAnsi(*Endpoint.Address);
-					Notify->NotifyAcceptedConnection( Connection );
-					ClientConnections.AddItem( Connection );
-				}
-			}
+			//Run bulk disconnect on bad/empty connections
+			guard( XC_IpDrv_DiscardConnections);
+			for ( int32 i=0 ; i<ClientConnections.Num() ; i++ )
+				if ( ClientConnections(i) && ClientConnections(i)->Channels[0] )
+					delete ClientConnections(i--);
+			unguard;
+		}
 
-			// Send the packet to the connection for processing.
-			if( Connection )
-				Connection->ReceivedRawPacket( Data, Size );
+		if ( ClientConnections.Num() < ConnectionLimit )
+		{
+			Connection = CreateClientConnection( Socket, Endpoint);
+			Notify->NotifyAcceptedConnection( Connection );
+			ClientConnections.AddItem( Connection );
+			HashConnection( Connection );
+			GNetMetrics.ConnectionsAccepted++;
 		}
 	}
+	if ( !Connection && !GetServerConnection() )
+		GNetMetrics.AcceptRejected++;
+
+	// Send the packet to the connection for processing.
+	GNetMetrics.PacketsRecv++;
+	GNetMetrics.BytesRecv += Size;
+	if( Connection )
+	{
+		Connection->Stats.PacketsRecv++;
+		Connection->Stats.BytesRecv += Size;
+		if ( (Size >= 2) && (Data[Size-1] == 0) )
+			Connection->ReceivedDriverPacket( Data, Size );
+		else
+			Connection->ReceivedRawPacket( Data, Size );
+	}
+}
+
+//
+// Blocks until a packet is received or a delayed packet is due, up to the given time.
+// The server connection may use any socket (see FindSocketFor), all of them are waited on.
+//
+UBOOL UXC_TcpNetDriver::WaitForPacket( double Seconds )
+{
+	if ( !Sockets.Num() )
+		return 0;
+
+	if ( NumDelayedPackets() )
+	{
+		double Remaining = DelayedPackets(DelayedHead).ReleaseTime - appSeconds();
+		if ( Remaining <= 0 )
+			return 1;
+		Seconds = Min( Seconds, Remaining);
 	}
+
+	// Deferred sends also wake us up once their socket takes more.
+	uint32 WriteMask = GetSendQueueMask();
+	UBOOL bReady = XDP ? XDP->Wait( Seconds, Sockets, WriteMask) : WaitReadable( Sockets, Max( Seconds, 0.0), WriteMask);
+	if ( WriteMask )
+		FlushSendQueues( WriteMask);
+	return bReady;
+}
+
+UBOOL XC_WaitForNetPacket( UNetDriver* Driver, FLOAT Seconds )
+{
+	if ( Driver && Driver->IsA(UXC_TcpNetDriver::StaticClass()) )
+		return ((UXC_TcpNetDriver*)Driver)->WaitForPacket( Seconds);
+	return 0;
 }
 
 FString UXC_TcpNetDriver::LowLevelGetNetworkNumber()
@@ -259,6 +843,28 @@ FString UXC_TcpNetDriver::LowLevelGetNetworkNumber()
 
 void UXC_TcpNetDriver::LowLevelDestroy()
 {
+	GNetMetrics.Connections -= MetricsConnections;
+	MetricsConnections = 0;
+	if ( MetricsStarted )
+	{
+		StopMetricsServer();
+		MetricsStarted = 0;
+	}
+
+	// Pacer sends what's left on the driver's sockets, stop it first.
+	if ( Pacer )
+	{
+		delete Pacer;
+		Pacer = nullptr;
+	}
+
+	// Detaches the XDP program, game port traffic goes back to the sockets.
+	if ( XDP )
+	{
+		delete XDP;
+		XDP = nullptr;
+	}
+
 	// Close the socket.
 	for ( int32 s=0; s<Sockets.Num(); s++)
 	{
@@ -270,6 +876,12 @@ void UXC_TcpNetDriver::LowLevelDestroy()
 		}
 	}
 	Sockets.Empty();
+	SocketAddresses.Empty();
+	LostSocketAddresses = 0;
+
+	// Held packets reference the sockets above.
+	DelayedPackets.Empty();
+	DelayedHead = 0;
 }
 
 // UXC_TcpNetDriver interface.
@@ -307,6 +919,7 @@ UBOOL UXC_TcpNetDriver::InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL&
 		return 0;
 	}
 	LocalAddress.Address = MultiAddress(0);
+	LocalAddressSerial = GetLocalAddressSerial();
 
 	// Get hardcoded port
 	UBOOL HardcodedPort = 0;
@@ -317,10 +930,18 @@ UBOOL UXC_TcpNetDriver::InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL&
 		LocalAddress.Port = URL.Port;
 	}
 
+	// One IPv6 socket can take both families when binding to all addresses.
+	UBOOL DualStackBound = 0;
+	int32 ListenPort = 0;
+	UBOOL TryDualStack = GIPv6 && DualStackSocket && MultiAddress.FindItemIndex(IPAddress::Any) != INDEX_NONE;
+
 	// Initialize each socket.
 	Sockets.Empty();
 	for ( int i=0; i<MultiAddress.Num(); i++)
 	{
+		if ( DualStackBound && (MultiAddress(i) == IPAddress(0,0,0,0)) )
+			continue;
+
 		// Log previous error and flush it
 		if ( Error.Len() )
 		{
@@ -349,6 +970,7 @@ UBOOL UXC_TcpNetDriver::InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL&
 
 		Socket.SetReuseAddr();
 		Socket.SetRecvErr();
+		UBOOL DualStack = TryDualStack && (MultiAddress(i) == IPAddress::Any) && SetDualStack( Socket);
 
 		// Increase socket queue size, because we are polling rather than threading
 		// and thus we rely on Windows Sockets to buffer a lot of data on the server.
@@ -373,6 +995,14 @@ UBOOL UXC_TcpNetDriver::InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL&
 			Sockets.Remove( Sockets.Num() - 1);
 			continue;
 		}
+		if ( !ListenPort )
+			ListenPort = BoundPort;
+		if ( DualStack )
+		{
+			DualStackBound = 1;
+			debugf( NAME_DevNet, TEXT("%s: dual stack socket on port %i"), appFromAnsi(CSocket::API), BoundPort);
+		}
+		SocketAddresses.AddItem( MultiAddress(i));
 	}
 
 	// Log previous error and flush it if we have a valid socket
@@ -382,21 +1012,534 @@ UBOOL UXC_TcpNetDriver::InitBase( UBOOL Connect, FNetworkNotify* InNotify, FURL&
 		Error.Empty();
 	}
 
+	// Start pacer on servers.
+	if ( !Connect && PacedSend && Sockets.Num() && !Pacer )
+		Pacer = new FPacketPacer( this);
+
+	// Kernel bypass for the game port, the sockets stay open for everything else.
+	if ( !Connect && UseAFXDP && Sockets.Num() && !XDP )
+	{
+		CSocket* Socket = FindSocketFor( IPAddress(0,0,0,0));
+		XDPSocketIndex = Socket ? (int32)(Socket - &Sockets(0)) : 0;
+		FString XDPError = TEXT("no IPv4 socket");
+		XDP = Socket ? FXDPSocket::Create( *AFXDPInterface, ListenPort, *Socket, XDPError) : nullptr;
+		if ( XDP )
+			debugf( NAME_DevNet, TEXT("AF_XDP: receiving port %i on %s (%i queues)"), ListenPort, *AFXDPInterface, XDP->NumQueues());
+		else
+			debugf( NAME_DevNet, TEXT("AF_XDP: %s, using sockets"), *XDPError);
+	}
+
+	// XDP frames skip the qdisc, their send time would be ignored.
+	if ( Pacer && PacedSendTxTime && !XDP )
+	{
+		if ( Pacer->EnableTxTime( Sockets) )
+			debugf( NAME_DevNet, TEXT("Pacing: kernel send times (SO_TXTIME), the interface needs the fq qdisc"));
+		else
+			debugf( NAME_DevNet, TEXT("Pacing: SO_TXTIME not available, using the pacer thread"));
+	}
+
+	// Local metrics endpoint, process-wide.
+	if ( (MetricsPort > 0) && !MetricsStarted )
+		MetricsStarted = StartMetricsServer( MetricsPort);
+
 	// Success.
 	return Sockets.Num() > 0;
 }
 
+//
+// Every outgoing packet leaves through here, peers that reached us over
+// AF_XDP are answered from its TX ring so the two paths can't reorder them.
+// Also called by the pacer thread.
+// bBlocked: socket buffer or TX ring is full, the packet can be retried.
+//
+UBOOL UXC_TcpNetDriver::TransmitPacket( CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Count, UBOOL& bBlocked )
+{
+	bBlocked = 0;
+	if ( XDP && (XDP->Send( Endpoint, Data, Count, bBlocked) || bBlocked) )
+		return !bBlocked;
+	int32 Sent = 0;
+	if ( Socket.SendTo( Data, Count, Sent, Endpoint) && (Sent == Count) )
+		return 1;
+	bBlocked = CSocket::IsNonBlocking( Socket.LastError);
+	return 0;
+}
+
+//
+// First socket that can send to this address family.
+//
+CSocket* UXC_TcpNetDriver::FindSocketFor( const IPAddress& Address )
+{
+	UBOOL bIPv4 = IsIPv4Address( Address);
+	for ( int32 s=0; s<Sockets.Num(); s++)
+		if ( !Sockets(s).IsInvalid() && SocketReaches( Sockets(s), bIPv4) )
+			return &Sockets(s);
+	return nullptr;
+}
+
 UXC_TcpipConnection* UXC_TcpNetDriver::GetServerConnection() 
 {
 	return (UXC_TcpipConnection*)ServerConnection;
 }
 
+//
+// Prepares connection names and array slack ahead of time so that
+// accepting clients during join storms doesn't generate new object names.
+//
+void UXC_TcpNetDriver::PrewarmConnectionPool()
+{
+	ClientConnections.Empty( ConnectionLimit);
+	FreeConnectionNames.Empty( ConnectionLimit);
+	for ( int32 i=ConnectionLimit-1; i>=0; i--) //Lowest index goes last
+		FreeConnectionNames.AddItem( FName( *FString::Printf( TEXT("%s_Connection%i"), GetName(), i)) );
+}
+
+UXC_TcpipConnection* UXC_TcpNetDriver::CreateClientConnection( CSocket& Socket, const IPEndpoint& Endpoint )
+{
+	// Take a pooled name, ensure no other object is still using it.
+	// Names still in use go back to the bottom of the pool so they aren't lost.
+	FName Name = NAME_None;
+	int32 Skipped = 0;
+	while ( (FreeConnectionNames.Num() > Skipped) && (Name == NAME_None) )
+	{
+		Name = FreeConnectionNames.Last();
+		FreeConnectionNames.Remove( FreeConnectionNames.Num() - 1);
+		if ( FindObject<UObject>( GetTransientPackage(), *Name) )
+		{
+			FreeConnectionNames.InsertItem( 0, Name);
+			Skipped++;
+			Name = NAME_None;
+		}
+	}
+
+	UXC_TcpipConnection* Connection;
+	if ( Name != NAME_None )
+	{
+		Connection = new( GetTransientPackage(), Name) UXC_TcpipConnection( Socket, this, Endpoint, USOCK_Open, 0, FURL() );
+		Connection->PooledName = 1;
+		PooledNamesUsed++;
+	}
+	else
+	{
+		// Pool exhausted, keep object names bounded
+		if ( UXC_TcpipConnection::StaticClass()->ClassUnique > (ClientConnections.Num() + ConnectionLimit) )
+			UXC_TcpipConnection::StaticClass()->ClassUnique = 0;
+		Connection = new UXC_TcpipConnection( Socket, this, Endpoint, USOCK_Open, 0, FURL() );
+	}
+	Connection->URL.Host = UnmappedAddress(*Endpoint.Address);
+	ConnectionsCreated++;
+	return Connection;
+}
+
+//
+// Counts heap operations while the join benchmark runs.
+// Other threads allocating at the same time are counted too.
+//
+class FJoinBenchMalloc : public FMalloc
+{
+public:
+	FMalloc* Inner;
+	int32 Allocs;
+	int32 Frees;
+
+	FJoinBenchMalloc( FMalloc* InInner) : Inner(InInner), Allocs(0), Frees(0) {}
+	void* Malloc( DWORD Count, const TCHAR* Tag)
+	{
+		FPlatformAtomics::InterlockedIncrement( &Allocs);
+		return Inner->Malloc( Count, Tag);
+	}
+	void* Realloc( void* Original, DWORD Count, const TCHAR* Tag)
+	{
+		if ( !Original && Count )
+			FPlatformAtomics::InterlockedIncrement( &Allocs);
+		else if ( Original && !Count )
+			FPlatformAtomics::InterlockedIncrement( &Frees);
+		return Inner->Realloc( Original, Count, Tag);
+	}
+	void Free( void* Original)
+	{
+		if ( Original )
+			FPlatformAtomics::InterlockedIncrement( &Frees);
+		Inner->Free( Original);
+	}
+	void DumpAllocs() { Inner->DumpAllocs(); }
+	void HeapCheck()  { Inner->HeapCheck(); }
+	void Init()       {}
+	void Exit()       {}
+};
+
+//
+// NETSTATS JOINBENCH [COUNT=n] [ROUNDS=n]
+// Accepts and closes COUNT fake clients ROUNDS times like a join storm would,
+// first without the name pool and then with it.
+// Runs on a driver of its own with no sockets, this driver's clients, counters
+// and pool are left alone. The benchmark driver's name is fixed so repeated
+// runs reuse the same pooled names.
+//
+UBOOL UXC_TcpNetDriver::ExecJoinBenchmark( const TCHAR* Str, FOutputDevice& Ar)
+{
+	guard(UXC_TcpNetDriver::ExecJoinBenchmark);
+	int32 Count = ConnectionLimit;
+	int32 Rounds = 4;
+	Parse( Str, TEXT("COUNT="), Count);
+	Parse( Str, TEXT("ROUNDS="), Rounds);
+	Count = Clamp( Count, 1, 1024);
+	Rounds = Clamp( Rounds, 1, 100);
+
+	UXC_TcpNetDriver* Bench = ConstructObject<UXC_TcpNetDriver>( GetClass(), GetTransientPackage(), FName(TEXT("XC_JoinBenchDriver")) );
+	Bench->ConnectionLimit = Count;
+	CSocket Socket; //Never used, connections are closed before sending
+
+	Ar.Logf( TEXT("Join benchmark: %i connections x %i rounds"), Count, Rounds);
+	Ar.Logf( TEXT("%-8s %10s %10s %8s %8s %9s"), TEXT("Pool"), TEXT("Accept us"), TEXT("Close us"), TEXT("Allocs"), TEXT("Frees"), TEXT("NewNames") );
+	for ( int32 Pooled=0; Pooled<2; Pooled++)
+	{
+		if ( Pooled )
+			Bench->PrewarmConnectionPool();
+		FJoinBenchMalloc CountingMalloc( GMalloc);
+		INT NamesBefore = FName::GetMaxNames();
+		DWORD AcceptCycles = 0;
+		DWORD CloseCycles = 0;
+		GMalloc = &CountingMalloc;
+		for ( int32 Round=0; Round<Rounds; Round++)
+		{
+			// Same steps as DispatchPacket.
+			clockFast( AcceptCycles);
+			for ( int32 i=0; i<Count; i++)
+			{
+				IPEndpoint Endpoint( IPAddress( 198, 51, 100, i & 0xFF), 1024 + Round * 16 + (i >> 8));
+				UXC_TcpipConnection* Connection = Bench->CreateClientConnection( Socket, Endpoint);
+				Bench->ClientConnections.AddItem( Connection);
+				Bench->HashConnection( Connection);
+			}
+			unclockFast( AcceptCycles);
+
+			// Same steps as UNetDriver::TickDispatch on closed connections.
+			clockFast( CloseCycles);
+			for ( int32 i=Bench->ClientConnections.Num()-1; i>=0; i--)
+			{
+				Bench->ClientConnections(i)->State = USOCK_Closed;
+				delete Bench->ClientConnections(i);
+			}
+			unclockFast( CloseCycles);
+		}
+		GMalloc = CountingMalloc.Inner;
+
+		int32 Total = Count * Rounds;
+		Ar.Logf( TEXT("%-8s %10.2f %10.2f %8.1f %8.1f %9i")
+			, Pooled ? TEXT("On") : TEXT("Off")
+			, AcceptCycles * GSecondsPerCycle * 1000000.0 / Total
+			, CloseCycles * GSecondsPerCycle * 1000000.0 / Total
+			, (double)CountingMalloc.Allocs / Total
+			, (double)CountingMalloc.Frees / Total
+			, FName::GetMaxNames() - NamesBefore );
+	}
+	Ar.Logf( TEXT("Allocs and frees are per connection, %u of %u connections used pooled names")
+		, Bench->PooledNamesUsed
+		, Bench->ConnectionsCreated );
+	delete Bench;
+	return 1;
+	unguard;
+}
+
+//
+// Local addresses are cached process-wide and refreshed by a watcher thread,
+// this only does work when they change.
+//
+void UXC_TcpNetDriver::CheckLocalAddresses()
+{
+	uint32 Serial = GetLocalAddressSerial();
+	if ( Serial == LocalAddressSerial )
+		return;
+	LocalAddressSerial = Serial;
+
+	TArray<IPAddress> MultiAddress = GetLocalBindAddress(*GLog);
+	if ( !MultiAddress.Num() )
+	{
+		debugf( NAME_DevNet, TEXT("Local addresses changed, none available") );
+		return;
+	}
+	if ( MultiAddress.FindItemIndex(LocalAddress.Address) == INDEX_NONE )
+	{
+		debugf( NAME_DevNet, TEXT("Local addresses changed, network number %s -> %s"), appFromAnsi(*LocalAddress.Address), appFromAnsi(*MultiAddress(0)) );
+		LocalAddress.Address = MultiAddress(0);
+	}
+
+	// Sockets bound to one address can't be reached while it's gone.
+	// They aren't rebound, the address usually comes back (DHCP renewal, interface restart).
+	for ( int32 s=0; (s<SocketAddresses.Num()) && (s<32); s++)
+	{
+		UBOOL bLost = !IsLocalAddress( SocketAddresses(s));
+		if ( bLost == ((LostSocketAddresses >> s) & 1) )
+			continue;
+		LostSocketAddresses ^= 1 << s;
+		if ( bLost )
+			debugf( NAME_Warning, TEXT("Socket bound to %s lost its address, clients can't reach it until the address is back"), *UnmappedAddress(*SocketAddresses(s)) );
+		else
+			debugf( NAME_Log, TEXT("Socket bound to %s has its address back"), *UnmappedAddress(*SocketAddresses(s)) );
+	}
+}
+
+/*-----------------------------------------------------------------------------
+	Connection stats.
+-----------------------------------------------------------------------------*/
+
+enum EStatsSort
+{
+	STATSORT_Bytes,
+	STATSORT_Ping,
+	STATSORT_Loss,
+	STATSORT_Fails,
+	STATSORT_Time,
+};
+
+static int32 ParseStatsSort( const TCHAR* SortBy)
+{
+	if ( SortBy && *SortBy )
+	{
+		if ( !appStricmp( SortBy, TEXT("PING")) || !appStricmp( SortBy, TEXT("RTT")) )
+			return STATSORT_Ping;
+		if ( !appStricmp( SortBy, TEXT("LOSS")) )
+			return STATSORT_Loss;
+		if ( !appStricmp( SortBy, TEXT("FAILS")) )
+			return STATSORT_Fails;
+		if ( !appStricmp( SortBy, TEXT("TIME")) )
+			return STATSORT_Time;
+	}
+	return STATSORT_Bytes;
+}
+
+// Higher value goes first
+static double GetStatsSortValue( UXC_TcpipConnection* Connection, int32 SortKey)
+{
+	switch ( SortKey )
+	{
+	case STATSORT_Ping:  return Connection->AvgLag;
+	case STATSORT_Loss:  return Max( Connection->InLoss, Connection->OutLoss);
+	case STATSORT_Fails: return (double)(Connection->Stats.SendFailures + Connection->Stats.PortUnreach);
+	case STATSORT_Time:  return appSeconds() - Connection->Stats.StartTime;
+	default:             return (double)(Connection->Stats.BytesSent + Connection->Stats.BytesRecv);
+	}
+}
+
+void UXC_TcpNetDriver::GetSortedConnections( TArray<UXC_TcpipConnection*>& Result, const TCHAR* SortBy)
+{
+	Result.Empty();
+	if ( GetServerConnection() )
+		Result.AddItem( GetServerConnection() );
+	for ( int32 i=0; i<ClientConnections.Num(); i++)
+		if ( ClientConnections(i) )
+			Result.AddItem( (UXC_TcpipConnection*)ClientConnections(i) );
+
+	// Insertion sort, connection count is small
+	int32 SortKey = ParseStatsSort( SortBy);
+	for ( int32 i=1; i<Result.Num(); i++)
+	{
+		UXC_TcpipConnection* Connection = Result(i);
+		double Value = GetStatsSortValue( Connection, SortKey);
+		int32 j = i - 1;
+		for ( ; (j >= 0) && (GetStatsSortValue( Result(j), SortKey) < Value); j--)
+			Result(j+1) = Result(j);
+		Result(j+1) = Connection;
+	}
+}
+
+FString UXC_TcpNetDriver::ExportStats( UBOOL bJSON)
+{
+	TArray<UXC_TcpipConnection*> Connections;
+	GetSortedConnections( Connections, nullptr);
+
+	double Now = appSeconds();
+	FString Result;
+	if ( bJSON ) //One JSON object per dump (JSON lines)
+		Result = FString::Printf( TEXT("{\"time\":\"%s\",\"connections\":["), appTimestamp() );
+	for ( int32 i=0; i<Connections.Num(); i++)
+	{
+		UXC_TcpipConnection* Connection = Connections(i);
+		FConnectionStats& Stats = Connection->Stats;
+		const TCHAR* Fmt = bJSON
+			? TEXT("%s{\"address\":\"%s\",\"state\":%i,\"rtt\":%i,\"inloss\":%.2f,\"outloss\":%.2f,\"netspeed\":%i,\"bytesout\":%llu,\"bytesin\":%llu,\"pktout\":%u,\"pktin\":%u,\"sendfail\":%u,\"lasterror\":%i,\"portunreach\":%u,\"seconds\":%i}")
+			: TEXT("%s%s,%i,%i,%.2f,%.2f,%i,%llu,%llu,%u,%u,%u,%i,%u,%i\r\n");
+		Result += FString::Printf( Fmt
+			, bJSON ? (i ? TEXT(",") : TEXT("")) : appTimestamp()
+			, *Connection->LowLevelGetRemoteAddress()
+			, (int32)Connection->State
+			, appRound( Connection->AvgLag * 1000.f)
+			, Connection->InLoss * 100.f
+			, Connection->OutLoss * 100.f
+			, Connection->CurrentNetSpeed
+			, Stats.BytesSent
+			, Stats.BytesRecv
+			, Stats.PacketsSent
+			, Stats.PacketsRecv
+			, Stats.SendFailures
+			, Stats.LastSendError
+			, Stats.PortUnreach
+			, appFloor( Now - Stats.StartTime) );
+	}
+	if ( bJSON )
+		Result += TEXT("]}\r\n");
+	return Result;
+}
+
+UBOOL UXC_TcpNetDriver::DumpStats( const TCHAR* Filename)
+{
+	if ( !Filename || !*Filename )
+		return 0;
+
+	UBOOL bJSON = appStrfind( Filename, TEXT(".json")) != nullptr;
+	UBOOL bNewFile = GFileManager->FileSize( Filename) <= 0;
+	FArchive* Ar = GFileManager->CreateFileWriter( Filename, FILEWRITE_Append);
+	if ( !Ar )
+		return 0;
+
+	FString Text;
+	if ( bNewFile && !bJSON )
+		Text = TEXT("Time,Address,State,RTT,InLoss,OutLoss,NetSpeed,BytesOut,BytesIn,PacketsOut,PacketsIn,SendFailures,LastSendError,PortUnreach,Seconds\r\n");
+	Text += ExportStats( bJSON);
+	TArray<ANSICHAR> AnsiText( Text.Len() );
+	for ( int32 i=0; i<Text.Len(); i++)
+		AnsiText(i) = (ANSICHAR)(*Text)[i];
+	if ( AnsiText.Num() )
+		Ar->Serialize( &AnsiText(0), AnsiText.Num() );
+	delete Ar;
+	return 1;
+}
+
+//
+// NETSTATS [SORT=BYTES|PING|LOSS|FAILS|TIME]
+// NETSTATS DUMP [FILE=Filename]
+// NETSTATS BWE
+// NETSTATS JOINBENCH [COUNT=n] [ROUNDS=n]
+// NETSTATS CAPTURE [COUNT=n] | CAPTURE SAVE [FILE=Filename]
+// NETSTATS LZ4BENCH [FILE=Filename] [ROUNDS=n]
+//
+UBOOL UXC_TcpNetDriver::Exec( const TCHAR* Cmd, FOutputDevice& Ar)
+{
+	guard(UXC_TcpNetDriver::Exec);
+	const TCHAR* Str = Cmd;
+	if ( ParseCommand( &Str, TEXT("NETEMU")) )
+		return ExecEmulation( Str, Ar);
+	if ( ParseCommand( &Str, TEXT("NETTRACE")) )
+		return ExecTrace( Str, Ar);
+	if ( ParseCommand( &Str, TEXT("HTTPBENCH")) )
+		return ExecHTTPBenchmark( Str, Ar);
+	if ( ParseCommand( &Str, TEXT("NETSTATS")) )
+	{
+		if ( ParseCommand( &Str, TEXT("BWE")) )
+			return ExecBandwidth( Ar);
+		if ( ParseCommand( &Str, TEXT("JOINBENCH")) )
+			return ExecJoinBenchmark( Str, Ar);
+		const TCHAR* Sub = Str;
+		if ( ParseCommand( &Sub, TEXT("CAPTURE")) || ParseCommand( &Sub, TEXT("LZ4BENCH")) )
+			return ExecCompressBenchmark( Str, Ar);
+		if ( ParseCommand( &Str, TEXT("DUMP")) )
+		{
+			FString Filename = StatsDumpFile;
+			Parse( Str, TEXT("FILE="), Filename);
+			if ( DumpStats( *Filename) )
+				Ar.Logf( TEXT("Connection stats written to %s"), *Filename);
+			else
+				Ar.Logf( TEXT("Unable to write connection stats to %s"), *Filename);
+			return 1;
+		}
+
+		FString SortBy;
+		Parse( Str, TEXT("SORT="), SortBy);
+		TArray<UXC_TcpipConnection*> Connections;
+		GetSortedConnections( Connections, *SortBy);
+
+		double Now = appSeconds();
+		Ar.Logf( TEXT("%i connections:"), Connections.Num() );
+		Ar.Logf( TEXT("%-40s %5s %6s %6s %7s %10s %10s %5s %5s %5s"), TEXT("Address"), TEXT("RTT"), TEXT("InL%"), TEXT("OutL%"), TEXT("Rate"), TEXT("KBOut"), TEXT("KBIn"), TEXT("Fail"), TEXT("ICMP"), TEXT("Secs") );
+		for ( int32 i=0; i<Connections.Num(); i++)
+		{
+			UXC_TcpipConnection* Connection = Connections(i);
+			FConnectionStats& Stats = Connection->Stats;
+			Ar.Logf( TEXT("%-40s %5i %6.2f %6.2f %7i %10i %10i %5u %5u %5i")
+				, *Connection->LowLevelGetRemoteAddress()
+				, appRound( Connection->AvgLag * 1000.f)
+				, Connection->InLoss * 100.f
+				, Connection->OutLoss * 100.f
+				, Connection->CurrentNetSpeed
+				, (int32)(Stats.BytesSent / 1024)
+				, (int32)(Stats.BytesRecv / 1024)
+				, Stats.SendFailures
+				, Stats.PortUnreach
+				, appFloor( Now - Stats.StartTime) );
+			if ( Stats.SendFailures && Stats.LastSendError )
+				Ar.Logf( TEXT("%-40s last send error: %s"), TEXT(""), appFromAnsi(CSocket::ErrorText(Stats.LastSendError)) );
+		}
+		Ar.Logf( TEXT("Pool: %u connections accepted, %u used pooled names, %i names free")
+			, ConnectionsCreated
+			, PooledNamesUsed
+			, FreeConnectionNames.Num() );
+		if ( XDP )
+			Ar.Logf( TEXT("AF_XDP: %u packets received, %u sent, %u sent through sockets, TX ring full %u times")
+				, XDP->PacketsRecv
+				, XDP->PacketsSent
+				, XDP->SendFallbacks
+				, XDP->TxFull );
+		if ( Pacer )
+		{
+			Ar.Logf( TEXT("Pacing: %u packets paced, %u by kernel send time, largest burst %u before pacing, %u after")
+				, Pacer->PacedPackets
+				, Pacer->TxTimePackets
+				, Pacer->MaxTickBurst
+				, Pacer->MaxPacedBurst );
+			if ( Pacer->BlockedSends || Pacer->SendErrors )
+				Ar.Logf( TEXT("Pacing: send buffer full %u times, %u send errors (last: %s)")
+					, Pacer->BlockedSends
+					, Pacer->SendErrors
+					, appFromAnsi(CSocket::ErrorText(Pacer->LastSendError)) );
+		}
+		if ( QueuedSends )
+			Ar.Logf( TEXT("Send queue: %u packets deferred, %u unreliable and %u reliable dropped")
+				, QueuedSends
+				, QueueDropsUnreliable
+				, QueueDropsReliable );
+		if ( CompressedPackets )
+			Ar.Logf( TEXT("LZ4: %u packets, %i KB -> %i KB (%.1f%% saved), %.2f ms CPU")
+				, CompressedPackets
+				, (int32)(CompressBytesIn / 1024)
+				, (int32)(CompressBytesOut / 1024)
+				, 100.0 * (double)(CompressBytesIn - CompressBytesOut) / (double)CompressBytesIn
+				, CompressCycles * GSecondsPerCycle * 1000.0 );
+		return 1;
+	}
+	return Super::Exec( Cmd, Ar);
+	unguard;
+}
+
 void UXC_TcpNetDriver::StaticConstructor()
 {
 	new(GetClass(),TEXT("AllowPlayerPortUnreach"),	RF_Public)UBoolProperty (CPP_PROPERTY(AllowPlayerPortUnreach), TEXT("Client"), CPF_Config );
 	new(GetClass(),TEXT("LogPortUnreach"),			RF_Public)UBoolProperty (CPP_PROPERTY(LogPortUnreach        ), TEXT("Client"), CPF_Config );
 	new(GetClass(),TEXT("ConnectionLimit"),			RF_Public)UIntProperty  (CPP_PROPERTY(ConnectionLimit       ), TEXT("Settings"), CPF_Config );
 	new(GetClass(),TEXT("UseIPv6"),                 RF_Public)UBoolProperty (CPP_PROPERTY(UseIPv6               ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("DualStackSocket"),         RF_Public)UBoolProperty (CPP_PROPERTY(DualStackSocket       ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("CompressPackets"),         RF_Public)UBoolProperty (CPP_PROPERTY(CompressPackets       ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("CompressThreshold"),       RF_Public)UIntProperty  (CPP_PROPERTY(CompressThreshold     ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("PacedSend"),               RF_Public)UBoolProperty (CPP_PROPERTY(PacedSend             ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("PacedSendTxTime"),         RF_Public)UBoolProperty (CPP_PROPERTY(PacedSendTxTime       ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("SendQueueSize"),           RF_Public)UIntProperty  (CPP_PROPERTY(SendQueueSize         ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("CompressCache"),           RF_Public)UBoolProperty (CPP_PROPERTY(CompressCache         ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("CompressCacheDir"),        RF_Public)UStrProperty  (CPP_PROPERTY(CompressCacheDir      ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("CompressCacheThreads"),    RF_Public)UIntProperty  (CPP_PROPERTY(CompressCacheThreads  ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("AdaptiveNetSpeed"),        RF_Public)UBoolProperty (CPP_PROPERTY(AdaptiveNetSpeed      ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("AdaptiveMinNetSpeed"),     RF_Public)UIntProperty  (CPP_PROPERTY(AdaptiveMinNetSpeed   ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("AdaptiveMaxNetSpeed"),     RF_Public)UIntProperty  (CPP_PROPERTY(AdaptiveMaxNetSpeed   ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("AdaptiveDelayMs"),         RF_Public)UIntProperty  (CPP_PROPERTY(AdaptiveDelayMs       ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("UseAFXDP"),                RF_Public)UBoolProperty (CPP_PROPERTY(UseAFXDP              ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("AFXDPInterface"),          RF_Public)UStrProperty  (CPP_PROPERTY(AFXDPInterface        ), TEXT("Settings"), CPF_Config );
+	new(GetClass(),TEXT("EmuPktLag"),               RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.PktLag         ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("EmuPktLagVariance"),       RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.PktLagVariance ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("EmuPktLoss"),              RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.PktLoss        ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("EmuPktDup"),               RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.PktDup         ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("EmuPktOrder"),             RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.PktOrder       ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("EmuBandwidth"),            RF_Public)UIntProperty  (CPP_PROPERTY(Emulation.Bandwidth      ), TEXT("Emulation"), CPF_Config );
+	new(GetClass(),TEXT("StatsDumpInterval"),       RF_Public)UFloatProperty(CPP_PROPERTY(StatsDumpInterval     ), TEXT("Stats"), CPF_Config );
+	new(GetClass(),TEXT("StatsDumpFile"),           RF_Public)UStrProperty  (CPP_PROPERTY(StatsDumpFile         ), TEXT("Stats"), CPF_Config );
+	new(GetClass(),TEXT("MetricsPort"),             RF_Public)UIntProperty  (CPP_PROPERTY(MetricsPort           ), TEXT("Stats"), CPF_Config );
 
 	
 	UXC_TcpNetDriver* DefObject = GetDefault<UXC_TcpNetDriver>();
@@ -412,6 +1555,24 @@ void UXC_TcpNetDriver::StaticConstructor()
 	DefObject->RedirectRate = 50000;
 	DefObject->RedirectPort = 7782;
 	DefObject->ConnectionLimit = 128;
+	DefObject->CompressPackets = 0;
+	DefObject->CompressThreshold = 128;
+	DefObject->PacedSend = 0;
+	DefObject->PacedSendTxTime = 0;
+	DefObject->DualStackSocket = 0;
+	DefObject->SendQueueSize = 32768;
+	DefObject->CompressCache = 0;
+	DefObject->CompressCacheDir = TEXT("../Redirect");
+	DefObject->CompressCacheThreads = 2;
+	DefObject->AdaptiveNetSpeed = 0;
+	DefObject->AdaptiveMinNetSpeed = 5000;
+	DefObject->AdaptiveMaxNetSpeed = 0;
+	DefObject->AdaptiveDelayMs = 40;
+	DefObject->UseAFXDP = 0;
+	DefObject->AFXDPInterface = TEXT("eth0");
+	DefObject->StatsDumpInterval = 0;
+	DefObject->StatsDumpFile = TEXT("../Logs/XC_NetStats.csv");
+	DefObject->MetricsPort = 0;
 }
 
 void UXC_TcpNetDriver::PostEditChange()
@@ -427,6 +1588,15 @@ void UXC_TcpNetDriver::PostEditChange()
 	RedirectPort = Clamp( RedirectPort, 1, 65535);
 	RedirectRate = Clamp( RedirectRate, 5000, 5000000); //5gbps
 	ConnectionLimit = Clamp( ConnectionLimit, 2, 1000); //Umm... lol
+	CompressThreshold = Clamp( CompressThreshold, 16, NETWORK_MAX_PACKET);
+	SendQueueSize = Clamp( SendQueueSize, 0, 1048576);
+	CompressCacheThreads = Clamp( CompressCacheThreads, 1, COMPRESS_MAX_THREADS);
+	AdaptiveMinNetSpeed = Clamp( AdaptiveMinNetSpeed, 1800, 1000001);
+	AdaptiveMaxNetSpeed = Clamp( AdaptiveMaxNetSpeed, 0, 1000001);
+	AdaptiveDelayMs = Clamp( AdaptiveDelayMs, 5, 1000);
+	Emulation.Validate();
+	StatsDumpInterval = Max( StatsDumpInterval, 0.f);
+	MetricsPort = Clamp( MetricsPort, 0, 65535);
 
 	Super::PostEditChange();
 	SaveConfig();
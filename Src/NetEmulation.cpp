@@ -0,0 +1,227 @@
+/*=============================================================================
+	NetEmulation.cpp
+	Author: Fernando Velazquez
+
+	Network condition emulator for UXC_TcpNetDriver.
+	Applies latency, jitter, loss, duplication, reordering and bandwidth
+	caps between the socket and the connections, so that load tests on a
+	single machine behave like internet traffic.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+
+// Packets held at once, a slow bandwidth cap would otherwise grow the queue without bound.
+#define EMULATION_MAX_PACKETS 4096
+
+/*-----------------------------------------------------------------------------
+	FNetEmulation.
+-----------------------------------------------------------------------------*/
+
+UBOOL FNetEmulation::IsActive() const
+{
+	return PktLag || PktLagVariance || PktLoss || PktDup || PktOrder || Bandwidth;
+}
+
+void FNetEmulation::Validate()
+{
+	PktLag         = Clamp( PktLag, 0, 5000);
+	PktLagVariance = Clamp( PktLagVariance, 0, 5000);
+	PktLoss        = Clamp( PktLoss, 0, 100);
+	PktDup         = Clamp( PktDup, 0, 100);
+	PktOrder       = Clamp( PktOrder, 0, 100);
+	Bandwidth      = Max( Bandwidth, 0);
+}
+
+FString FNetEmulation::String() const
+{
+	return FString::Printf( TEXT("LAG=%i VAR=%i LOSS=%i DUP=%i ORDER=%i BW=%i")
+		, PktLag, PktLagVariance, PktLoss, PktDup, PktOrder, Bandwidth);
+}
+
+static UBOOL ParseEmulation( const TCHAR* Cmd, FNetEmulation& Emulation)
+{
+	UBOOL bParsed = 0;
+	bParsed |= Parse( Cmd, TEXT("LAG="), Emulation.PktLag);
+	bParsed |= Parse( Cmd, TEXT("VAR="), Emulation.PktLagVariance);
+	bParsed |= Parse( Cmd, TEXT("LOSS="), Emulation.PktLoss);
+	bParsed |= Parse( Cmd, TEXT("DUP="), Emulation.PktDup);
+	bParsed |= Parse( Cmd, TEXT("ORDER="), Emulation.PktOrder);
+	bParsed |= Parse( Cmd, TEXT("BW="), Emulation.Bandwidth);
+	Emulation.Validate();
+	return bParsed;
+}
+
+static inline UBOOL RollPercent( int32 Percent)
+{
+	return Percent && (appFrand() * 100.f < (float)Percent);
+}
+
+/*-----------------------------------------------------------------------------
+	UXC_TcpNetDriver emulation interface.
+-----------------------------------------------------------------------------*/
+
+UBOOL UXC_TcpNetDriver::EmulationActive() const
+{
+	return ConnectionEmulation || Emulation.IsActive();
+}
+
+//
+// Returns true if the emulation layer took ownership of the packet (delayed or dropped).
+//
+UBOOL UXC_TcpNetDriver::EmulatePacket( UXC_TcpipConnection* Connection, CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Size, UBOOL bOutgoing )
+{
+	FNetEmulation& Settings = (Connection && Connection->UseEmulation) ? Connection->Emulation : Emulation;
+	if ( !Settings.IsActive() )
+		return 0;
+
+	if ( RollPercent( Settings.PktLoss) )
+		return 1;
+
+	double Now = appSeconds();
+	double ReleaseTime = Now + (Settings.PktLag + Settings.PktLagVariance * appFrand()) * 0.001;
+	if ( RollPercent( Settings.PktOrder) )
+		ReleaseTime += (Settings.PktLagVariance + 20) * 0.001;
+
+	// Bandwidth cap serializes packets on the emulated link.
+	if ( Settings.Bandwidth > 0 )
+	{
+		double& LinkTime = Connection ? Connection->EmulationLinkTime[bOutgoing] : EmulationLinkTime[bOutgoing];
+		LinkTime = Max( LinkTime, Now) + (double)(Size + 28) / (double)Settings.Bandwidth; //UDP/IP headers count
+		ReleaseTime = Max( ReleaseTime, LinkTime);
+	}
+
+	int32 Copies = RollPercent( Settings.PktDup) ? 2 : 1;
+	for ( int32 c=0; c<Copies; c++ )
+	{
+		// Queue is full, oldest packet is dropped like an overflowing router would.
+		if ( NumDelayedPackets() >= EMULATION_MAX_PACKETS )
+		{
+			DelayedPackets(DelayedHead++).Data.Empty();
+			EmulationDrops++;
+			if ( DelayedHead * 2 >= DelayedPackets.Num() )
+			{
+				DelayedPackets.Remove( 0, DelayedHead);
+				DelayedHead = 0;
+			}
+		}
+
+		// Keep queue sorted by release time.
+		int32 Index = DelayedPackets.Num();
+		while ( (Index > DelayedHead) && (DelayedPackets(Index-1).ReleaseTime > ReleaseTime) )
+			Index--;
+		DelayedPackets.InsertZeroed( Index);
+		FDelayedPacket& Packet = DelayedPackets(Index);
+		Packet.ReleaseTime = ReleaseTime;
+		Packet.Socket      = Socket;
+		Packet.Endpoint    = Endpoint;
+		Packet.bOutgoing   = bOutgoing;
+		Packet.Data.Add( Size);
+		appMemcpy( &Packet.Data(0), Data, Size);
+		ReleaseTime += 0.001;
+	}
+	return 1;
+}
+
+int32 UXC_TcpNetDriver::NumDelayedPackets() const
+{
+	return DelayedPackets.Num() - DelayedHead;
+}
+
+//
+// Sends or dispatches every packet whose time has come.
+// Connections are looked up again on release as they may be gone by now.
+//
+void UXC_TcpNetDriver::ReleaseDelayedPackets()
+{
+	double Now = appSeconds();
+	int32 Count = 0;
+	while ( (DelayedHead + Count < DelayedPackets.Num()) && (DelayedPackets(DelayedHead + Count).ReleaseTime <= Now) )
+		Count++;
+	if ( !Count )
+		return;
+
+	// Detach released packets first, dispatching may queue new ones.
+	TArray<FDelayedPacket> Released;
+	Released.AddZeroed( Count);
+	for ( int32 i=0; i<Count; i++)
+		Exchange( Released(i), DelayedPackets(DelayedHead + i));
+	DelayedHead += Count;
+
+	// Released slots are only compacted once they're half the array.
+	if ( DelayedHead == DelayedPackets.Num() )
+	{
+		DelayedPackets.Empty();
+		DelayedHead = 0;
+	}
+	else if ( DelayedHead * 2 >= DelayedPackets.Num() )
+	{
+		DelayedPackets.Remove( 0, DelayedHead);
+		DelayedHead = 0;
+	}
+
+	for ( int32 i=0; i<Released.Num(); i++)
+	{
+		FDelayedPacket& Packet = Released(i);
+		if ( Packet.bOutgoing )
+		{
+			// Connection's own traffic goes through its pacer and send queue.
+			UXC_TcpipConnection* Connection = FindConnection( Packet.Endpoint, 0);
+			if ( Connection && (Connection->RemoteAddress == Packet.Endpoint) && (Connection->Socket.Socket == Packet.Socket.Socket) )
+				Connection->SendToRemote( &Packet.Data(0), Packet.Data.Num() );
+			else
+			{
+				UBOOL bBlocked;
+				TransmitPacket( Packet.Socket, Packet.Endpoint, &Packet.Data(0), Packet.Data.Num(), bBlocked);
+			}
+		}
+		else
+			DispatchPacket( Packet.Socket, Packet.Endpoint, &Packet.Data(0), Packet.Data.Num() );
+	}
+}
+
+//
+// NETEMU [LAG=ms] [VAR=ms] [LOSS=%] [DUP=%] [ORDER=%] [BW=bytes/s] [ADDR=connection address]
+// NETEMU OFF
+//
+UBOOL UXC_TcpNetDriver::ExecEmulation( const TCHAR* Cmd, FOutputDevice& Ar )
+{
+	guard(UXC_TcpNetDriver::ExecEmulation);
+	if ( ParseCommand( &Cmd, TEXT("OFF")) )
+	{
+		appMemzero( &Emulation, sizeof(Emulation));
+		for ( int32 i=0; i<ClientConnections.Num(); i++)
+			if ( ClientConnections(i) )
+				((UXC_TcpipConnection*)ClientConnections(i))->UseEmulation = 0;
+		if ( GetServerConnection() )
+			GetServerConnection()->UseEmulation = 0;
+		ConnectionEmulation = 0;
+		Ar.Logf( TEXT("Network emulation disabled, %i queued packets will still be delivered"), NumDelayedPackets() );
+		return 1;
+	}
+
+	FString Address;
+	if ( Parse( Cmd, TEXT("ADDR="), Address) )
+	{
+		TArray<UXC_TcpipConnection*> Connections;
+		GetSortedConnections( Connections, nullptr);
+		for ( int32 i=0; i<Connections.Num(); i++)
+			if ( Connections(i)->LowLevelGetRemoteAddress() == Address )
+			{
+				UXC_TcpipConnection* Connection = Connections(i);
+				if ( !Connection->UseEmulation )
+					Connection->Emulation = Emulation;
+				ParseEmulation( Cmd, Connection->Emulation);
+				Connection->UseEmulation = 1;
+				ConnectionEmulation = 1;
+				Ar.Logf( TEXT("Network emulation for %s: %s"), *Address, *Connection->Emulation.String() );
+				return 1;
+			}
+		Ar.Logf( TEXT("No connection with address %s"), *Address);
+		return 1;
+	}
+
+	ParseEmulation( Cmd, Emulation);
+	Ar.Logf( TEXT("Network emulation: %s, %i queued packets, %u dropped on overflow"), *Emulation.String(), NumDelayedPackets(), EmulationDrops );
+	return 1;
+	unguard;
+}
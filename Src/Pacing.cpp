@@ -0,0 +1,423 @@
+/*=============================================================================
+	Pacing.cpp
+	Author: Fernando Velazquez
+
+	Paced transmission for UXC_TcpNetDriver.
+	All replication for a tick is flushed at once, at high tick rates and
+	player counts these microbursts overflow small router buffers.
+	The pacer releases each connection's packets at its net speed instead.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "Cacus/Atomics.h"
+
+#ifdef __linux__
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <time.h>
+	#include <linux/net_tstamp.h>
+	#ifndef SO_TXTIME
+		#define SO_TXTIME 61
+		#define SCM_TXTIME SO_TXTIME
+	#endif
+#endif
+
+/*-----------------------------------------------------------------------------
+	Pacer thread.
+-----------------------------------------------------------------------------*/
+
+static unsigned long PacerThreadEntry( void* Arg, CThread* Handler)
+{
+	FPacketPacer* Pacer = (FPacketPacer*)Arg;
+	while ( !Pacer->bExit )
+		Pacer->Event.Wait( Pacer->Flush() ); //Sleeps until due or woken by Send
+	return THREAD_END_OK;
+}
+
+#ifdef __linux__
+//
+// Destination for sendmsg in the socket's family.
+// IPv4 peers of a dual stack socket use their mapped form.
+//
+static UBOOL GetSockAddr( const IPEndpoint& Endpoint, int32 Family, sockaddr_storage& Addr, socklen_t& AddrSize)
+{
+	const uint8* Bytes = Endpoint.Address.Bytes;
+	UBOOL bIPv4 = IsIPv4Address( Endpoint.Address);
+	appMemzero( &Addr, sizeof(Addr));
+	if ( Family == AF_INET )
+	{
+		sockaddr_in* In = (sockaddr_in*)&Addr;
+		In->sin_family = AF_INET;
+		In->sin_port = htons( Endpoint.Port);
+		appMemcpy( &In->sin_addr, Bytes + 12, 4);
+		AddrSize = sizeof(sockaddr_in);
+		return bIPv4;
+	}
+
+	sockaddr_in6* In6 = (sockaddr_in6*)&Addr;
+	In6->sin6_family = AF_INET6;
+	In6->sin6_port = htons( Endpoint.Port);
+	if ( bIPv4 )
+	{
+		In6->sin6_addr.s6_addr[10] = 0xFF;
+		In6->sin6_addr.s6_addr[11] = 0xFF;
+		appMemcpy( &In6->sin6_addr.s6_addr[12], Bytes + 12, 4);
+	}
+	else
+		appMemcpy( &In6->sin6_addr, Bytes, 16);
+	AddrSize = sizeof(sockaddr_in6);
+	return 1;
+}
+#endif
+
+/*-----------------------------------------------------------------------------
+	FPacketPacer.
+-----------------------------------------------------------------------------*/
+
+FPacketPacer::FPacketPacer( UXC_TcpNetDriver* InDriver )
+	: CThread()
+	, Driver(InDriver)
+	, Lock(0)
+	, bExit(0)
+	, bBlocked(0)
+	, NumQueued(0)
+	, NumFree(PACER_MAX_PACKETS)
+	, NextSendTime(0)
+	, NextSequence(0)
+	, NumTxTimeSockets(0)
+	, TickBurst(0)
+	, TickImmediate(0)
+	, MaxTickBurst(0)
+	, MaxPacedBurst(0)
+	, PacedPackets(0)
+	, TxTimePackets(0)
+	, BlockedSends(0)
+	, SendErrors(0)
+	, LastSendError(0)
+{
+	for ( int32 i=0; i<PACER_MAX_PACKETS; i++)
+	{
+		FreeList[i] = PACER_MAX_PACKETS - 1 - i;
+		Used[i] = 0;
+	}
+	Run( &PacerThreadEntry, this);
+}
+
+//
+// Driver's sockets must still be open here.
+//
+FPacketPacer::~FPacketPacer()
+{
+	bExit = 1;
+	Event.Signal();
+	while ( !WaitFinish( 0.01f) );
+
+	// Don't lose what's left.
+	double Next;
+	UBOOL bStopped = 0;
+	bBlocked = 0;
+	SendDue( CollectDue( appSeconds() + 1000.0, Next), bStopped);
+	if ( Driver->XDP )
+		Driver->XDP->Flush();
+}
+
+//
+// Lets the kernel hold paced packets (Linux 4.19+).
+// Without the fq or etf qdisc on the interface they leave right away,
+// so this is opt-in and the pacer thread stays in charge otherwise.
+//
+UBOOL FPacketPacer::EnableTxTime( TArray<CSocket>& Sockets )
+{
+#ifdef __linux__
+	if ( Sockets.Num() > (int32)ARRAY_COUNT(TxTimeSockets) )
+		return 0;
+	for ( int32 i=0; i<Sockets.Num(); i++)
+	{
+		sock_txtime Config;
+		Config.clockid = CLOCK_MONOTONIC;
+		Config.flags = 0;
+		sockaddr_storage Local;
+		socklen_t LocalSize = sizeof(Local);
+		if ( (setsockopt( Sockets(i).Socket, SOL_SOCKET, SO_TXTIME, &Config, sizeof(Config)) != 0)
+			|| (getsockname( Sockets(i).Socket, (sockaddr*)&Local, &LocalSize) != 0) )
+		{
+			NumTxTimeSockets = 0;
+			return 0;
+		}
+		TxTimeSockets[i].Socket = Sockets(i);
+		TxTimeSockets[i].Family = Local.ss_family;
+	}
+	NumTxTimeSockets = Sockets.Num();
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+//
+// Schedules a packet at the connection's pacing rate.
+// Returns false if the packet should be sent right away.
+//
+UBOOL FPacketPacer::Send( UXC_TcpipConnection* Connection, const uint8* Data, int32 Count, double TickInterval )
+{
+	TickBurst++;
+	if ( Count > PACER_MAX_SIZE )
+		return 0;
+
+	// Pace slightly above net speed so the queue drains before next tick's flush.
+	double Now = appSeconds();
+	double Rate = Max( Connection->CurrentNetSpeed, 2600) * 1.25;
+	double SendTime = Clamp( Connection->PacingTime, Now, Now + TickInterval);
+	Connection->PacingTime = SendTime + (double)(Count + 28) / Rate; //UDP/IP headers count
+	if ( SendTime <= Now )
+	{
+		TickImmediate++;
+		return 0;
+	}
+
+	if ( NumTxTimeSockets )
+	{
+		if ( SendTxTime( Connection->Socket, Connection->RemoteAddress, Data, Count, SendTime - Now) )
+		{
+			TxTimePackets++;
+			return 1;
+		}
+		TickImmediate++;
+		return 0; //Full buffer or error, the normal path deals with it
+	}
+
+	CSpinLock SL(&Lock);
+	if ( !NumFree )
+	{
+		TickImmediate++;
+		return 0;
+	}
+	int32 Index = FreeList[--NumFree];
+	FPacedPacket& Packet = Packets[Index];
+	Packet.SendTime = SendTime;
+	Packet.Sequence = NextSequence++;
+	Packet.Connection = Connection;
+	Packet.Socket   = Connection->Socket;
+	Packet.Endpoint = Connection->RemoteAddress;
+	Packet.Size     = Count;
+	appMemcpy( Packet.Data, Data, Count);
+	Used[Index] = 1;
+	NumQueued++;
+
+	// Pacer is sleeping past this packet's time.
+	if ( (NumQueued == 1) || (SendTime < NextSendTime) )
+	{
+		NextSendTime = SendTime;
+		Event.Signal();
+	}
+	return 1;
+}
+
+//
+// Called once per tick by the driver (game thread).
+//
+void FPacketPacer::EndTick()
+{
+	ReturnBlocked();
+	MaxTickBurst = Max( MaxTickBurst, TickBurst);
+	if ( TickImmediate > MaxPacedBurst )
+	{
+		CSpinLock SL(&Lock); //Pacer thread updates it too
+		MaxPacedBurst = Max( MaxPacedBurst, TickImmediate);
+	}
+	TickBurst = 0;
+	TickImmediate = 0;
+}
+
+//
+// Hands the packets of a blocked pacer back to their connections (game thread).
+// They join the send queues in send order and leave once the socket takes more.
+//
+void FPacketPacer::ReturnBlocked()
+{
+	if ( !bBlocked )
+		return;
+	CSpinLock SL(&Lock);
+	double Next;
+	int32 NumDue = SortDue( appSeconds() + 1000.0, Next);
+	for ( int32 i=0; i<NumDue; i++)
+	{
+		FPacedPacket& Packet = Packets[DueList[i]];
+		if ( Packet.Connection )
+			Packet.Connection->QueuePacket( Packet.Data, Packet.Size);
+		Used[DueList[i]] = 0;
+		FreeList[NumFree++] = DueList[i];
+	}
+	NumQueued -= NumDue;
+	bBlocked = 0;
+}
+
+//
+// Connection is being destroyed, its packets are still sent by the pacer thread.
+//
+void FPacketPacer::Forget( UXC_TcpipConnection* Connection )
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=0; i<PACER_MAX_PACKETS; i++)
+		if ( Used[i] && (Packets[i].Connection == Connection) )
+			Packets[i].Connection = nullptr;
+}
+
+//
+// Sends due packets (pacer thread).
+// Returns time until the next packet is due, negative if there's none.
+//
+double FPacketPacer::Flush()
+{
+	double Now = appSeconds();
+	double Next;
+	int32 NumDue = CollectDue( Now, Next);
+	if ( NumDue == INDEX_NONE )
+		return -1.0; //Blocked, sleep until ReturnBlocked empties the queue
+
+	// The socket is sent to outside the lock, the slots stay used until then.
+	UBOOL bStopped = 0;
+	int32 NumSent = SendDue( NumDue, bStopped);
+	if ( Driver->XDP && NumSent )
+		Driver->XDP->Flush();
+
+	{
+		CSpinLock SL(&Lock);
+		for ( int32 i=0; i<NumSent; i++)
+		{
+			Used[DueList[i]] = 0;
+			FreeList[NumFree++] = DueList[i];
+		}
+		NumQueued -= NumSent;
+		PacedPackets += NumSent;
+		MaxPacedBurst = Max<uint32>( MaxPacedBurst, NumSent);
+
+		// Send buffer is full, the game thread moves the rest to the send queues
+		// so they're retried once the socket is writable, still in order.
+		if ( bStopped )
+		{
+			bBlocked = 1;
+			BlockedSends++;
+			return -1.0;
+		}
+		if ( !NumQueued )
+			return -1.0;
+		NextSendTime = Next;
+	}
+	return Max( Next - appSeconds(), 0.0);
+}
+
+//
+// Picks due packets, INDEX_NONE while blocked.
+// Until the next Flush every Send wakes the pacer, it can't tell
+// whether the packet is due before Next.
+//
+int32 FPacketPacer::CollectDue( double Now, double& Next )
+{
+	CSpinLock SL(&Lock);
+	Next = Now + 1.0;
+	if ( bBlocked )
+		return INDEX_NONE;
+	NextSendTime = Now + 1000.0;
+	return SortDue( Now, Next);
+}
+
+//
+// Fills DueList in SendTime order, ties in queue order (Lock held).
+//
+int32 FPacketPacer::SortDue( double Now, double& Next )
+{
+	Next = Now + 1.0;
+	int32 NumDue = 0;
+	int32 NumSeen = 0;
+	for ( int32 i=0; (i<PACER_MAX_PACKETS) && (NumSeen<NumQueued); i++)
+	{
+		if ( !Used[i] )
+			continue;
+		NumSeen++;
+		const FPacedPacket& Packet = Packets[i];
+		if ( Packet.SendTime > Now )
+		{
+			Next = Min( Next, Packet.SendTime);
+			continue;
+		}
+
+		// Insertion sort, a wakeup rarely finds more than a few due packets.
+		int32 j = NumDue++;
+		for ( ; j>0; j--)
+		{
+			const FPacedPacket& Other = Packets[DueList[j-1]];
+			if ( (Other.SendTime < Packet.SendTime) || ((Other.SendTime == Packet.SendTime) && ((int32)(Other.Sequence - Packet.Sequence) < 0)) )
+				break;
+			DueList[j] = DueList[j-1];
+		}
+		DueList[j] = i;
+	}
+	return NumDue;
+}
+
+//
+// Sends collected packets in order, returns how many are done.
+// Stops at the first full send buffer or XDP ring so nothing overtakes the blocked packet.
+//
+int32 FPacketPacer::SendDue( int32 NumDue, UBOOL& bStopped )
+{
+	for ( int32 i=0; i<NumDue; i++)
+	{
+		FPacedPacket& Packet = Packets[DueList[i]];
+		UBOOL bFull;
+		if ( Driver->TransmitPacket( Packet.Socket, Packet.Endpoint, Packet.Data, Packet.Size, bFull) )
+			continue;
+		if ( bFull )
+		{
+			bStopped = 1;
+			return i;
+		}
+		SendErrors++;
+		LastSendError = Packet.Socket.LastError;
+	}
+	return NumDue;
+}
+
+//
+// Hands the packet to the kernel with its send time (game thread).
+//
+UBOOL FPacketPacer::SendTxTime( CSocket& Socket, const IPEndpoint& Endpoint, const uint8* Data, int32 Count, double Delay )
+{
+#ifdef __linux__
+	int32 Family = 0;
+	for ( int32 i=0; i<NumTxTimeSockets; i++)
+		if ( TxTimeSockets[i].Socket.Socket == Socket.Socket )
+			Family = TxTimeSockets[i].Family;
+	sockaddr_storage Addr;
+	socklen_t AddrSize;
+	if ( !Family || !GetSockAddr( Endpoint, Family, Addr, AddrSize) )
+		return 0;
+
+	timespec Now;
+	clock_gettime( CLOCK_MONOTONIC, &Now);
+	QWORD TxTime = (QWORD)Now.tv_sec * 1000000000 + (QWORD)Now.tv_nsec + (QWORD)(Delay * 1000000000.0);
+
+	uint8 Control[CMSG_SPACE(sizeof(TxTime))];
+	appMemzero( Control, sizeof(Control));
+	iovec Buffer;
+	Buffer.iov_base = (void*)Data;
+	Buffer.iov_len = Count;
+	msghdr Message;
+	appMemzero( &Message, sizeof(Message));
+	Message.msg_name = &Addr;
+	Message.msg_namelen = AddrSize;
+	Message.msg_iov = &Buffer;
+	Message.msg_iovlen = 1;
+	Message.msg_control = Control;
+	Message.msg_controllen = sizeof(Control);
+	cmsghdr* Header = CMSG_FIRSTHDR( &Message);
+	Header->cmsg_level = SOL_SOCKET;
+	Header->cmsg_type = SCM_TXTIME;
+	Header->cmsg_len = CMSG_LEN( sizeof(TxTime));
+	appMemcpy( CMSG_DATA(Header), &TxTime, sizeof(TxTime));
+	return sendmsg( Socket.Socket, &Message, 0) == Count;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,537 @@
+/*=============================================================================
+	Prefetch.cpp
+	Author: Fernando Velazquez
+
+	Concurrent package prefetching for the HTTP downloader.
+	The engine requests missing packages one at a time, so on high latency
+	links most of the join time is spent waiting for round trips.
+	While a package downloads, worker threads fetch the ones after it into
+	DownloadTemp, the downloader then picks them up when they're requested.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+#include "Cacus/Atomics.h"
+
+static FHTTPPrefetcher* GHTTPPrefetcher = nullptr;
+
+FHTTPPrefetcher* GetHTTPPrefetcher()
+{
+	if ( !GHTTPPrefetcher )
+		GHTTPPrefetcher = new FHTTPPrefetcher();
+	return GHTTPPrefetcher;
+}
+
+FHTTPPrefetcher::FHTTPPrefetcher()
+	: Connection(nullptr)
+	, MaxThreads(0)
+	, Timeout(4.0)
+	, KeepAliveTimeout(5.0)
+	, bDecompress(0)
+	, CurlEngine(nullptr)
+	, BatchPackages(0)
+	, BatchBytes(0)
+	, BatchStart(0)
+	, Lock(0)
+{
+	appMemzero( Workers, sizeof(Workers));
+}
+
+/*-----------------------------------------------------------------------------
+	Worker threads.
+-----------------------------------------------------------------------------*/
+
+static unsigned long PrefetchThreadEntry( void* Arg, CThread* Handler)
+{
+	FHTTPPrefetcher::FWorker* Worker = (FHTTPPrefetcher::FWorker*)Arg;
+	FPrefetchEntry Entry;
+	while ( GHTTPPrefetcher->PopEntry( Entry) )
+	{
+		Entry.StartTime = appSecondsNew();
+		Entry.State = GHTTPPrefetcher->Fetch( Entry) ? PREFETCH_Done : PREFETCH_Failed;
+		Entry.EndTime = appSecondsNew();
+		GHTTPPrefetcher->PushResult( Entry);
+	}
+	Worker->Done = 1;
+	return THREAD_END_OK;
+}
+
+UBOOL FHTTPPrefetcher::PopEntry( FPrefetchEntry& Entry)
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=0; i<Entries.Num(); i++)
+		if ( Entries(i).State == PREFETCH_Queued )
+		{
+			Entries(i).State = PREFETCH_Active;
+			Entry = Entries(i);
+			return 1;
+		}
+	return 0;
+}
+
+void FHTTPPrefetcher::PushResult( const FPrefetchEntry& Entry)
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=0; i<Entries.Num(); i++)
+		if ( Entries(i).Guid == Entry.Guid )
+		{
+			Entries(i) = Entry;
+			return;
+		}
+	// Cancelled while in progress.
+	if ( Entry.State == PREFETCH_Done )
+		GFileManager->Delete( *Entry.Filename);
+}
+
+void FHTTPPrefetcher::Log( const TCHAR* Message)
+{
+	CSpinLock SL(&Lock);
+	Messages.AddItem( FString(Message));
+}
+
+//
+// Follows redirects and falls back to lesser compression like the downloader does.
+//
+UBOOL FHTTPPrefetcher::Fetch( FPrefetchEntry& Entry)
+{
+	FString PackageName = Entry.URL.RequestedPackage;
+	FDownloadURL Requested = Entry.URL; //Before redirects
+	FString Key;
+	FValidatorEntry Validator;
+	int32 RedirectsLeft = 5;
+	while ( true )
+	{
+		//Validators of the requested URL stay on through redirects
+		if ( Entry.URL.RequestedPackage.Len() )
+		{
+			Key = Entry.URL.String();
+			Validator = FValidatorEntry();
+			GetHTTPValidatorCache()->Find( Key, Entry.Guid, Validator);
+			FString MovedTo = GetHTTPRedirectMemo()->FindMove( Entry.URL);
+			if ( MovedTo.Len() )
+				Entry.URL.Redirect( *MovedTo);
+		}
+
+		FArchive* Ar = nullptr;
+		FString Location;
+		int32 Status = Request( Entry, Ar, Location, Validator);
+		if ( Ar )
+		{
+			delete Ar;
+			Ar = nullptr;
+		}
+
+		if ( (Status == 304) && Validator.IsValid() )
+		{
+			if ( GetHTTPValidatorCache()->Restore( Validator, *Entry.Filename) )
+			{
+				Entry.Size = Validator.Size;
+				Entry.URL = Requested;
+				Entry.URL.Compression = Validator.Compression;
+				Log( *FString::Printf( TEXT("Prefetched %s: not modified, using local copy (%i bytes)"), *PackageName, Entry.Size) );
+				Unpack( Entry);
+				return 1;
+			}
+			//Local copy is gone, try again without validators
+			GetHTTPValidatorCache()->Remove( Validator.URL);
+			Validator = FValidatorEntry();
+			continue;
+		}
+		if ( Status == 200 )
+		{
+			Entry.URL = Requested;
+			Log( *FString::Printf( TEXT("Prefetched %s%s: %i bytes in %.2fs"), *PackageName, FDownloadURL::GetCompressedExt(Entry.URL.Compression), Entry.Size, appSecondsNew() - Entry.StartTime) );
+			GNetMetrics.DownloadBytes += Entry.Size;
+			GetHTTPRedirectMemo()->Found( Requested);
+			Unpack( Entry);
+			Validator.URL = Key;
+			Validator.Guid = Entry.Guid;
+			Validator.Size = Entry.Size;
+			Validator.Compression = Entry.URL.Compression;
+			GetHTTPValidatorCache()->Store( Validator, *Entry.Filename);
+			return 1;
+		}
+		GFileManager->Delete( *Entry.Filename);
+		Entry.Size = 0;
+
+		if ( (Status == 301 || Status == 302 || Status == 303 || Status == 307 || Status == 308) && Location.Len() && (RedirectsLeft-- > 0) )
+		{
+			FDownloadURL From = Entry.URL;
+			Entry.URL.Redirect( *Location);
+			if ( (Status == 301 || Status == 308) && From.RequestedPackage.Len() ) //First hop only
+				GetHTTPRedirectMemo()->Moved( From, *Entry.URL);
+		}
+		else if ( (Status == 404) && (Requested.Compression > 0) ) //Start over from the requested URL
+		{
+			GetHTTPRedirectMemo()->Missing( Requested);
+			Requested.Compression--;
+			Entry.URL = Requested;
+		}
+		else
+		{
+			Log( *FString::Printf( TEXT("Prefetch of %s failed (%i)"), *PackageName, Status) );
+			return 0;
+		}
+	}
+}
+
+//
+// Unpack now, overlapping the transfers still in flight.
+//
+void FHTTPPrefetcher::Unpack( FPrefetchEntry& Entry)
+{
+	if ( !bDecompress || (Entry.URL.Compression <= 0) )
+		return;
+	FString Dest = Entry.Filename + TEXT(".unpacked");
+	FString Error;
+	double StartTime = appSecondsNew();
+	if ( DecompressDownload( *Entry.Filename, *Dest, Entry.PackageSize, Error) && GFileManager->Move( *Entry.Filename, *Dest, 1) )
+	{
+		Entry.Size = Entry.PackageSize;
+		Entry.URL.Compression = NO_COMPRESSION;
+		Log( *FString::Printf( TEXT("Decompressed %s in %.2fs"), *Entry.URL.RequestedPackage, appSecondsNew() - StartTime) );
+	}
+	else
+	{
+		GFileManager->Delete( *Dest);
+		if ( Error.Len() )
+			Log( *FString::Printf( TEXT("Decompression of %s failed: %s"), *Entry.URL.RequestedPackage, *Error) );
+	}
+}
+
+//
+// Single GET, the body of a 200 response is written to Entry.Filename.
+// Conditional if a validated local copy exists, the validators of a 200 response are returned.
+// Returns the HTTP status, or 0 on network errors.
+//
+int32 FHTTPPrefetcher::Request( FPrefetchEntry& Entry, FArchive*& Ar, FString& Location, FValidatorEntry& Validator)
+{
+	FDownloadURL& URL = Entry.URL;
+	if ( URL.Scheme == TEXT("https") )
+		return CurlEngine ? RequestCurl( Entry, Ar) : 0;
+
+	XC_TRACE_SCOPE("HTTP Prefetch");
+	IPEndpoint Endpoint( CSocket::ResolveHostname( appToAnsi(*URL.StringHost(1))), URL.GetPort());
+	if ( Endpoint.Address == IPAddress::Any )
+		return 0;
+
+	CSocket Socket;
+	UBOOL Reused = GHTTPConnectionPool.Acquire( Endpoint, Socket, KeepAliveTimeout);
+	if ( !Reused )
+	{
+		Socket = CSocket(true);
+		if ( Socket.IsInvalid() )
+			return 0;
+		Socket.SetNonBlocking();
+		ESocketState State = SOCKET_HasError;
+		if ( Socket.Connect(Endpoint) || Socket.IsNonBlocking(Socket.LastError) )
+			State = Socket.CheckState( SOCKET_Writable, Timeout);
+		if ( State == SOCKET_HasError || State == SOCKET_Timeout )
+		{
+			Socket.Close();
+			return 0;
+		}
+	}
+
+	HTTP_Request Request;
+	Request.Hostname = URL.StringHost();
+	Request.Method = TEXT("GET");
+	Request.Path = URL.StringGet();
+	Request.Headers.Set( TEXT("User-Agent"), TEXT("Unreal"));
+	Request.Headers.Set( TEXT("Accept")    , TEXT("*/*"));
+	Request.Headers.Set( TEXT("Connection"), URL.ProxyHostname.Len() ? TEXT("close") : TEXT("keep-alive"));
+	if ( Validator.IsValid() )
+		Validator.SetHeaders( Request);
+	FString RequestHeader = Request.String();
+	int32 Sent = 0;
+	if ( !Socket.Send( (const uint8*)appToAnsi(*RequestHeader), RequestHeader.Len(), Sent) || (Sent < RequestHeader.Len()) )
+	{
+		Socket.Close();
+		return Reused ? this->Request( Entry, Ar, Location, Validator) : 0; //Idle connection was dropped by server
+	}
+
+	HTTP_Response Response;
+	FHTTPParser Parser;
+	int32 ContentLength = -1;
+	UBOOL KeepAlive = 0;
+	UBOOL bClosed = 0;
+	while ( !bClosed )
+	{
+		ESocketState State = Socket.CheckState( SOCKET_Readable, Timeout);
+		if ( State == SOCKET_HasError || State == SOCKET_Timeout )
+			break;
+		uint8* Dest = Parser.GetWriteBuffer();
+		if ( !Dest )
+			break;
+		int32 Bytes = 0;
+		if ( !Socket.Recv( Dest, Parser.WriteSpace(), Bytes) )
+		{
+			if ( Socket.IsNonBlocking(Socket.LastError) )
+				continue;
+			break;
+		}
+		bClosed = (Bytes == 0);
+		Parser.Commit( Bytes);
+
+		//Header stage, wait for EOH
+		if ( Parser.State != HTTPPARSE_Body )
+		{
+			if ( !Parser.ParseHeaders( Response) )
+			{
+				if ( Parser.State == HTTPPARSE_Error )
+					break;
+				continue;
+			}
+
+			FString* LengthHeader = Response.Headers.Find( TEXT("Content-Length"));
+			FString* ConnectionHeader = Response.Headers.Find( TEXT("Connection"));
+			FString* TransferEncoding = Response.Headers.Find( TEXT("Transfer-Encoding"));
+			FString* LocationHeader = Response.Headers.Find( TEXT("Location"));
+			if ( LengthHeader )
+				ContentLength = appAtoi( **LengthHeader);
+			if ( LocationHeader )
+				Location = *LocationHeader;
+			if ( ConnectionHeader )
+				KeepAlive = !appStricmp( **ConnectionHeader, TEXT("keep-alive")) || ((Response.Version == TEXT("HTTP/1.1")) && appStricmp( **ConnectionHeader, TEXT("close")));
+			else
+				KeepAlive = (Response.Version == TEXT("HTTP/1.1"));
+			if ( TransferEncoding && appStricmp( **TransferEncoding, TEXT("identity")) )
+			{
+				Socket.Close();
+				return -1; //Chunked transfers are left to the downloader
+			}
+			if ( Response.Status == 304 ) //Not modified, no body
+			{
+				if ( KeepAlive && !bClosed && !Parser.BodyBytes() )
+					GHTTPConnectionPool.Release( Endpoint, Socket);
+				else
+					Socket.Close();
+				return 304;
+			}
+			if ( (Response.Status != 200) || (ContentLength == 0) )
+			{
+				Socket.Close();
+				return (Response.Status == 200) ? 404 : Response.Status;
+			}
+			Validator.FromResponse( Response);
+			Ar = GFileManager->CreateFileWriter( *Entry.Filename);
+			if ( !Ar )
+			{
+				Socket.Close();
+				return 0;
+			}
+		}
+
+		//Body stage
+		int32 Count = Parser.BodyBytes();
+		if ( (ContentLength >= 0) && (Entry.Size + Count > ContentLength) )
+		{
+			Count = ContentLength - Entry.Size;
+			KeepAlive = 0;
+		}
+		if ( Count > 0 )
+		{
+			Ar->Serialize( Parser.BodyData(), Count);
+			if ( Ar->IsError() )
+				break;
+			Entry.Size += Count;
+		}
+		Parser.ConsumeBody( Parser.BodyBytes());
+		if ( (ContentLength >= 0) && (Entry.Size >= ContentLength) )
+		{
+			if ( KeepAlive && !bClosed )
+				GHTTPConnectionPool.Release( Endpoint, Socket);
+			else
+				Socket.Close();
+			return 200;
+		}
+	}
+
+	Socket.Close();
+	//No Content-Length, server signals the end by closing
+	if ( bClosed && (Response.Status == 200) && (ContentLength < 0) && Entry.Size )
+		return 200;
+	return 0;
+}
+
+//
+// Engine thread, writes the body of an HTTPS prefetch.
+//
+static int32 PrefetchCurlReceive( FCurlTransfer* Transfer, const uint8* Data, int32 Count)
+{
+	FArchive* Ar = (FArchive*)Transfer->Owner;
+	Ar->Serialize( (void*)Data, Count);
+	return !Ar->IsError();
+}
+
+//
+// Single HTTPS GET through the curl engine, which runs the transfers of all workers at once.
+// Sent without validators, the connection is kept by libcurl.
+// Returns the HTTP status, or 0 on network errors.
+//
+int32 FHTTPPrefetcher::RequestCurl( FPrefetchEntry& Entry, FArchive*& Ar)
+{
+	XC_TRACE_SCOPE("HTTPS Prefetch");
+	Ar = GFileManager->CreateFileWriter( *Entry.Filename);
+	if ( !Ar )
+		return 0;
+
+	FCurlTransfer Transfer;
+	Transfer.URL = Entry.URL.String();
+	Transfer.Timeout = Timeout;
+	Transfer.Receive = &PrefetchCurlReceive;
+	Transfer.Owner = Ar;
+	int32 Result = CurlEngine->Perform( Transfer);
+	Entry.Size = Ar->Tell();
+	if ( Result == 22 ) /*CURLE_HTTP_RETURNED_ERROR*/
+		return Transfer.ResponseCode;
+	if ( Result || Ar->IsError() )
+		return 0;
+	if ( (Transfer.ResponseCode == 200) && !Entry.Size )
+		return 404;
+	return Transfer.ResponseCode;
+}
+
+/*-----------------------------------------------------------------------------
+	Game thread.
+-----------------------------------------------------------------------------*/
+
+//
+// Queues every missing package after FromIndex, the engine requests them in map order.
+//
+void FHTTPPrefetcher::Schedule( UNetConnection* InConnection, int32 FromIndex, const TCHAR* Params, UBOOL bCompression)
+{
+	guard(FHTTPPrefetcher::Schedule);
+	if ( InConnection != Connection )
+	{
+		Cancel();
+		Connection = InConnection;
+	}
+
+	UPackageMap* Map = Connection->PackageMap;
+	int32 Added = 0;
+	{
+		CSpinLock SL(&Lock);
+		for ( int32 i=FromIndex+1; i<Map->List.Num(); i++)
+		{
+			FPackageInfo& Info = Map->List(i);
+			if ( !Info.URL.Len() || (Info.PackageFlags & PKG_ClientOptional) )
+				continue;
+			int32 j;
+			for ( j=0; j<Entries.Num() && Entries(j).Guid!=Info.Guid; j++);
+			if ( j < Entries.Num() )
+				continue;
+			TCHAR Filename[256];
+			if ( appFindPackageFile( Info.Parent->GetName(), &Info.Guid, Filename) )
+				continue;
+
+			FPrefetchEntry& Entry = Entries( Entries.AddZeroed());
+			Entry.Guid = Info.Guid;
+			Entry.URL = FDownloadURL( Params, *Info.URL);
+			Entry.URL.Compression = bCompression ? LZMA_COMPRESSION : NO_COMPRESSION;
+			Entry.URL.Compression = GetHTTPRedirectMemo()->PickCompression( Entry.URL);
+			Entry.Filename = FString::Printf( TEXT("../DownloadTemp/%s.prefetch"), *Info.URL);
+			Entry.PackageSize = Info.FileSize;
+			Entry.State = Entry.URL.bIsValid ? PREFETCH_Queued : PREFETCH_Failed;
+			Added++;
+		}
+	}
+
+	if ( Added && !BatchPackages )
+		BatchStart = appSecondsNew();
+
+	if ( Added )
+	{
+		GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
+		StartWorkers();
+	}
+	unguard;
+}
+
+//
+// Called when the engine requests a package.
+// Queued entries are dropped so the downloader fetches them itself.
+//
+int32 FHTTPPrefetcher::Claim( const FGuid& Guid, FString& Filename, int32& Size, int32& Compression)
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=0; i<Entries.Num(); i++)
+		if ( Entries(i).Guid == Guid )
+		{
+			FPrefetchEntry& Entry = Entries(i);
+			int32 State = Entry.State;
+			if ( State == PREFETCH_Active )
+				return PREFETCH_Active;
+			if ( State == PREFETCH_Done )
+			{
+				Filename = Entry.Filename;
+				Size = Entry.Size;
+				Compression = Entry.URL.RequestedPackage.Len() ? Entry.URL.Compression : NO_COMPRESSION;
+				BatchPackages++;
+				BatchBytes += Entry.Size;
+			}
+			Entries.Remove( i);
+			return (State == PREFETCH_Done) ? PREFETCH_Done : PREFETCH_None;
+		}
+	return PREFETCH_None;
+}
+
+void FHTTPPrefetcher::Update()
+{
+	guard(FHTTPPrefetcher::Update);
+	TArray<FString> Logs;
+	UBOOL bIdle;
+	{
+		CSpinLock SL(&Lock);
+		ExchangeArray( Logs, Messages);
+		bIdle = (Entries.Num() == 0);
+	}
+	for ( int32 i=0; i<Logs.Num(); i++)
+		debugf( NAME_DevNet, TEXT("%s"), *Logs(i));
+
+	for ( int32 i=0; i<PREFETCH_MAX_THREADS; i++)
+		if ( Workers[i].Thread && Workers[i].Done )
+		{
+			while ( !Workers[i].Thread->WaitFinish( 0.01f) );
+			delete Workers[i].Thread;
+			Workers[i].Thread = nullptr;
+		}
+
+	if ( bIdle && BatchPackages )
+	{
+		double Seconds = Max( appSecondsNew() - BatchStart, 0.001);
+		debugf( NAME_DevNet, TEXT("Prefetch: %i packages, %i bytes in %.2fs (%.1f KB/s)"), BatchPackages, BatchBytes, Seconds, (double)BatchBytes / (Seconds * 1024.0));
+		BatchPackages = 0;
+		BatchBytes = 0;
+	}
+	unguard;
+}
+
+//
+// Different server, drop what hasn't started.
+// Transfers in progress are kept, the GUID still identifies them.
+//
+void FHTTPPrefetcher::Cancel()
+{
+	CSpinLock SL(&Lock);
+	for ( int32 i=Entries.Num()-1; i>=0; i--)
+		if ( Entries(i).State != PREFETCH_Active )
+		{
+			if ( Entries(i).State == PREFETCH_Done )
+				GFileManager->Delete( *Entries(i).Filename);
+			Entries.Remove( i);
+		}
+	BatchPackages = 0;
+	BatchBytes = 0;
+}
+
+void FHTTPPrefetcher::StartWorkers()
+{
+	for ( int32 i=0; i<Min(MaxThreads,PREFETCH_MAX_THREADS); i++)
+		if ( !Workers[i].Thread )
+		{
+			Workers[i].Done = 0;
+			Workers[i].Thread = new CThread();
+			Workers[i].Thread->Run( &PrefetchThreadEntry, &Workers[i]);
+		}
+}
@@ -0,0 +1,196 @@
+/*=============================================================================
+	RedirectMemo.cpp
+	Author: Fernando Velazquez
+
+	Remembers what each redirect server has shown during the session.
+	Compression variants that keep returning 404 are skipped, with an occasional
+	probe in case they were uploaded later, and permanent redirects are followed before connecting, so later packages
+	reach the right file on the first request.
+	Optionally saved to DownloadTemp so it carries over to the next session.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+#include "Cacus/Atomics.h"
+
+#define REDIRECT_MEMO_MAX 256
+#define REDIRECT_MEMO_MISSES 3   //Consecutive 404s before a variant is skipped
+#define REDIRECT_MEMO_REPROBE 16 //Skipped requests before the variant is tried again
+
+static FHTTPRedirectMemo* GHTTPRedirectMemo = nullptr;
+
+FHTTPRedirectMemo* GetHTTPRedirectMemo()
+{
+	if ( !GHTTPRedirectMemo )
+		GHTTPRedirectMemo = new FHTTPRedirectMemo();
+	return GHTTPRedirectMemo;
+}
+
+FHTTPRedirectMemo::FHTTPRedirectMemo()
+	: bSave(0)
+	, Lock(0)
+	, Loaded(0)
+	, Dirty(0)
+{}
+
+/*-----------------------------------------------------------------------------
+	Any thread.
+-----------------------------------------------------------------------------*/
+
+//
+// Steps down from the requested compression past variants this redirect doesn't have.
+//
+int32 FHTTPRedirectMemo::PickCompression( const FDownloadURL& URL)
+{
+	int32 Compression = Clamp( URL.Compression, 0, LZMA_COMPRESSION);
+	CSpinLock SL(&Lock);
+	Load();
+	FRedirectMemoEntry* Entry = FindEntry( *URL);
+	if ( Entry )
+		for ( ; (Compression > 0) && (Entry->Misses[Compression] >= REDIRECT_MEMO_MISSES); Compression--)
+			if ( ++Entry->Skipped[Compression] >= REDIRECT_MEMO_REPROBE )
+			{
+				Entry->Skipped[Compression] = 0;
+				break;
+			}
+	return Compression;
+}
+
+//
+// Returns the absolute URL a permanent redirect sends this file to, or empty.
+//
+FString FHTTPRedirectMemo::FindMove( const FDownloadURL& URL)
+{
+	CSpinLock SL(&Lock);
+	Load();
+	FRedirectMemoEntry* Entry = FindEntry( URL.String());
+	if ( Entry && Entry->MovedTo.Len() )
+		return Entry->MovedTo;
+	Entry = FindEntry( *URL);
+	if ( Entry && Entry->MovedTo.Len() )
+		return Entry->MovedTo + URL.RequestedPackage + FDownloadURL::GetCompressedExt( URL.Compression);
+	return FString();
+}
+
+void FHTTPRedirectMemo::Found( const FDownloadURL& URL)
+{
+	int32 Compression = Clamp( URL.Compression, 0, LZMA_COMPRESSION);
+	CSpinLock SL(&Lock);
+	FRedirectMemoEntry& Entry = GetEntry( *URL);
+	if ( !(Entry.Found & (1 << Compression)) || Entry.Misses[Compression] )
+	{
+		Entry.Found |= 1 << Compression;
+		Entry.Misses[Compression] = 0;
+		Dirty = 1;
+	}
+}
+
+void FHTTPRedirectMemo::Missing( const FDownloadURL& URL)
+{
+	int32 Compression = Clamp( URL.Compression, 0, LZMA_COMPRESSION);
+	CSpinLock SL(&Lock);
+	FRedirectMemoEntry& Entry = GetEntry( *URL);
+	if ( Entry.Misses[Compression] < 255 )
+	{
+		Entry.Misses[Compression]++;
+		Dirty = 1;
+	}
+}
+
+//
+// A target that keeps the file name moves the whole redirect, otherwise only this file.
+//
+void FHTTPRedirectMemo::Moved( const FDownloadURL& From, const FString& To)
+{
+	FString Suffix = From.RequestedPackage + FDownloadURL::GetCompressedExt( From.Compression);
+	UBOOL bWhole = (To.Len() > Suffix.Len()) && (To.Right( Suffix.Len()) == Suffix);
+	CSpinLock SL(&Lock);
+	FRedirectMemoEntry& Entry = GetEntry( bWhole ? FString(*From) : From.String());
+	Entry.MovedTo = bWhole ? To.LeftChop( Suffix.Len()) : To;
+	Dirty = 1;
+}
+
+/*-----------------------------------------------------------------------------
+	Game thread.
+-----------------------------------------------------------------------------*/
+
+void FHTTPRedirectMemo::Update()
+{
+	if ( Dirty && bSave )
+		Save();
+}
+
+/*-----------------------------------------------------------------------------
+	Memo file.
+	One line per URL: found mask <tab> misses per variant <tab> URL <tab> moved to
+	Callers hold the lock, except Save.
+-----------------------------------------------------------------------------*/
+
+FRedirectMemoEntry* FHTTPRedirectMemo::FindEntry( const FString& URL)
+{
+	for ( int32 i=0; i<Entries.Num(); i++)
+		if ( Entries(i).URL == URL )
+			return &Entries(i);
+	return nullptr;
+}
+
+FRedirectMemoEntry& FHTTPRedirectMemo::GetEntry( const FString& URL)
+{
+	Load();
+	FRedirectMemoEntry* Entry = FindEntry( URL);
+	if ( Entry )
+		return *Entry;
+	if ( Entries.Num() >= REDIRECT_MEMO_MAX )
+		Entries.Remove( 0);
+	Entry = &Entries( Entries.AddZeroed());
+	Entry->URL = URL;
+	return *Entry;
+}
+
+void FHTTPRedirectMemo::Load()
+{
+	if ( Loaded || !bSave )
+		return;
+	Loaded = 1;
+	FString Text;
+	if ( !appLoadFileToString( Text, TEXT("../DownloadTemp/XC_RedirectMemo.txt")) )
+		return;
+
+	TCHAR* Pos = (TCHAR*)*Text;
+	while ( TCHAR* Line = ParseLine( Pos) )
+	{
+		TCHAR* Fields[4];
+		if ( (ParseTabFields( Line, Fields, ARRAY_COUNT(Fields)) == ARRAY_COUNT(Fields)) && *Fields[2] && !FindEntry( Fields[2]) && (Entries.Num() < REDIRECT_MEMO_MAX) )
+		{
+			FRedirectMemoEntry& Entry = Entries( Entries.AddZeroed());
+			Entry.Found = appAtoi( Fields[0]);
+			Entry.URL = Fields[2];
+			Entry.MovedTo = Fields[3];
+
+			// Comma separated, older files had a mask here and start over.
+			TCHAR* Misses = Fields[1];
+			if ( appStrchr( Misses, ',') )
+				for ( int32 i=0; i<=LZMA_COMPRESSION; i++)
+				{
+					Entry.Misses[i] = (uint8)Clamp( appAtoi( Misses), 0, 255);
+					while ( *Misses && (*Misses++ != ',') );
+				}
+		}
+	}
+}
+
+void FHTTPRedirectMemo::Save()
+{
+	FString Text;
+	{
+		CSpinLock SL(&Lock);
+		for ( int32 i=0; i<Entries.Num(); i++)
+		{
+			FRedirectMemoEntry& Entry = Entries(i);
+			Text += FString::Printf( TEXT("%i\t%i,%i,%i\t%s\t%s\r\n"), Entry.Found, Entry.Misses[0], Entry.Misses[1], Entry.Misses[2], *Entry.URL, *Entry.MovedTo);
+		}
+		Dirty = 0;
+	}
+	GFileManager->MakeDirectory( TEXT("../DownloadTemp"), 0);
+	appSaveStringToFile( Text, TEXT("../DownloadTemp/XC_RedirectMemo.txt"));
+}
@@ -0,0 +1,103 @@
+/*=============================================================================
+	ThreadEvent.cpp
+	Author: Fernando Velazquez
+
+	Auto-reset event.
+	Windows uses a kernel event, other platforms a condition variable
+	on the monotonic clock.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <time.h>
+	#include <errno.h>
+#endif
+
+#ifdef _WIN32
+
+FThreadEvent::FThreadEvent()
+	: Handle( CreateEventA( nullptr, FALSE, FALSE, nullptr) )
+{}
+
+FThreadEvent::~FThreadEvent()
+{
+	CloseHandle( (HANDLE)Handle);
+}
+
+void FThreadEvent::Signal()
+{
+	SetEvent( (HANDLE)Handle);
+}
+
+UBOOL FThreadEvent::Wait( double Seconds)
+{
+	DWORD Milliseconds = (Seconds < 0) ? INFINITE : (DWORD)appCeil( Seconds * 1000.0);
+	return WaitForSingleObject( (HANDLE)Handle, Milliseconds) == WAIT_OBJECT_0;
+}
+
+#else
+
+struct FPosixEvent
+{
+	pthread_mutex_t Mutex;
+	pthread_cond_t Cond;
+	int32 Signaled;
+};
+
+FThreadEvent::FThreadEvent()
+{
+	FPosixEvent* Event = new FPosixEvent;
+	pthread_condattr_t Attr;
+	pthread_condattr_init( &Attr);
+	pthread_condattr_setclock( &Attr, CLOCK_MONOTONIC);
+	pthread_mutex_init( &Event->Mutex, nullptr);
+	pthread_cond_init( &Event->Cond, &Attr);
+	pthread_condattr_destroy( &Attr);
+	Event->Signaled = 0;
+	Handle = Event;
+}
+
+FThreadEvent::~FThreadEvent()
+{
+	FPosixEvent* Event = (FPosixEvent*)Handle;
+	pthread_cond_destroy( &Event->Cond);
+	pthread_mutex_destroy( &Event->Mutex);
+	delete Event;
+}
+
+void FThreadEvent::Signal()
+{
+	FPosixEvent* Event = (FPosixEvent*)Handle;
+	pthread_mutex_lock( &Event->Mutex);
+	Event->Signaled = 1;
+	pthread_cond_signal( &Event->Cond);
+	pthread_mutex_unlock( &Event->Mutex);
+}
+
+UBOOL FThreadEvent::Wait( double Seconds)
+{
+	FPosixEvent* Event = (FPosixEvent*)Handle;
+	timespec Deadline;
+	if ( Seconds >= 0 )
+	{
+		clock_gettime( CLOCK_MONOTONIC, &Deadline);
+		uint64 Nanoseconds = (uint64)Deadline.tv_nsec + (uint64)(Seconds * 1000000000.0);
+		Deadline.tv_sec += (time_t)(Nanoseconds / 1000000000);
+		Deadline.tv_nsec = (long)(Nanoseconds % 1000000000);
+	}
+
+	pthread_mutex_lock( &Event->Mutex);
+	int32 Result = 0;
+	while ( !Event->Signaled && (Result != ETIMEDOUT) )
+		Result = (Seconds < 0) ? pthread_cond_wait( &Event->Cond, &Event->Mutex) : pthread_cond_timedwait( &Event->Cond, &Event->Mutex, &Deadline);
+	UBOOL Signaled = Event->Signaled;
+	Event->Signaled = 0;
+	pthread_mutex_unlock( &Event->Mutex);
+	return Signaled;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*=============================================================================
+	Trace.cpp
+	Author: Fernando Velazquez
+
+	Timeline tracing with Chrome trace (chrome://tracing, Perfetto) export.
+	Each thread records into its own ring buffer without locking, buffers
+	of finished threads are handed to new ones.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "Cacus/Atomics.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+	#include <unistd.h>
+	#include <sys/syscall.h>
+#endif
+
+volatile int32 GTraceEnabled = 0;
+
+struct FTraceEvent
+{
+	const char* Name;
+	uint64 Start;
+	uint32 Duration; //Nanoseconds
+	uint32 ThreadId;
+};
+
+struct FTraceBuffer
+{
+	FTraceBuffer* Next;
+	volatile int32 InUse;
+	volatile uint32 Count; //Only written by owner thread
+	FTraceEvent Events[TRACE_BUFFER_EVENTS];
+};
+
+static FTraceBuffer* TraceBuffers = nullptr;
+static volatile int32 TraceBufferLock = 0;
+
+/*-----------------------------------------------------------------------------
+	Per thread state.
+-----------------------------------------------------------------------------*/
+
+struct FThreadTrace
+{
+	FTraceBuffer* Buffer;
+	uint32 ThreadId;
+
+	FThreadTrace()
+		: Buffer(nullptr)
+		, ThreadId(0)
+	{}
+
+	// Thread exits, buffer goes back to the pool with its events.
+	~FThreadTrace()
+	{
+		if ( Buffer )
+			Buffer->InUse = 0;
+	}
+
+	FTraceBuffer* Acquire()
+	{
+	#ifdef _WIN32
+		ThreadId = (uint32)GetCurrentThreadId();
+	#else
+		ThreadId = (uint32)syscall( SYS_gettid);
+	#endif
+		CSpinLock SL(&TraceBufferLock);
+		for ( FTraceBuffer* It=TraceBuffers; It; It=It->Next )
+			if ( !It->InUse )
+			{
+				It->InUse = 1;
+				return Buffer = It;
+			}
+		Buffer = (FTraceBuffer*)appMalloc( sizeof(FTraceBuffer), TEXT("FTraceBuffer"));
+		appMemzero( Buffer, sizeof(FTraceBuffer));
+		Buffer->InUse = 1;
+		Buffer->Next = TraceBuffers;
+		TraceBuffers = Buffer;
+		return Buffer;
+	}
+};
+
+static thread_local FThreadTrace ThreadTrace;
+
+uint64 TraceNow()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER Frequency = {};
+	if ( !Frequency.QuadPart )
+		QueryPerformanceFrequency( &Frequency);
+	LARGE_INTEGER Counter;
+	QueryPerformanceCounter( &Counter);
+	return (uint64)((double)Counter.QuadPart * 1000000000.0 / (double)Frequency.QuadPart);
+#else
+	timespec Now;
+	clock_gettime( CLOCK_MONOTONIC, &Now);
+	return (uint64)Now.tv_sec * 1000000000ull + (uint64)Now.tv_nsec;
+#endif
+}
+
+void TraceRecord( const char* Name, uint64 Start, uint64 End)
+{
+	FTraceBuffer* Buffer = ThreadTrace.Buffer ? ThreadTrace.Buffer : ThreadTrace.Acquire();
+	uint32 Index = Buffer->Count;
+	FTraceEvent& Event = Buffer->Events[Index % TRACE_BUFFER_EVENTS];
+	Event.Name     = Name;
+	Event.Start    = Start;
+	Event.Duration = (uint32)Min<uint64>( End - Start, MAXDWORD);
+	Event.ThreadId = ThreadTrace.ThreadId;
+	Buffer->Count  = Index + 1;
+}
+
+/*-----------------------------------------------------------------------------
+	Chrome trace export.
+-----------------------------------------------------------------------------*/
+
+static int32 ExportTrace( const TCHAR* Filename)
+{
+	FArchive* Ar = GFileManager->CreateFileWriter( Filename);
+	if ( !Ar )
+		return -1;
+
+	char Line[256];
+	int32 Len = snprintf( Line, sizeof(Line), "{\"traceEvents\":[\n");
+	Ar->Serialize( Line, Len);
+
+	// Find time base.
+	uint64 Base = ~0ull;
+	CSpinLock SL(&TraceBufferLock);
+	for ( FTraceBuffer* It=TraceBuffers; It; It=It->Next )
+	{
+		uint32 Count = It->Count;
+		for ( uint32 i=(Count > TRACE_BUFFER_EVENTS) ? Count - TRACE_BUFFER_EVENTS : 0; i<Count; i++)
+			Base = Min( Base, It->Events[i % TRACE_BUFFER_EVENTS].Start);
+	}
+
+	int32 Exported = 0;
+	for ( FTraceBuffer* It=TraceBuffers; It; It=It->Next )
+	{
+		uint32 Count = It->Count;
+		for ( uint32 i=(Count > TRACE_BUFFER_EVENTS) ? Count - TRACE_BUFFER_EVENTS : 0; i<Count; i++)
+		{
+			FTraceEvent& Event = It->Events[i % TRACE_BUFFER_EVENTS];
+			Len = snprintf( Line, sizeof(Line), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}"
+				, Exported ? ",\n" : ""
+				, Event.Name
+				, Event.ThreadId
+				, (double)(Event.Start - Base) / 1000.0
+				, (double)Event.Duration / 1000.0 );
+			Ar->Serialize( Line, Min<int32>( Len, sizeof(Line) - 1));
+			Exported++;
+		}
+	}
+
+	Len = snprintf( Line, sizeof(Line), "\n]}\n");
+	Ar->Serialize( Line, Len);
+	delete Ar;
+	return Exported;
+}
+
+//
+// NETTRACE START|STOP|CLEAR
+// NETTRACE DUMP [FILE=Filename]
+//
+UBOOL ExecTrace( const TCHAR* Cmd, FOutputDevice& Ar)
+{
+	if ( ParseCommand( &Cmd, TEXT("START")) )
+	{
+		GTraceEnabled = 1;
+		Ar.Logf( TEXT("Net tracing enabled"));
+	}
+	else if ( ParseCommand( &Cmd, TEXT("STOP")) )
+	{
+		GTraceEnabled = 0;
+		Ar.Logf( TEXT("Net tracing disabled"));
+	}
+	else if ( ParseCommand( &Cmd, TEXT("CLEAR")) )
+	{
+		// Owners may still be writing, only reset buffers while disabled.
+		if ( GTraceEnabled )
+			Ar.Logf( TEXT("Stop tracing before clearing buffers"));
+		else
+		{
+			CSpinLock SL(&TraceBufferLock);
+			for ( FTraceBuffer* It=TraceBuffers; It; It=It->Next )
+				It->Count = 0;
+			Ar.Logf( TEXT("Net trace buffers cleared"));
+		}
+	}
+	else if ( ParseCommand( &Cmd, TEXT("DUMP")) )
+	{
+		FString Filename = TEXT("../Logs/XC_NetTrace.json");
+		Parse( Cmd, TEXT("FILE="), Filename);
+		int32 Events = ExportTrace( *Filename);
+		if ( Events < 0 )
+			Ar.Logf( TEXT("Unable to write trace to %s"), *Filename);
+		else
+			Ar.Logf( TEXT("%i trace events written to %s"), Events, *Filename);
+	}
+	else
+		Ar.Logf( TEXT("Net tracing is %s, usage: NETTRACE START|STOP|CLEAR|DUMP [FILE=]"), GTraceEnabled ? TEXT("enabled") : TEXT("disabled"));
+	return 1;
+}
@@ -0,0 +1,285 @@
+/*=============================================================================
+	ValidatorCache.cpp
+	Author: Fernando Velazquez
+
+	Conditional requests for the HTTP downloader.
+	Every finished download that came with an ETag or Last-Modified header
+	is hardlinked here and indexed by URL, the next request for that URL and
+	package GUID carries If-None-Match/If-Modified-Since and a 304 response
+	is satisfied from the copy, costing a single round trip.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+#include "HTTPDownload.h"
+#include "Cacus/Atomics.h"
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+#endif
+
+static FHTTPValidatorCache* GHTTPValidatorCache = nullptr;
+
+FHTTPValidatorCache* GetHTTPValidatorCache()
+{
+	if ( !GHTTPValidatorCache )
+		GHTTPValidatorCache = new FHTTPValidatorCache();
+	return GHTTPValidatorCache;
+}
+
+void FValidatorEntry::SetHeaders( HTTP_Request& Request) const
+{
+	if ( ETag.Len() )
+		Request.Headers.Set( TEXT("If-None-Match"), *ETag);
+	if ( LastModified.Len() )
+		Request.Headers.Set( TEXT("If-Modified-Since"), *LastModified);
+}
+
+void FValidatorEntry::FromResponse( HTTP_Response& Response)
+{
+	FString* ETagHeader = Response.Headers.Find( TEXT("ETag"));
+	FString* LastModifiedHeader = Response.Headers.Find( TEXT("Last-Modified"));
+	ETag = ETagHeader ? *ETagHeader : FString();
+	LastModified = LastModifiedHeader ? *LastModifiedHeader : FString();
+}
+
+//
+// Second name for the same file, costs no disk writes.
+// Fails across volumes or on file systems without hardlinks.
+//
+static UBOOL LinkFile( const TCHAR* Dest, const TCHAR* Source)
+{
+	GFileManager->Delete( Dest);
+#ifdef _WIN32
+	return CreateHardLinkW( Dest, Source, nullptr) != 0;
+#else
+	ANSICHAR AnsiSource[1024], AnsiDest[1024];
+	appToAnsiInPlace( AnsiSource, Source, ARRAY_COUNT(AnsiSource));
+	appToAnsiInPlace( AnsiDest, Dest, ARRAY_COUNT(AnsiDest));
+	return link( AnsiSource, AnsiDest) == 0;
+#endif
+}
+
+FHTTPValidatorCache::FHTTPValidatorCache()
+	: Directory(TEXT("../DownloadTemp/Validated"))
+	, MaxSizeMB(0)
+	, Lock(0)
+	, Loaded(0)
+	, Dirty(0)
+{}
+
+/*-----------------------------------------------------------------------------
+	Any thread.
+-----------------------------------------------------------------------------*/
+
+//
+// Entry is only returned if it was made for this GUID and the copy is intact.
+//
+UBOOL FHTTPValidatorCache::Find( const FString& URL, const FGuid& Guid, FValidatorEntry& Out)
+{
+	if ( !MaxSizeMB )
+		return 0;
+	CSpinLock SL(&Lock);
+	LoadIndex();
+	int32 i = FindIndex( URL);
+	if ( (i == INDEX_NONE) || (Index(i).Guid != Guid) )
+		return 0;
+	if ( GFileManager->FileSize( *CopyFilename( Index(i))) != Index(i).Size )
+	{
+		RemoveIndex( i);
+		return 0;
+	}
+	Out = Index(i);
+	return 1;
+}
+
+//
+// Server answered 304, link the file back into DownloadTemp (copy if that fails).
+//
+UBOOL FHTTPValidatorCache::Restore( const FValidatorEntry& Entry, const TCHAR* Dest)
+{
+	XC_TRACE_SCOPE("HTTP Restore validated");
+	FString Source = CopyFilename( Entry);
+	if ( (!LinkFile( Dest, *Source) && (GFileManager->Copy( Dest, *Source) != COPY_OK)) || (GFileManager->FileSize( Dest) != Entry.Size) )
+	{
+		GFileManager->Delete( Dest);
+		return 0;
+	}
+
+	// Most recently used goes last.
+	CSpinLock SL(&Lock);
+	int32 i = FindIndex( Entry.URL);
+	if ( i != INDEX_NONE )
+	{
+		FValidatorEntry Used = Index(i);
+		Index.Remove( i);
+		Index.AddItem( Used);
+		Dirty = 1;
+	}
+	return 1;
+}
+
+//
+// Links a finished download, the link is made under a temporary name first.
+// Nothing is stored if the file can't be linked, a full copy would double
+// the disk writes of every download.
+//
+void FHTTPValidatorCache::Store( const FValidatorEntry& Entry, const TCHAR* Source)
+{
+	if ( !MaxSizeMB || !Entry.IsValid() || (Entry.Size <= 0) )
+		return;
+	if ( (SQWORD)Entry.Size > (SQWORD)MaxSizeMB * 1024 * 1024 )
+		return;
+
+	XC_TRACE_SCOPE("HTTP Store validated");
+	FString Dest = CopyFilename( Entry);
+	FString Temp = Dest + TEXT(".tmp");
+	GFileManager->MakeDirectory( *Directory, 1);
+	if ( !LinkFile( *Temp, Source) || (GFileManager->FileSize( *Temp) != Entry.Size) || !GFileManager->Move( *Dest, *Temp, 1) )
+	{
+		GFileManager->Delete( *Temp);
+		return;
+	}
+
+	CSpinLock SL(&Lock);
+	LoadIndex();
+	int32 i = FindIndex( Entry.URL);
+	if ( (i != INDEX_NONE) && (CopyFilename( Index(i)) != Dest) )
+		RemoveIndex( i);
+	else if ( i != INDEX_NONE )
+		Index.Remove( i); //Same copy, just replaced
+	Index.AddItem( Entry);
+	Trim();
+	Dirty = 1;
+}
+
+//
+// Copy is missing or the server rejected the validators.
+//
+void FHTTPValidatorCache::Remove( const FString& URL)
+{
+	CSpinLock SL(&Lock);
+	int32 i = FindIndex( URL);
+	if ( i != INDEX_NONE )
+		RemoveIndex( i);
+}
+
+/*-----------------------------------------------------------------------------
+	Game thread.
+-----------------------------------------------------------------------------*/
+
+//
+// Index is written here so workers never wait on it.
+//
+void FHTTPValidatorCache::Update()
+{
+	if ( Dirty )
+		SaveIndex();
+}
+
+/*-----------------------------------------------------------------------------
+	Index.
+	One line per URL: GUID <tab> size <tab> compression <tab> ETag <tab> Last-Modified <tab> URL
+	Callers hold the lock.
+-----------------------------------------------------------------------------*/
+
+FString FHTTPValidatorCache::IndexFilename() const
+{
+	return Directory * TEXT("XC_HTTPValidators.txt");
+}
+
+//
+// Copies are named after the package GUID, URLs on different redirects share them.
+//
+FString FHTTPValidatorCache::CopyFilename( const FValidatorEntry& Entry) const
+{
+	return (Directory * Entry.Guid.String()) + FDownloadURL::GetCompressedExt( Entry.Compression);
+}
+
+int32 FHTTPValidatorCache::FindIndex( const FString& URL) const
+{
+	for ( int32 i=0; i<Index.Num(); i++)
+		if ( Index(i).URL == URL )
+			return i;
+	return INDEX_NONE;
+}
+
+void FHTTPValidatorCache::RemoveIndex( int32 i)
+{
+	FString Filename = CopyFilename( Index(i));
+	Index.Remove( i);
+	Dirty = 1;
+	for ( int32 j=0; j<Index.Num(); j++)
+		if ( CopyFilename( Index(j)) == Filename )
+			return;
+	GFileManager->Delete( *Filename);
+}
+
+void FHTTPValidatorCache::LoadIndex()
+{
+	if ( Loaded )
+		return;
+	Loaded = 1;
+	FString Text;
+	if ( !appLoadFileToString( Text, *IndexFilename()) )
+		return;
+
+	TCHAR* Pos = (TCHAR*)*Text;
+	while ( TCHAR* Line = ParseLine( Pos) )
+	{
+		TCHAR* Fields[6];
+		FValidatorEntry Entry;
+		if ( (ParseTabFields( Line, Fields, ARRAY_COUNT(Fields)) == ARRAY_COUNT(Fields)) && (appStrlen( Fields[0]) == 32) && ParseGuid( Fields[0], Entry.Guid) )
+		{
+			Entry.Size = appAtoi( Fields[1]);
+			Entry.Compression = appAtoi( Fields[2]);
+			Entry.ETag = Fields[3];
+			Entry.LastModified = Fields[4];
+			Entry.URL = Fields[5];
+			if ( Entry.IsValid() && (Entry.Size > 0) )
+				Index.AddItem( Entry);
+		}
+	}
+}
+
+void FHTTPValidatorCache::SaveIndex()
+{
+	FString Text;
+	{
+		CSpinLock SL(&Lock);
+		for ( int32 i=0; i<Index.Num(); i++)
+		{
+			FValidatorEntry& Entry = Index(i);
+			Text += FString::Printf( TEXT("%s\t%i\t%i\t%s\t%s\t%s\r\n"), *Entry.Guid.String(), Entry.Size, Entry.Compression, *Entry.ETag, *Entry.LastModified, *Entry.URL);
+		}
+		Dirty = 0;
+	}
+	GFileManager->MakeDirectory( *Directory, 1);
+	appSaveStringToFile( Text, *IndexFilename());
+}
+
+//
+// Drops least recently used entries until the copies fit in MaxSizeMB.
+//
+void FHTTPValidatorCache::Trim()
+{
+	SQWORD MaxSize = (SQWORD)MaxSizeMB * 1024 * 1024;
+	while ( Index.Num() )
+	{
+		SQWORD Total = 0;
+		TArray<FString> Counted;
+		for ( int32 i=0; i<Index.Num(); i++)
+		{
+			FString Filename = CopyFilename( Index(i));
+			if ( Counted.FindItemIndex( Filename) == INDEX_NONE )
+			{
+				Counted.AddItem( Filename);
+				Total += Index(i).Size;
+			}
+		}
+		if ( Total <= MaxSize )
+			break;
+		RemoveIndex( 0);
+	}
+}
@@ -6,6 +6,26 @@
 #include "XC_IpDrv.h"
 #include "Cacus/DebugCallback.h"
 #include "Cacus/CacusString.h"
+#include "Cacus/Atomics.h"
+
+#ifdef _WIN32
+	#include <ws2tcpip.h>
+	#include <iphlpapi.h>
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <netdb.h>
+	#include <poll.h>
+#endif
+
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <linux/netlink.h>
+	#include <linux/rtnetlink.h>
+#endif
 
 /*-----------------------------------------------------------------------------
 	Declarations.
@@ -57,21 +77,21 @@ TArray<IPAddress> GetLocalBindAddress( FOutputDevice& Out)
 
 //Should export as C
 static uint32 First = 0;
-TArray<IPAddress> GetLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll)
+static TArray<IPAddress> ResolveLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll)
 {
-	guard(GetLocalHostAddress);
+	guard(ResolveLocalHostAddress);
 
 	TArray<IPAddress> Addresses;
 
 	const TCHAR* MultiHome = appStrfind( appCmdLine(), TEXT("MULTIHOME="));
 	if ( MultiHome )
 	{
-		FMemMark Mark(GMem);
-
+		// Not GMem, this may run on any thread.
 		const TCHAR* MultiHomeEnd = (MultiHome += _len("MULTIHOME="));
 		AdvanceTo( MultiHomeEnd, TEXT("\" \r\n"));
 		size_t MultiHomeSize = 1 + MultiHomeEnd - MultiHome;
-		TCHAR* Start = new(GMem,MultiHomeSize) TCHAR;
+		TArray<TCHAR> Buffer( (INT)MultiHomeSize);
+		TCHAR* Start = &Buffer(0);
 		CStrcpy_s( Start, MultiHomeSize, MultiHome);
 
 		while ( true )
@@ -97,7 +117,6 @@ TArray<IPAddress> GetLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll)
 				break;
 			Start = (TCHAR*)End + 1;
 		}
-		Mark.Pop();
 
 		if ( Addresses.Num() )
 		{
@@ -130,6 +149,423 @@ TArray<IPAddress> GetLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll)
 	unguard;
 }
 
+/*----------------------------------------------------------------------------
+	Local address registry.
+	Local addresses are resolved once, then a watcher thread waits for the
+	system to report an address change (rtnetlink on Linux, NotifyAddrChange
+	on Windows) and resolves them again. The serial only changes if the
+	resolved set differs. Game thread callers never resolve after startup.
+----------------------------------------------------------------------------*/
+
+static volatile int32 LocalAddressLock = 0;
+static TArray<IPAddress> CachedAddresses;
+static UBOOL CachedCanBindAll = 0;
+static uint32 CachedAvailable = 0; //Bit per address that can be bound to
+static UBOOL CacheValid = 0;
+static uint32 LocalAddressSerial = 0;
+static CThread* AddressThread = nullptr;
+static volatile int32 AddressThreadExit = 0;
+
+#ifdef __linux__
+static int32 NetlinkSocket = -1;
+
+static void OpenAddressWatch()
+{
+	if ( NetlinkSocket >= 0 )
+		return;
+	int32 Fd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if ( Fd < 0 )
+		return;
+	sockaddr_nl Addr;
+	appMemzero( &Addr, sizeof(Addr));
+	Addr.nl_family = AF_NETLINK;
+	Addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if ( (fcntl( Fd, F_SETFL, O_NONBLOCK) < 0) || (bind( Fd, (sockaddr*)&Addr, sizeof(Addr)) < 0) )
+	{
+		close( Fd);
+		return;
+	}
+	NetlinkSocket = Fd;
+}
+
+static void CloseAddressWatch()
+{
+	if ( NetlinkSocket >= 0 )
+	{
+		close( NetlinkSocket);
+		NetlinkSocket = -1;
+	}
+}
+
+// Drains pending rtnetlink messages, returns true if an address was added or removed.
+static bool AddressesChanged()
+{
+	bool bChanged = false;
+	uint8 Buffer[4096];
+	while ( true )
+	{
+		int32 Len = (int32)recv( NetlinkSocket, Buffer, sizeof(Buffer), MSG_DONTWAIT);
+		if ( Len < 0 )
+		{
+			if ( errno == ENOBUFS ) //Missed messages
+			{
+				bChanged = true;
+				continue;
+			}
+			break;
+		}
+		for ( nlmsghdr* Msg=(nlmsghdr*)Buffer; NLMSG_OK(Msg,Len); Msg=NLMSG_NEXT(Msg,Len) )
+			if ( (Msg->nlmsg_type == RTM_NEWADDR) || (Msg->nlmsg_type == RTM_DELADDR) )
+				bChanged = true;
+	}
+	return bChanged;
+}
+
+// Watcher thread, waits up to a second so it can notice shutdown.
+static bool WaitAddressChange()
+{
+	if ( NetlinkSocket < 0 )
+	{
+		appSleep( 1.f);
+		return false;
+	}
+	pollfd Fd;
+	Fd.fd = NetlinkSocket;
+	Fd.events = POLLIN;
+	Fd.revents = 0;
+	return (poll( &Fd, 1, 1000) > 0) && AddressesChanged();
+}
+#elif defined(_WIN32)
+static HANDLE AddressEvent = nullptr;
+static OVERLAPPED AddressOverlap;
+static HANDLE AddressHandle = nullptr;
+static double CacheTime = 0;
+
+static void ArmAddressWatch()
+{
+	appMemzero( &AddressOverlap, sizeof(AddressOverlap));
+	AddressOverlap.hEvent = AddressEvent;
+	if ( NotifyAddrChange( &AddressHandle, &AddressOverlap) != ERROR_IO_PENDING )
+	{
+		CloseHandle( AddressEvent);
+		AddressEvent = nullptr;
+	}
+}
+
+static void OpenAddressWatch()
+{
+	CacheTime = appSecondsNew();
+	if ( AddressEvent )
+		return;
+	AddressEvent = CreateEventA( nullptr, TRUE, FALSE, nullptr);
+	if ( AddressEvent )
+		ArmAddressWatch();
+}
+
+static void CloseAddressWatch()
+{
+	if ( AddressEvent )
+	{
+		CancelIPChangeNotify( &AddressOverlap);
+		CloseHandle( AddressEvent);
+		AddressEvent = nullptr;
+	}
+}
+
+// Watcher thread, waits up to a second so it can notice shutdown.
+// Refreshes every now and then if notifications couldn't be set up.
+static bool WaitAddressChange()
+{
+	if ( !AddressEvent )
+	{
+		appSleep( 1.f);
+		if ( appSecondsNew() - CacheTime < 30.0 )
+			return false;
+		CacheTime = appSecondsNew();
+		return true;
+	}
+	if ( WaitForSingleObject( AddressEvent, 1000) != WAIT_OBJECT_0 )
+		return false;
+	ResetEvent( AddressEvent);
+	ArmAddressWatch();
+	return true;
+}
+#else
+static double CacheTime = 0;
+
+static void OpenAddressWatch()
+{
+	CacheTime = appSecondsNew();
+}
+
+static void CloseAddressWatch()
+{
+}
+
+// No change notifications here, refresh every now and then.
+static bool WaitAddressChange()
+{
+	appSleep( 1.f);
+	if ( appSecondsNew() - CacheTime < 30.0 )
+		return false;
+	CacheTime = appSecondsNew();
+	return true;
+}
+#endif
+
+//
+// Whether an address can still be bound to, false once it's gone from every interface.
+//
+UBOOL IsLocalAddress( const IPAddress& Address)
+{
+	if ( (Address == IPAddress::Any) || (Address == IPAddress(0,0,0,0)) )
+		return 1;
+	addrinfo Hints;
+	appMemzero( &Hints, sizeof(Hints));
+	Hints.ai_family = AF_UNSPEC;
+	Hints.ai_socktype = SOCK_DGRAM;
+	Hints.ai_flags = AI_NUMERICHOST;
+	addrinfo* Result = nullptr;
+	if ( getaddrinfo( *Address, nullptr, &Hints, &Result) != 0 )
+		return 1; //Can't tell
+	UBOOL bBound = 1;
+#ifdef _WIN32
+	SOCKET Fd = socket( Result->ai_family, SOCK_DGRAM, 0);
+	if ( Fd != INVALID_SOCKET )
+	{
+		bBound = bind( Fd, Result->ai_addr, (int)Result->ai_addrlen) == 0;
+		closesocket( Fd);
+	}
+#else
+	int32 Fd = socket( Result->ai_family, SOCK_DGRAM, 0);
+	if ( Fd >= 0 )
+	{
+		bBound = bind( Fd, Result->ai_addr, Result->ai_addrlen) == 0;
+		close( Fd);
+	}
+#endif
+	freeaddrinfo( Result);
+	return bBound;
+}
+
+//
+// MULTIHOME addresses given as numbers resolve the same after they're removed,
+// whether they can still be bound to is part of what's compared.
+//
+static void StoreAddresses( const TArray<IPAddress>& Addresses, UBOOL bCanBindAll)
+{
+	uint32 Available = 0;
+	for ( int32 i=0; i<Addresses.Num() && i<32; i++)
+		if ( IsLocalAddress( Addresses(i)) )
+			Available |= 1 << i;
+
+	CSpinLock SL(&LocalAddressLock);
+	if ( !CacheValid || (Addresses.Num() != CachedAddresses.Num()) || (bCanBindAll != CachedCanBindAll) || (Available != CachedAvailable)
+		|| (Addresses.Num() && appMemcmp( &Addresses(0), &CachedAddresses(0), Addresses.Num() * sizeof(IPAddress))) )
+		LocalAddressSerial++;
+	CachedAddresses = Addresses;
+	CachedCanBindAll = bCanBindAll;
+	CachedAvailable = Available;
+	CacheValid = 1;
+}
+
+// Name resolution may block, this is the only thread that does it after startup.
+static unsigned long AddressThreadEntry( void* Arg, CThread* Handler)
+{
+	XC_TRACE_SCOPE("Local address watch");
+	while ( !FPlatformAtomics::AtomicRead( &AddressThreadExit) )
+	{
+		if ( !WaitAddressChange() )
+			continue;
+		try
+		{
+			UBOOL bCanBindAll = 0;
+			TArray<IPAddress> Addresses = ResolveLocalHostAddress( *GNull, bCanBindAll);
+			StoreAddresses( Addresses, bCanBindAll);
+			GNetMetrics.ResolverCacheMisses++;
+		}
+		catch ( ... )
+		{
+		}
+	}
+	return THREAD_END_OK;
+}
+
+//
+// Stops the watcher and closes its handles when the module is unloaded.
+//
+static struct FLocalAddressExit
+{
+	~FLocalAddressExit()
+	{
+		if ( AddressThread )
+		{
+			FPlatformAtomics::InterlockedExchange( &AddressThreadExit, 1);
+			if ( AddressThread->WaitFinish( 2.f) )
+				CloseAddressWatch();
+			else
+				AddressThread->Detach(); //Leave its handles alone
+		}
+		else
+			CloseAddressWatch();
+	}
+} GLocalAddressExit;
+
+TArray<IPAddress> GetLocalHostAddress( FOutputDevice& Out, UBOOL& bCanBindAll)
+{
+	guard(GetLocalHostAddress);
+	{
+		CSpinLock SL(&LocalAddressLock);
+		if ( CacheValid )
+		{
+			GNetMetrics.ResolverCacheHits++;
+			bCanBindAll = CachedCanBindAll;
+			return CachedAddresses;
+		}
+	}
+
+	// First call resolves here, then the watcher takes over.
+	// Watch is opened first so no change between both is missed.
+	GNetMetrics.ResolverCacheMisses++;
+	OpenAddressWatch();
+	TArray<IPAddress> Addresses = ResolveLocalHostAddress( Out, bCanBindAll);
+	StoreAddresses( Addresses, bCanBindAll);
+	{
+		CSpinLock SL(&LocalAddressLock);
+		if ( !AddressThread )
+		{
+			AddressThread = new CThread();
+			AddressThread->Run( &AddressThreadEntry, nullptr);
+		}
+	}
+	return Addresses;
+	unguard;
+}
+
+//
+// Changes when the watcher finds a different set of local addresses.
+//
+uint32 GetLocalAddressSerial()
+{
+	CSpinLock SL(&LocalAddressLock);
+	return LocalAddressSerial;
+}
+
+/*----------------------------------------------------------------------------
+	Dual stack sockets.
+	A single IPv6 socket bound to :: receives IPv4 traffic as well, those
+	peers show up as IPv4-mapped addresses (::ffff:a.b.c.d).
+----------------------------------------------------------------------------*/
+
+UBOOL SetDualStack( CSocket& Socket)
+{
+	int32 V6Only = 0;
+	return setsockopt( Socket.Socket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&V6Only, sizeof(V6Only)) == 0;
+}
+
+// ::ffff:0:0/96
+static const uint8 MappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+// IPv4 or IPv4-mapped.
+UBOOL IsIPv4Address( const IPAddress& Address)
+{
+	const uint8* B = Address.Bytes;
+	return !appMemcmp( B, MappedPrefix, sizeof(MappedPrefix)) || (Address == IPAddress( B[12], B[13], B[14], B[15]));
+}
+
+// Dual stack sockets see IPv4 peers as ::ffff:a.b.c.d, keep them in IPv4 form
+// so they hash and compare like the ones received by IPv4 sockets or XDP.
+void NormalizeEndpoint( IPEndpoint& Endpoint)
+{
+	const uint8* B = Endpoint.Address.Bytes;
+	if ( !appMemcmp( B, MappedPrefix, sizeof(MappedPrefix)) )
+		Endpoint.Address = IPAddress( B[12], B[13], B[14], B[15]);
+}
+
+// Whether the socket can send to this family, dual stack sockets take both.
+UBOOL SocketReaches( CSocket& Socket, UBOOL bIPv4)
+{
+	sockaddr_storage Local;
+	socklen_t LocalSize = sizeof(Local);
+	if ( getsockname( Socket.Socket, (sockaddr*)&Local, &LocalSize) != 0 )
+		return 0;
+	if ( Local.ss_family == AF_INET )
+		return bIPv4;
+	if ( !bIPv4 )
+		return 1;
+	int32 V6Only = 1;
+	socklen_t OptSize = sizeof(V6Only);
+	return (getsockopt( Socket.Socket, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&V6Only, &OptSize) == 0) && !V6Only;
+}
+
+//
+// Waits until any of the sockets has data, or any in WriteMask (bit per
+// socket) has room in its send buffer, up to the given time.
+// Returns the writable sockets in WriteMask.
+//
+UBOOL WaitReadable( TArray<CSocket>& Sockets, double Seconds, uint32& WriteMask)
+{
+#ifdef _WIN32
+	fd_set Readable, Writable;
+	FD_ZERO( &Readable);
+	FD_ZERO( &Writable);
+	for ( int32 s=0; s<Sockets.Num(); s++)
+	{
+		FD_SET( Sockets(s).Socket, &Readable);
+		if ( WriteMask & (1 << s) )
+			FD_SET( Sockets(s).Socket, &Writable);
+	}
+	timeval Timeout;
+	Timeout.tv_sec = (long)Seconds;
+	Timeout.tv_usec = (long)((Seconds - (double)Timeout.tv_sec) * 1000000.0);
+	int32 Result = select( 0, &Readable, WriteMask ? &Writable : nullptr, nullptr, &Timeout);
+	for ( int32 s=0; s<Sockets.Num(); s++)
+		if ( (Result <= 0) || !FD_ISSET( Sockets(s).Socket, &Writable) )
+			WriteMask &= ~(1 << s);
+	return Result > 0;
+#else
+	pollfd Fds[16];
+	int32 NumFds = Min<int32>( Sockets.Num(), ARRAY_COUNT(Fds));
+	for ( int32 s=0; s<NumFds; s++)
+	{
+		Fds[s].fd = Sockets(s).Socket;
+		Fds[s].events = POLLIN | ((WriteMask & (1 << s)) ? POLLOUT : 0);
+		Fds[s].revents = 0;
+	}
+	int32 Result = poll( Fds, NumFds, appRound( Seconds * 1000.0));
+	WriteMask = 0;
+	for ( int32 s=0; (s<NumFds) && (Result > 0); s++)
+		if ( Fds[s].revents & POLLOUT )
+			WriteMask |= (1 << s);
+	return Result > 0;
+#endif
+}
+
+// Strips the IPv4-mapped prefix from an address or endpoint string.
+FString UnmappedAddress( const ANSICHAR* Address)
+{
+	const ANSICHAR* Prefix = "::ffff:";
+	int32 Skip = 0;
+	if ( Address[0] == '[' )
+		Skip = 1;
+	int32 i;
+	for ( i=0; Prefix[i]; i++)
+		if ( (Address[Skip+i] | 0x20) != (Prefix[i] | 0x20) ) //Case insensitive, ':' is unaffected
+			break;
+	if ( Prefix[i] || !strchr( Address + Skip + i, '.') )
+		return appFromAnsi( Address);
+
+	// Endpoint: [::ffff:a.b.c.d]:port -> a.b.c.d:port
+	FString Result = appFromAnsi( Address + Skip + i);
+	if ( Skip )
+	{
+		int32 Bracket = Result.InStr( TEXT("]"));
+		if ( Bracket != INDEX_NONE )
+			Result = Result.Left( Bracket) + Result.Mid( Bracket + 1);
+	}
+	return Result;
+}
+
 /*----------------------------------------------------------------------------
 	Non-blocking resolver.
 ----------------------------------------------------------------------------*/
@@ -140,15 +576,47 @@ void ResolveExceptionCallback( const char* Message, int MessageFlags)
 	throw Message;
 }
 
+// Resolves both A and AAAA records, IPv6 goes first.
+static bool ResolveDualStack( const char* HostName, IPAddress& Primary, IPAddress& Secondary)
+{
+	addrinfo Hints;
+	appMemzero( &Hints, sizeof(Hints));
+	Hints.ai_family = AF_UNSPEC;
+	Hints.ai_socktype = SOCK_DGRAM;
+
+	addrinfo* Result = nullptr;
+	if ( getaddrinfo( HostName, nullptr, &Hints, &Result) != 0 )
+		return false;
+
+	IPAddress Addr6 = IPAddress::Any;
+	IPAddress Addr4 = IPAddress::Any;
+	for ( addrinfo* It=Result; It; It=It->ai_next )
+	{
+		if ( (It->ai_family != AF_INET6) && (It->ai_family != AF_INET) )
+			continue;
+		IPAddress& Slot = (It->ai_family == AF_INET6) ? Addr6 : Addr4;
+		char Numeric[64];
+		if ( (Slot == IPAddress::Any) && !getnameinfo( It->ai_addr, (socklen_t)It->ai_addrlen, Numeric, sizeof(Numeric), nullptr, 0, NI_NUMERICHOST) )
+			Slot = CSocket::ResolveHostname( Numeric, true);
+	}
+	freeaddrinfo( Result);
+
+	Primary   = (Addr6 != IPAddress::Any) ? Addr6 : Addr4;
+	Secondary = (Addr6 != IPAddress::Any) ? Addr4 : IPAddress::Any;
+	return Primary != IPAddress::Any;
+}
+
 // Resolution thread entrypoint.
 unsigned long ResolveThreadEntry( void* Arg, CThread* Handler)
 {
+	XC_TRACE_SCOPE("Resolve");
 	FResolveInfo* Info = (FResolveInfo*)Arg;
 	CDbg_RegisterCallback( &ResolveExceptionCallback, CACUS_CALLBACK_NET|CACUS_CALLBACK_EXCEPTION, 0);
 	// Awful Java styled code
 	try
 	{
-		Info->Addr = CSocket::ResolveHostname( Info->HostName, false, true);
+		if ( !GIPv6 || !ResolveDualStack( Info->HostName, Info->Addr, Info->AltAddr) )
+			Info->Addr = CSocket::ResolveHostname( Info->HostName, false, true);
 	}
 	catch ( const char* Message )
 	{
@@ -165,6 +633,7 @@ FResolveInfo::FResolveInfo( const TCHAR* InHostName )
 
 	appToAnsiInPlace( HostName, InHostName);
 	Error[0] = '\0';
+	AltAddr = IPAddress::Any;
 
 	Run( &ResolveThreadEntry, this);
 }
@@ -0,0 +1,847 @@
+/*=============================================================================
+	XDP.cpp
+	Author: Fernando Velazquez
+
+	AF_XDP packet path for high population servers.
+	Only built on Linux with XC_AFXDP (make AFXDP=1), Create fails and the
+	driver keeps using its sockets everywhere else.
+
+	Layout:
+	- One AF_XDP socket per RX queue of the interface, each with its own
+	  UMEM of XDP_NUM_FRAMES frames. The first XDP_RING_SIZE circulate
+	  between the fill and RX rings, the rest are TX frames returned by
+	  the completion ring.
+	- XDP program (hand assembled, no libbpf): IPv4 UDP to the game port
+	  and the bound address (any if the socket is bound to 0.0.0.0)
+	  without options or fragments is redirected to the socket of the
+	  receiving queue, everything else is passed to the kernel.
+	- Attached in generic (SKB) mode so it runs on any interface, veth and
+	  loopback included. A bpf_link is used when available (5.9+) so the
+	  program goes away with the process, netlink otherwise.
+	- TX frames are built from the addresses seen on the last packet from
+	  each peer and go out of the queue it arrived on, unknown peers are
+	  sent through the sockets.
+	- The pacer thread sends too, the peer table and TX side are locked.
+=============================================================================*/
+
+#include "XC_IpDrv.h"
+
+#if XC_AFXDP && defined(__linux__)
+
+#include "Cacus/Atomics.h"
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#ifndef AF_XDP
+	#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+	#define SOL_XDP 283
+#endif
+#ifndef BPF_JMP32
+	#define BPF_JMP32 0x06
+#endif
+
+#define XDP_NUM_FRAMES   2048 //Per queue
+#define XDP_FRAME_SIZE   2048
+#define XDP_RING_SIZE    1024
+#define XDP_MAX_QUEUES   16
+#define XDP_PEER_SLOTS   4096 //Power of two
+#define XDP_HEADERS_SIZE 42   //Ethernet + IPv4 + UDP
+#define XDP_TX_BATCH     32   //Kick the kernel after this many queued frames
+
+/*-----------------------------------------------------------------------------
+	Rings.
+	Each side owns one index, the other one is read with acquire semantics.
+-----------------------------------------------------------------------------*/
+
+struct FXDPRing
+{
+	uint32* Producer;
+	uint32* Consumer;
+	void* Descs;
+	void* Map;
+	size_t MapSize;
+	uint32 Cached; //Index owned by this side
+
+	FXDPRing() : Producer(nullptr), Consumer(nullptr), Descs(nullptr), Map(MAP_FAILED), MapSize(0), Cached(0) {}
+	~FXDPRing()
+	{
+		Unmap();
+	}
+
+	void Unmap()
+	{
+		if ( Map != MAP_FAILED )
+			munmap( Map, MapSize);
+		Map = MAP_FAILED;
+	}
+
+	UBOOL Open( int32 Fd, const xdp_ring_offset& Offsets, size_t DescSize, uint64 PageOffset)
+	{
+		MapSize = Offsets.desc + XDP_RING_SIZE * DescSize;
+		Map = mmap64( nullptr, MapSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, Fd, (off64_t)PageOffset);
+		if ( Map == MAP_FAILED )
+			return 0;
+		Producer = (uint32*)((uint8*)Map + Offsets.producer);
+		Consumer = (uint32*)((uint8*)Map + Offsets.consumer);
+		Descs = (uint8*)Map + Offsets.desc;
+		return 1;
+	}
+
+	static uint32 Load( uint32* Index)             { return __atomic_load_n( Index, __ATOMIC_ACQUIRE); }
+	static void Store( uint32* Index, uint32 Value) { __atomic_store_n( Index, Value, __ATOMIC_RELEASE); }
+
+	uint64& Addr( uint32 i)    { return ((uint64*)Descs)[i & (XDP_RING_SIZE-1)]; }
+	xdp_desc& Desc( uint32 i)  { return ((xdp_desc*)Descs)[i & (XDP_RING_SIZE-1)]; }
+};
+
+//
+// Addresses needed to answer a peer, learned from its last packet.
+//
+struct FXDPPeer
+{
+	IPEndpoint Endpoint;
+	uint8 RemoteMac[6];
+	uint8 LocalMac[6];
+	uint8 RemoteIP[4];
+	uint8 LocalIP[4];
+	uint8 RemotePort[2]; //Network order
+	uint8 Queue;
+	uint8 bUsed;
+};
+
+//
+// AF_XDP socket bound to one RX queue.
+//
+struct FXDPQueue
+{
+	int32 XskFd;
+	uint8* Umem;
+	size_t UmemSize;
+	FXDPRing Rx, Tx, Fill, Comp;
+	uint64 FreeFrames[XDP_NUM_FRAMES];
+	int32 NumFree;
+	int32 TxUnkicked;
+
+	FXDPQueue()
+		: XskFd(-1), Umem((uint8*)MAP_FAILED), UmemSize(0), NumFree(0), TxUnkicked(0)
+	{}
+	~FXDPQueue()
+	{
+		// Rings are unmapped before the socket goes.
+		Rx.Unmap();
+		Tx.Unmap();
+		Fill.Unmap();
+		Comp.Unmap();
+		if ( XskFd >= 0 )
+			close( XskFd);
+		if ( Umem != MAP_FAILED )
+			munmap( Umem, UmemSize);
+	}
+
+	UBOOL Open( uint32 IfIndex, uint32 QueueId, FString& Error);
+
+	void Kick()
+	{
+		if ( TxUnkicked )
+		{
+			sendto( XskFd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+			TxUnkicked = 0;
+		}
+	}
+
+	// Sent frames come back through the completion ring.
+	void Reclaim()
+	{
+		uint32 Produced = FXDPRing::Load( Comp.Producer);
+		if ( Comp.Cached == Produced )
+			return;
+		while ( Comp.Cached != Produced )
+			FreeFrames[NumFree++] = Comp.Addr( Comp.Cached++);
+		FXDPRing::Store( Comp.Consumer, Comp.Cached);
+	}
+
+	UBOOL TxFull()
+	{
+		return !NumFree || (Tx.Cached - FXDPRing::Load( Tx.Consumer) >= XDP_RING_SIZE);
+	}
+};
+
+struct FXDPState
+{
+	int32 MapFd;
+	int32 ProgFd;
+	int32 LinkFd; //-1 if attached through netlink
+	int32 IfIndex;
+	uint16 Port;
+	uint32 BindAddress; //Network order, 0 = any
+	uint16 IPId;
+	int32 NumQueues;
+	int32 NextQueue; //Recv starts here so no queue starves the others
+	FXDPQueue* Queues[XDP_MAX_QUEUES];
+	volatile int32 Lock; //Peers and the TX side
+	FXDPPeer Peers[XDP_PEER_SLOTS];
+
+	FXDPState()
+		: MapFd(-1), ProgFd(-1), LinkFd(-1), IfIndex(0), Port(0), BindAddress(0), IPId(0)
+		, NumQueues(0), NextQueue(0), Lock(0)
+	{
+		for ( int32 i=0; i<XDP_PEER_SLOTS; i++)
+			Peers[i].bUsed = 0;
+	}
+	~FXDPState()
+	{
+		for ( int32 i=0; i<NumQueues; i++)
+			delete Queues[i];
+	}
+
+	FXDPPeer& Peer( const IPEndpoint& Endpoint)
+	{
+		return Peers[(appMemCrc( &Endpoint.Address, sizeof(IPAddress)) ^ Endpoint.Port) & (XDP_PEER_SLOTS-1)];
+	}
+};
+
+/*-----------------------------------------------------------------------------
+	BPF.
+-----------------------------------------------------------------------------*/
+
+static int32 BpfCall( int32 Cmd, bpf_attr& Attr)
+{
+	return (int32)syscall( __NR_bpf, Cmd, &Attr, sizeof(Attr));
+}
+
+static bpf_insn Insn( uint8 Code, uint8 Dst, uint8 Src, int32 Off, int32 Imm)
+{
+	bpf_insn Result;
+	Result.code = Code;
+	Result.dst_reg = Dst;
+	Result.src_reg = Src;
+	Result.off = (__s16)Off;
+	Result.imm = Imm;
+	return Result;
+}
+
+static FString ErrnoText( const TCHAR* What)
+{
+	return FString::Printf( TEXT("%s failed (%s)"), What, appFromAnsi( strerror( errno)) );
+}
+
+//
+// Redirects IPv4 UDP packets for Address:Port into the XSKMAP, passes the rest.
+// Address is in network order, 0 masks the destination check out.
+// r6 = ctx, r2 = data, r3 = data_end
+//
+static int32 LoadProgram( int32 MapFd, uint32 Address, uint16 Port, FString& Error)
+{
+	const int32 Pass = 26;
+	bpf_insn Program[] =
+	{
+		/* 0*/ Insn( BPF_ALU64|BPF_MOV|BPF_X,  6, 1, 0, 0),
+		/* 1*/ Insn( BPF_LDX|BPF_W|BPF_MEM,    2, 6, 0, 0),                     //xdp_md.data
+		/* 2*/ Insn( BPF_LDX|BPF_W|BPF_MEM,    3, 6, 4, 0),                     //xdp_md.data_end
+		/* 3*/ Insn( BPF_ALU64|BPF_MOV|BPF_X,  4, 2, 0, 0),
+		/* 4*/ Insn( BPF_ALU64|BPF_ADD|BPF_K,  4, 0, 0, XDP_HEADERS_SIZE),
+		/* 5*/ Insn( BPF_JMP|BPF_JGT|BPF_X,    4, 3, Pass-6, 0),                //Too short
+		/* 6*/ Insn( BPF_LDX|BPF_H|BPF_MEM,    5, 2, 12, 0),
+		/* 7*/ Insn( BPF_JMP|BPF_JNE|BPF_K,    5, 0, Pass-8, htons(0x0800)),    //IPv4
+		/* 8*/ Insn( BPF_LDX|BPF_B|BPF_MEM,    5, 2, 14, 0),
+		/* 9*/ Insn( BPF_JMP|BPF_JNE|BPF_K,    5, 0, Pass-10, 0x45),            //No options
+		/*10*/ Insn( BPF_LDX|BPF_B|BPF_MEM,    5, 2, 23, 0),
+		/*11*/ Insn( BPF_JMP|BPF_JNE|BPF_K,    5, 0, Pass-12, IPPROTO_UDP),
+		/*12*/ Insn( BPF_LDX|BPF_H|BPF_MEM,    5, 2, 20, 0),
+		/*13*/ Insn( BPF_ALU64|BPF_AND|BPF_K,  5, 0, 0, htons(0x3FFF)),
+		/*14*/ Insn( BPF_JMP|BPF_JNE|BPF_K,    5, 0, Pass-15, 0),               //Fragment
+		/*15*/ Insn( BPF_LDX|BPF_W|BPF_MEM,    5, 2, 30, 0),
+		/*16*/ Insn( BPF_ALU64|BPF_AND|BPF_K,  5, 0, 0, Address ? -1 : 0),
+		/*17*/ Insn( BPF_JMP32|BPF_JNE|BPF_K,  5, 0, Pass-18, (int32)Address), //Bound address
+		/*18*/ Insn( BPF_LDX|BPF_H|BPF_MEM,    5, 2, 36, 0),
+		/*19*/ Insn( BPF_JMP|BPF_JNE|BPF_K,    5, 0, Pass-20, htons(Port)),     //Game port
+		/*20*/ Insn( BPF_LDX|BPF_W|BPF_MEM,    2, 6, 16, 0),                    //xdp_md.rx_queue_index
+		/*21*/ Insn( BPF_LD|BPF_DW|BPF_IMM,    1, BPF_PSEUDO_MAP_FD, 0, MapFd),
+		/*22*/ Insn( 0, 0, 0, 0, 0),
+		/*23*/ Insn( BPF_ALU64|BPF_MOV|BPF_K,  3, 0, 0, XDP_PASS),              //No socket on this queue
+		/*24*/ Insn( BPF_JMP|BPF_CALL,         0, 0, 0, BPF_FUNC_redirect_map),
+		/*25*/ Insn( BPF_JMP|BPF_EXIT,         0, 0, 0, 0),
+		/*26*/ Insn( BPF_ALU64|BPF_MOV|BPF_K,  0, 0, 0, XDP_PASS),
+		/*27*/ Insn( BPF_JMP|BPF_EXIT,         0, 0, 0, 0),
+	};
+	static const char License[] = "Dual BSD/GPL";
+
+	bpf_attr Attr;
+	appMemzero( &Attr, sizeof(Attr));
+	Attr.prog_type = BPF_PROG_TYPE_XDP;
+	Attr.insns     = (uint64)(uintptr_t)Program;
+	Attr.insn_cnt  = ARRAY_COUNT(Program);
+	Attr.license   = (uint64)(uintptr_t)License;
+	int32 Fd = BpfCall( BPF_PROG_LOAD, Attr);
+	if ( Fd >= 0 )
+		return Fd;
+
+	// Load again with the verifier log to report why.
+	Error = ErrnoText( TEXT("BPF_PROG_LOAD"));
+	static char Log[8192];
+	Log[0] = '\0';
+	Attr.log_buf   = (uint64)(uintptr_t)Log;
+	Attr.log_size  = sizeof(Log);
+	Attr.log_level = 1;
+	Fd = BpfCall( BPF_PROG_LOAD, Attr);
+	if ( Fd >= 0 )
+		return Fd;
+	if ( Log[0] )
+	{
+		char* LastLine = Log + strlen(Log);
+		while ( (LastLine > Log) && (LastLine[-1] == '\n') )
+			*--LastLine = '\0';
+		while ( (LastLine > Log) && (LastLine[-1] != '\n') )
+			LastLine--;
+		Error += FString::Printf( TEXT(": %s"), appFromAnsi( LastLine));
+	}
+	return -1;
+}
+
+//
+// Attaches (ProgFd >= 0) or detaches (ProgFd = -1) the generic XDP program through rtnetlink.
+//
+static UBOOL SetLinkXdp( int32 IfIndex, int32 ProgFd, uint32 Flags, FString& Error)
+{
+	int32 Fd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if ( Fd < 0 )
+	{
+		Error = ErrnoText( TEXT("netlink socket"));
+		return 0;
+	}
+
+	struct
+	{
+		nlmsghdr Header;
+		ifinfomsg Info;
+		uint8 Attributes[64];
+	} Request;
+	appMemzero( &Request, sizeof(Request));
+	Request.Header.nlmsg_len   = NLMSG_LENGTH( sizeof(ifinfomsg));
+	Request.Header.nlmsg_type  = RTM_SETLINK;
+	Request.Header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	Request.Header.nlmsg_seq   = 1;
+	Request.Info.ifi_family    = AF_UNSPEC;
+	Request.Info.ifi_index     = IfIndex;
+
+	nlattr* Xdp = (nlattr*)((uint8*)&Request + NLMSG_ALIGN(Request.Header.nlmsg_len));
+	Xdp->nla_type = NLA_F_NESTED | IFLA_XDP;
+	Xdp->nla_len  = NLA_HDRLEN;
+
+	nlattr* Attr = (nlattr*)((uint8*)Xdp + Xdp->nla_len);
+	Attr->nla_type = IFLA_XDP_FD;
+	Attr->nla_len  = NLA_HDRLEN + sizeof(int32);
+	*(int32*)((uint8*)Attr + NLA_HDRLEN) = ProgFd;
+	Xdp->nla_len += NLA_ALIGN(Attr->nla_len);
+
+	Attr = (nlattr*)((uint8*)Xdp + Xdp->nla_len);
+	Attr->nla_type = IFLA_XDP_FLAGS;
+	Attr->nla_len  = NLA_HDRLEN + sizeof(uint32);
+	*(uint32*)((uint8*)Attr + NLA_HDRLEN) = Flags;
+	Xdp->nla_len += NLA_ALIGN(Attr->nla_len);
+	Request.Header.nlmsg_len += NLA_ALIGN(Xdp->nla_len);
+
+	UBOOL bResult = 0;
+	uint8 Reply[512];
+	if ( send( Fd, &Request, Request.Header.nlmsg_len, 0) < 0 )
+		Error = ErrnoText( TEXT("RTM_SETLINK"));
+	else
+	{
+		int32 Len = (int32)recv( Fd, Reply, sizeof(Reply), 0);
+		nlmsghdr* Msg = (nlmsghdr*)Reply;
+		if ( (Len < 0) || !NLMSG_OK(Msg,(uint32)Len) || (Msg->nlmsg_type != NLMSG_ERROR) )
+			Error = TEXT("RTM_SETLINK: no acknowledgement");
+		else if ( ((nlmsgerr*)NLMSG_DATA(Msg))->error )
+		{
+			errno = -((nlmsgerr*)NLMSG_DATA(Msg))->error;
+			Error = ErrnoText( TEXT("RTM_SETLINK"));
+		}
+		else
+			bResult = 1;
+	}
+	close( Fd);
+	return bResult;
+}
+
+/*-----------------------------------------------------------------------------
+	FXDPQueue.
+-----------------------------------------------------------------------------*/
+
+UBOOL FXDPQueue::Open( uint32 IfIndex, uint32 QueueId, FString& Error)
+{
+	XskFd = socket( AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if ( XskFd < 0 )
+	{
+		Error = ErrnoText( TEXT("AF_XDP socket"));
+		return 0;
+	}
+	UmemSize = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+	Umem = (uint8*)mmap( nullptr, UmemSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	xdp_umem_reg UmemReg;
+	appMemzero( &UmemReg, sizeof(UmemReg));
+	UmemReg.addr       = (uint64)(uintptr_t)Umem;
+	UmemReg.len        = UmemSize;
+	UmemReg.chunk_size = XDP_FRAME_SIZE;
+	int32 RingSize = XDP_RING_SIZE;
+	xdp_mmap_offsets Offsets;
+	socklen_t OffsetsSize = sizeof(Offsets);
+	if ( (Umem == MAP_FAILED)
+		|| setsockopt( XskFd, SOL_XDP, XDP_UMEM_REG, &UmemReg, sizeof(UmemReg))
+		|| setsockopt( XskFd, SOL_XDP, XDP_UMEM_FILL_RING, &RingSize, sizeof(RingSize))
+		|| setsockopt( XskFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &RingSize, sizeof(RingSize))
+		|| setsockopt( XskFd, SOL_XDP, XDP_RX_RING, &RingSize, sizeof(RingSize))
+		|| setsockopt( XskFd, SOL_XDP, XDP_TX_RING, &RingSize, sizeof(RingSize))
+		|| getsockopt( XskFd, SOL_XDP, XDP_MMAP_OFFSETS, &Offsets, &OffsetsSize)
+		|| !Rx.Open( XskFd, Offsets.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING)
+		|| !Tx.Open( XskFd, Offsets.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING)
+		|| !Fill.Open( XskFd, Offsets.fr, sizeof(uint64), XDP_UMEM_PGOFF_FILL_RING)
+		|| !Comp.Open( XskFd, Offsets.cr, sizeof(uint64), XDP_UMEM_PGOFF_COMPLETION_RING) )
+	{
+		Error = ErrnoText( TEXT("UMEM setup"));
+		return 0;
+	}
+
+	// RX frames go to the fill ring, the rest are for TX.
+	for ( uint32 i=0; i<XDP_RING_SIZE; i++)
+		Fill.Addr( Fill.Cached++) = (uint64)i * XDP_FRAME_SIZE;
+	FXDPRing::Store( Fill.Producer, Fill.Cached);
+	for ( uint32 i=XDP_RING_SIZE; i<XDP_NUM_FRAMES; i++)
+		FreeFrames[NumFree++] = (uint64)i * XDP_FRAME_SIZE;
+
+	// Copy mode is what generic XDP supports.
+	sockaddr_xdp Addr;
+	appMemzero( &Addr, sizeof(Addr));
+	Addr.sxdp_family   = AF_XDP;
+	Addr.sxdp_ifindex  = IfIndex;
+	Addr.sxdp_queue_id = QueueId;
+	Addr.sxdp_flags    = XDP_COPY;
+	if ( bind( XskFd, (sockaddr*)&Addr, sizeof(Addr)) )
+	{
+		Error = ErrnoText( TEXT("AF_XDP bind"));
+		return 0;
+	}
+	return 1;
+}
+
+//
+// RX queues the kernel spreads the interface's traffic over.
+//
+static int32 CountRxQueues( const ANSICHAR* Interface)
+{
+	char Path[128];
+	snprintf( Path, sizeof(Path), "/sys/class/net/%s/queues", Interface);
+	DIR* Dir = opendir( Path);
+	if ( !Dir )
+		return 1;
+	int32 Count = 0;
+	while ( dirent* Entry = readdir( Dir) )
+		if ( !strncmp( Entry->d_name, "rx-", 3) )
+			Count++;
+	closedir( Dir);
+	return Max( Count, 1);
+}
+
+//
+// IPv4 address the driver's socket is bound to, network order.
+//
+static UBOOL GetBindAddress( CSocket& Socket, uint32& Address, FString& Error)
+{
+	sockaddr_storage Local;
+	socklen_t LocalSize = sizeof(Local);
+	if ( getsockname( Socket.Socket, (sockaddr*)&Local, &LocalSize) )
+	{
+		Error = ErrnoText( TEXT("getsockname"));
+		return 0;
+	}
+	if ( Local.ss_family == AF_INET )
+	{
+		Address = ((sockaddr_in*)&Local)->sin_addr.s_addr;
+		return 1;
+	}
+	const in6_addr& Addr6 = ((sockaddr_in6*)&Local)->sin6_addr;
+	if ( IN6_IS_ADDR_UNSPECIFIED( &Addr6) ) //Dual stack
+	{
+		Address = 0;
+		return 1;
+	}
+	if ( IN6_IS_ADDR_V4MAPPED( &Addr6) )
+	{
+		appMemcpy( &Address, &Addr6.s6_addr[12], 4);
+		return 1;
+	}
+	Error = TEXT("game socket isn't bound to an IPv4 address");
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+	FXDPSocket.
+-----------------------------------------------------------------------------*/
+
+FXDPSocket::FXDPSocket()
+	: PacketsRecv(0)
+	, PacketsSent(0)
+	, SendFallbacks(0)
+	, TxFull(0)
+	, State(new FXDPState())
+{}
+
+FXDPSocket::~FXDPSocket()
+{
+	FXDPState& S = *State;
+	if ( S.LinkFd >= 0 )
+		close( S.LinkFd);
+	else if ( S.ProgFd >= 0 )
+	{
+		FString Error;
+		if ( !SetLinkXdp( S.IfIndex, -1, XDP_FLAGS_SKB_MODE, Error) )
+			debugf( NAME_DevNet, TEXT("AF_XDP: unable to detach program: %s"), *Error);
+	}
+	if ( S.ProgFd >= 0 )
+		close( S.ProgFd);
+	if ( S.MapFd >= 0 )
+		close( S.MapFd);
+	delete State; //Closes the queues
+}
+
+FXDPSocket* FXDPSocket::Create( const TCHAR* Interface, int32 Port, CSocket& Socket, FString& Error)
+{
+	guard(FXDPSocket::Create);
+	uint32 IfIndex = if_nametoindex( appToAnsi(Interface));
+	if ( !IfIndex )
+	{
+		Error = FString::Printf( TEXT("unknown interface '%s'"), Interface);
+		return nullptr;
+	}
+
+	// Every queue needs a socket, or its share of the game traffic would take the slow path.
+	int32 NumQueues = CountRxQueues( appToAnsi(Interface));
+	if ( NumQueues > XDP_MAX_QUEUES )
+	{
+		Error = FString::Printf( TEXT("'%s' has %i RX queues, at most %i are supported (ethtool -L %s combined %i)"), Interface, NumQueues, XDP_MAX_QUEUES, Interface, XDP_MAX_QUEUES);
+		return nullptr;
+	}
+
+	FXDPSocket* Result = new FXDPSocket();
+	FXDPState& S = *Result->State;
+	S.IfIndex = (int32)IfIndex;
+	S.Port = (uint16)Port;
+	if ( !GetBindAddress( Socket, S.BindAddress, Error) )
+	{
+		delete Result;
+		return nullptr;
+	}
+
+	// Queue -> socket map.
+	bpf_attr Attr;
+	appMemzero( &Attr, sizeof(Attr));
+	Attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+	Attr.key_size    = sizeof(uint32);
+	Attr.value_size  = sizeof(uint32);
+	Attr.max_entries = XDP_MAX_QUEUES;
+	S.MapFd = BpfCall( BPF_MAP_CREATE, Attr);
+	if ( S.MapFd < 0 )
+	{
+		Error = ErrnoText( TEXT("XSKMAP create"));
+		delete Result;
+		return nullptr;
+	}
+	for ( uint32 Queue=0; Queue<(uint32)NumQueues; Queue++)
+	{
+		FXDPQueue* Q = new FXDPQueue();
+		S.Queues[S.NumQueues++] = Q;
+		if ( !Q->Open( IfIndex, Queue, Error) )
+		{
+			Error = FString::Printf( TEXT("queue %i: %s"), Queue, *Error);
+			delete Result;
+			return nullptr;
+		}
+		uint32 XskFd = (uint32)Q->XskFd;
+		appMemzero( &Attr, sizeof(Attr));
+		Attr.map_fd = S.MapFd;
+		Attr.key    = (uint64)(uintptr_t)&Queue;
+		Attr.value  = (uint64)(uintptr_t)&XskFd;
+		Attr.flags  = BPF_ANY;
+		if ( BpfCall( BPF_MAP_UPDATE_ELEM, Attr) )
+		{
+			Error = ErrnoText( TEXT("XSKMAP update"));
+			delete Result;
+			return nullptr;
+		}
+	}
+	S.ProgFd = LoadProgram( S.MapFd, S.BindAddress, S.Port, Error);
+	if ( S.ProgFd < 0 )
+	{
+		delete Result;
+		return nullptr;
+	}
+
+	// Generic mode, never replace a program someone else attached.
+	appMemzero( &Attr, sizeof(Attr));
+	Attr.link_create.prog_fd        = S.ProgFd;
+	Attr.link_create.target_ifindex = IfIndex;
+	Attr.link_create.attach_type    = BPF_XDP;
+	Attr.link_create.flags          = XDP_FLAGS_SKB_MODE;
+	S.LinkFd = BpfCall( BPF_LINK_CREATE, Attr);
+	if ( (S.LinkFd < 0) && !SetLinkXdp( S.IfIndex, S.ProgFd, XDP_FLAGS_SKB_MODE | XDP_FLAGS_UPDATE_IF_NOEXIST, Error) )
+	{
+		S.ProgFd = (close( S.ProgFd), -1); //Nothing to detach
+		delete Result;
+		return nullptr;
+	}
+	return Result;
+	unguard;
+}
+
+int32 FXDPSocket::NumQueues() const
+{
+	return State->NumQueues;
+}
+
+//
+// Copies the next redirected datagram out of the UMEM and gives the frame back.
+//
+int32 FXDPSocket::Recv( uint8* Data, int32 MaxSize, IPEndpoint& Endpoint)
+{
+	FXDPState& S = *State;
+	for ( int32 q=0; q<S.NumQueues; q++)
+	{
+		int32 QueueIndex = S.NextQueue;
+		FXDPQueue& Q = *S.Queues[QueueIndex];
+		S.NextQueue = (S.NextQueue + 1) % S.NumQueues;
+		uint32 Produced = FXDPRing::Load( Q.Rx.Producer);
+		while ( Q.Rx.Cached != Produced )
+		{
+			xdp_desc Desc = Q.Rx.Desc( Q.Rx.Cached++);
+			const uint8* Frame = Q.Umem + Desc.addr;
+			int32 Size = -1;
+			if ( Desc.len >= XDP_HEADERS_SIZE )
+			{
+				int32 UdpSize = (Frame[38] << 8) | Frame[39];
+				Size = UdpSize - 8;
+				if ( (Size < 0) || (Size > MaxSize) || (XDP_HEADERS_SIZE + Size > (int32)Desc.len) )
+					Size = -1;
+			}
+			if ( Size >= 0 )
+			{
+				appMemcpy( Data, Frame + XDP_HEADERS_SIZE, Size);
+				Endpoint = IPEndpoint( IPAddress( Frame[26], Frame[27], Frame[28], Frame[29]), (Frame[34] << 8) | Frame[35]);
+				CSpinLock SL(&S.Lock);
+				FXDPPeer& Peer = S.Peer( Endpoint);
+				Peer.Endpoint = Endpoint;
+				appMemcpy( Peer.RemoteMac, Frame + 6, 6);
+				appMemcpy( Peer.LocalMac, Frame, 6);
+				appMemcpy( Peer.RemoteIP, Frame + 26, 4);
+				appMemcpy( Peer.LocalIP, Frame + 30, 4);
+				appMemcpy( Peer.RemotePort, Frame + 34, 2);
+				Peer.Queue = (uint8)QueueIndex;
+				Peer.bUsed = 1;
+			}
+
+			// Fill ring has room for every RX frame.
+			Q.Fill.Addr( Q.Fill.Cached++) = Desc.addr & ~(uint64)(XDP_FRAME_SIZE-1);
+			FXDPRing::Store( Q.Fill.Producer, Q.Fill.Cached);
+			FXDPRing::Store( Q.Rx.Consumer, Q.Rx.Cached);
+			if ( Size >= 0 )
+			{
+				PacketsRecv++;
+				return Size;
+			}
+		}
+	}
+	return -1;
+}
+
+//
+// Game and pacer threads.
+//
+UBOOL FXDPSocket::Send( const IPEndpoint& Endpoint, const uint8* Data, int32 Count, UBOOL& bFull)
+{
+	FXDPState& S = *State;
+	CSpinLock SL(&S.Lock);
+	FXDPPeer& Peer = S.Peer( Endpoint);
+	if ( !Peer.bUsed || !(Peer.Endpoint == Endpoint) || (Count > XDP_FRAME_SIZE - XDP_HEADERS_SIZE) )
+	{
+		SendFallbacks++;
+		return 0;
+	}
+
+	// Sockets would overtake the frames still in the ring, wait for room instead.
+	FXDPQueue& Q = *S.Queues[Peer.Queue];
+	Q.Reclaim();
+	if ( Q.TxFull() )
+	{
+		Q.Kick();
+		Q.Reclaim();
+		if ( Q.TxFull() )
+		{
+			TxFull++;
+			bFull = 1;
+			return 0;
+		}
+	}
+
+	uint64 Addr = Q.FreeFrames[--Q.NumFree];
+	uint8* Frame = Q.Umem + Addr;
+	appMemcpy( Frame, Peer.RemoteMac, 6);
+	appMemcpy( Frame + 6, Peer.LocalMac, 6);
+	Frame[12] = 0x08;
+	Frame[13] = 0x00;
+
+	uint8* IP = Frame + 14;
+	int32 TotalSize = 20 + 8 + Count;
+	IP[0]  = 0x45;
+	IP[1]  = 0;
+	IP[2]  = (uint8)(TotalSize >> 8);
+	IP[3]  = (uint8)TotalSize;
+	IP[4]  = (uint8)(S.IPId >> 8);
+	IP[5]  = (uint8)S.IPId;
+	IP[6]  = 0x40; //Don't fragment
+	IP[7]  = 0;
+	IP[8]  = 64;
+	IP[9]  = IPPROTO_UDP;
+	IP[10] = 0;
+	IP[11] = 0;
+	appMemcpy( IP + 12, Peer.LocalIP, 4);
+	appMemcpy( IP + 16, Peer.RemoteIP, 4);
+	S.IPId++;
+	uint32 Sum = 0;
+	for ( int32 i=0; i<20; i+=2)
+		Sum += (IP[i] << 8) | IP[i+1];
+	while ( Sum >> 16 )
+		Sum = (Sum & 0xFFFF) + (Sum >> 16);
+	Sum = ~Sum & 0xFFFF;
+	IP[10] = (uint8)(Sum >> 8);
+	IP[11] = (uint8)Sum;
+
+	uint8* UDP = IP + 20;
+	int32 UdpSize = 8 + Count;
+	UDP[0] = (uint8)(S.Port >> 8);
+	UDP[1] = (uint8)S.Port;
+	UDP[2] = Peer.RemotePort[0];
+	UDP[3] = Peer.RemotePort[1];
+	UDP[4] = (uint8)(UdpSize >> 8);
+	UDP[5] = (uint8)UdpSize;
+	UDP[6] = 0; //No checksum, allowed on IPv4
+	UDP[7] = 0;
+	appMemcpy( UDP + 8, Data, Count);
+
+	xdp_desc& Desc = Q.Tx.Desc( Q.Tx.Cached++);
+	Desc.addr    = Addr;
+	Desc.len     = XDP_HEADERS_SIZE + Count;
+	Desc.options = 0;
+	FXDPRing::Store( Q.Tx.Producer, Q.Tx.Cached);
+	if ( ++Q.TxUnkicked >= XDP_TX_BATCH )
+		Q.Kick();
+	PacketsSent++;
+	return 1;
+}
+
+//
+// Copy mode only transmits when asked to.
+//
+void FXDPSocket::Flush()
+{
+	FXDPState& S = *State;
+	CSpinLock SL(&S.Lock);
+	for ( int32 q=0; q<S.NumQueues; q++)
+		S.Queues[q]->Kick();
+}
+
+//
+// Waits for data on the AF_XDP sockets or any of the driver's sockets,
+// or for room on the sockets in WriteMask (see WaitReadable).
+// Sends blocked on a full TX ring are retried once any ring has room again.
+//
+UBOOL FXDPSocket::Wait( double Seconds, TArray<CSocket>& Sockets, uint32& WriteMask)
+{
+	FXDPState& S = *State;
+	pollfd Fds[XDP_MAX_QUEUES + 16];
+	int32 NumFds = 0;
+	for ( int32 q=0; q<S.NumQueues; q++)
+	{
+		FXDPQueue& Q = *S.Queues[q];
+		if ( Q.Rx.Cached != FXDPRing::Load( Q.Rx.Producer) )
+		{
+			WriteMask = 0;
+			return 1;
+		}
+		Fds[NumFds].fd = Q.XskFd;
+		Fds[NumFds++].events = POLLIN | (WriteMask ? POLLOUT : 0);
+	}
+	for ( int32 s=0; (s<Sockets.Num()) && (NumFds < (int32)ARRAY_COUNT(Fds)); s++)
+	{
+		Fds[NumFds].fd = Sockets(s).Socket;
+		Fds[NumFds++].events = POLLIN | ((WriteMask & (1 << s)) ? POLLOUT : 0);
+	}
+	for ( int32 i=0; i<NumFds; i++)
+		Fds[i].revents = 0;
+	int32 Result = poll( Fds, NumFds, appRound( Max( Seconds, 0.0) * 1000.0));
+	uint32 Pending = WriteMask;
+	WriteMask = 0;
+	for ( int32 i=0; (i<NumFds) && (Result > 0); i++)
+		if ( Fds[i].revents & POLLOUT )
+			WriteMask |= (i < S.NumQueues) ? Pending : (1 << (i - S.NumQueues));
+	return Result > 0;
+}
+
+#else
+
+FXDPSocket::FXDPSocket()
+	: PacketsRecv(0)
+	, PacketsSent(0)
+	, SendFallbacks(0)
+	, TxFull(0)
+	, State(nullptr)
+{}
+
+FXDPSocket::~FXDPSocket()
+{}
+
+FXDPSocket* FXDPSocket::Create( const TCHAR* Interface, int32 Port, CSocket& Socket, FString& Error)
+{
+	Error = TEXT("not built with AF_XDP support (Linux, make AFXDP=1)");
+	return nullptr;
+}
+
+int32 FXDPSocket::Recv( uint8* Data, int32 MaxSize, IPEndpoint& Endpoint)
+{
+	return -1;
+}
+
+int32 FXDPSocket::NumQueues() const
+{
+	return 0;
+}
+
+UBOOL FXDPSocket::Send( const IPEndpoint& Endpoint, const uint8* Data, int32 Count, UBOOL& bFull)
+{
+	return 0;
+}
+
+void FXDPSocket::Flush()
+{}
+
+UBOOL FXDPSocket::Wait( double Seconds, TArray<CSocket>& Sockets, uint32& WriteMask)
+{
+	WriteMask = 0;
+	return 0;
+}
+
+#endif